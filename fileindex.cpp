@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+//############################################################################
+//##                                                                        ##
+//##  FILEINDEX.CPP                                                         ##
+//##                                                                        ##
+//##  Answers "does this file exist" from a listing of its directory tree   ##
+//##  made once, instead of asking the file system every time.              ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include "fileindex.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+
+// '/' separated, and without case where the file system has none.
+String FileIndex::GetKey(const char *path)
+{
+  String key = path;
+  for (size_t i=0; i<key.size(); i++)
+  {
+    if ( key[i] == '\\' ) key[i] = '/';
+#ifdef _WIN32
+    key[i] = (char)tolower((unsigned char)key[i]);
+#endif
+  }
+  return key;
+}
+
+#ifdef _WIN32
+
+void FileIndex::ReadTree(const String &dir)
+{
+  WIN32_FIND_DATAA found;
+  String pattern = dir + "*";
+  HANDLE find = FindFirstFileA(pattern.c_str(),&found);
+  if ( find == INVALID_HANDLE_VALUE ) return;
+  do
+  {
+    if ( strcmp(found.cFileName,".") == 0 || strcmp(found.cFileName,"..") == 0 ) continue;
+    String path = dir + found.cFileName;
+    // junctions and links to directories can lead back up the tree.
+    if ( found.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT ) continue;
+    if ( found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+      ReadTree(path + "/");
+    else
+      mFiles.insert(GetKey(path.c_str()));
+  } while ( FindNextFileA(find,&found) );
+  FindClose(find);
+}
+
+#else
+
+void FileIndex::ReadTree(const String &dir)
+{
+  // links to directories are followed, a directory reached twice (a link
+  // back up the tree) is listed once.
+  struct stat st;
+  if ( stat(dir.c_str(),&st) != 0 ) return;
+  if ( !mDirsRead.insert(std::make_pair((unsigned long long)st.st_dev,
+                                        (unsigned long long)st.st_ino)).second )
+    return;
+
+  DIR *d = opendir(dir.c_str());
+  if ( !d ) return;
+  while ( struct dirent *entry = readdir(d) )
+  {
+    if ( strcmp(entry->d_name,".") == 0 || strcmp(entry->d_name,"..") == 0 ) continue;
+    String path = dir + entry->d_name;
+
+    bool isDir = entry->d_type == DT_DIR;
+    if ( entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK )
+    {
+      struct stat st;
+      isDir = stat(path.c_str(),&st) == 0 && S_ISDIR(st.st_mode);
+    }
+
+    if ( isDir )
+      ReadTree(path + "/");
+    else
+      mFiles.insert(GetKey(path.c_str()));
+  }
+  closedir(d);
+}
+
+#endif
+
+// the first directory of a key, empty for paths checked on disk: without a
+// directory, absolute, or through "." or "..", whose trees can be anything
+// up to the whole disk.
+static String GetRoot(const String &key)
+{
+  size_t slash = key.find('/');
+  if ( slash == String::npos || slash == 0 ) return String();
+  String root = key.substr(0,slash);
+  if ( root == "." || root == ".." || root.find(':') != String::npos ) return String();
+  return key.substr(0,slash+1);
+}
+
+bool FileIndex::Exists(const char *path)
+{
+  String key = GetKey(path);
+  String root = GetRoot(key);
+  if ( root.empty() )
+  {
+    FILE *f = fopen(path,"rb");
+    if ( !f ) return false;
+    fclose(f);
+    return true;
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  if ( mRoots.insert(root).second )
+  {
+    ReadTree(String(path,root.size()));
+  }
+  return mFiles.count(key) != 0;
+}
+
+void FileIndex::List(const char *dir,const char *ext,StringVector &files)
+{
+  String prefix = GetKey(dir);
+  String suffix = GetKey(ext);
+  files.clear();
+
+  String root = GetRoot(prefix);
+  if ( root.empty() ) return;
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  if ( mRoots.insert(root).second )
+  {
+    ReadTree(String(dir,root.size()));
+  }
+
+  for (std::unordered_set< String >::iterator i=mFiles.begin(); i!=mFiles.end(); ++i)
+  {
+    const String &key = *i;
+    if ( key.size() >= prefix.size()+suffix.size() &&
+         key.compare(0,prefix.size(),prefix) == 0 &&
+         key.compare(key.size()-suffix.size(),suffix.size(),suffix) == 0 )
+    {
+      files.push_back(key);
+    }
+  }
+  std::sort(files.begin(),files.end());
+}
+
+void FileIndex::Added(const char *path)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mFiles.insert(GetKey(path));
+}
@@ -0,0 +1,54 @@
+#ifndef FILEINDEX_H
+
+#define FILEINDEX_H
+
+//############################################################################
+//##                                                                        ##
+//##  FILEINDEX.H                                                           ##
+//##                                                                        ##
+//##  Answers "does this file exist" from a listing of its directory tree   ##
+//##  made once, instead of asking the file system every time.              ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include <mutex>
+#include <unordered_set>
+#include "stl.h"
+
+// Paths like "textures/base_wall/concrete.tga" are looked up in a listing
+// of everything under their first directory, "textures/", read the first
+// time a path below it is asked for.  Paths without a directory, absolute
+// ones and those starting with "." or ".." are checked on disk.  Files created after the listing was read have to be
+// announced with Added.  Safe from any thread.
+class FileIndex
+{
+public:
+  bool Exists(const char *path);
+  void Added(const char *path);
+
+  // every file below dir ("scripts/") ending in ext, sorted, in the form
+  // GetKey gives.
+  void List(const char *dir,const char *ext,StringVector &files);
+
+  static String GetKey(const char *path);
+
+  static FileIndex& gFileIndex(void) // global instance
+  {
+    static FileIndex index;
+    return index;
+  };
+
+private:
+  void ReadTree(const String &dir);
+
+  std::set< String >              mRoots; // directories listed so far
+  std::set< std::pair< unsigned long long, unsigned long long > > mDirsRead; // device, inode
+  std::unordered_set< String >    mFiles;
+  std::mutex                      mMutex;
+};
+
+#endif
@@ -23,6 +23,16 @@
 
 #include "fload.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 
 Fload::Fload(const String& fname)
 {
@@ -108,3 +118,67 @@ char * Fload::GetString(void)
   }
   return ret;
 }
+
+
+#ifdef _WIN32
+
+Fmap::Fmap(const String& fname)
+{
+  mData    = 0;
+  mLen     = 0;
+  mMapping = 0;
+
+  mFile = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+                      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+  if ( mFile == INVALID_HANDLE_VALUE )
+  {
+    mFile = 0;
+    return;
+  }
+
+  LARGE_INTEGER size;
+  if ( !GetFileSizeEx((HANDLE)mFile, &size) || size.QuadPart == 0 ) return;
+
+  mMapping = CreateFileMappingA((HANDLE)mFile, 0, PAGE_READONLY, 0, 0, 0);
+  if ( !mMapping ) return;
+
+  mData = MapViewOfFile((HANDLE)mMapping, FILE_MAP_READ, 0, 0, 0);
+  if ( mData ) mLen = (size_t) size.QuadPart;
+}
+
+Fmap::~Fmap(void)
+{
+  if ( mData ) UnmapViewOfFile(mData);
+  if ( mMapping ) CloseHandle((HANDLE)mMapping);
+  if ( mFile ) CloseHandle((HANDLE)mFile);
+}
+
+#else
+
+Fmap::Fmap(const String& fname)
+{
+  mData = 0;
+  mLen  = 0;
+
+  int fd = open(fname.c_str(), O_RDONLY);
+  if ( fd < 0 ) return;
+
+  struct stat st;
+  if ( fstat(fd, &st) == 0 && st.st_size > 0 )
+  {
+    void *mem = mmap(0, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if ( mem != MAP_FAILED )
+    {
+      mData = mem;
+      mLen  = (size_t) st.st_size;
+    }
+  }
+  close(fd); // the mapping keeps its own reference to the file
+}
+
+Fmap::~Fmap(void)
+{
+  if ( mData ) munmap((void *) mData, mLen);
+}
+
+#endif
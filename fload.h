@@ -50,4 +50,30 @@ private:
   int   mReadLen;
 };
 
+// Maps a file read-only into the address space instead of copying it onto
+// the heap.  Pages are brought in by the OS as they are touched, so lump
+// data can be handed out as pointers straight into the file image.  The
+// mapping goes away when the Fmap instance goes away!!!
+class Fmap
+{
+public:
+  Fmap(const String& fname);
+
+  ~Fmap(void);
+
+  const void * GetData(void) const { return mData; };
+  size_t       GetLen(void) const { return mLen; };
+
+private:
+  Fmap(const Fmap &copy);            // not copyable
+  Fmap& operator=(const Fmap &copy);
+
+  const void *mData;
+  size_t      mLen;
+#ifdef _WIN32
+  void       *mFile;
+  void       *mMapping;
+#endif
+};
+
 #endif
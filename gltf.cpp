@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+//############################################################################
+//##                                                                        ##
+//##  GLTF.CPP                                                              ##
+//##                                                                        ##
+//##  Binary glTF 2.0 output of a VertexMesh.  Every section becomes a mesh ##
+//##  with one primitive, vertices interleaved as position, UV channel 1,   ##
+//##  UV channel 2 and color.                                               ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include "q3shader.h"
+#include "vformat.h"
+#include "gltf.h"
+#include "manifest.h"
+
+// floats per interleaved vertex: position, texel1, texel2, color
+#define GLB_VERTEX_FLOATS 10
+
+int GltfWriter::AddBufferView(const void *data,size_t bytes,int stride,int target)
+{
+  while ( mBin.size() & 3 ) mBin.push_back(0);
+
+  char buf[160];
+  int len = sprintf(buf,"{\"buffer\":0,\"byteOffset\":%u,\"byteLength\":%u",
+                    (unsigned int)mBin.size(),(unsigned int)bytes);
+  if ( stride ) len += sprintf(buf+len,",\"byteStride\":%d",stride);
+  if ( target ) len += sprintf(buf+len,",\"target\":%d",target);
+  strcpy(buf+len,"}");
+
+  const unsigned char *src = (const unsigned char *) data;
+  mBin.insert(mBin.end(),src,src+bytes);
+  mBufferViews.push_back(buf);
+  return (int)mBufferViews.size()-1;
+}
+
+int GltfWriter::AddAccessor(int view,size_t offset,int componentType,int count,
+                            const char *type,const float *min,const float *max)
+{
+  char buf[256];
+  int len = sprintf(buf,"{\"bufferView\":%d,\"byteOffset\":%u,\"componentType\":%d,\"count\":%d,\"type\":\"%s\"",
+                    view,(unsigned int)offset,componentType,count,type);
+  if ( min && max )
+  {
+    int n = type[3]-'0'; // VEC2 .. VEC4
+    const float *mm[2] = { min, max };
+    for (int k=0; k<2; k++)
+    {
+      len += sprintf(buf+len,k ? ",\"max\":[" : ",\"min\":[");
+      for (int i=0; i<n; i++)
+        len += sprintf(buf+len,i ? ",%.9g" : "%.9g",mm[k][i]);
+      len += sprintf(buf+len,"]");
+    }
+  }
+  strcpy(buf+len,"}");
+
+  mAccessors.push_back(buf);
+  return (int)mAccessors.size()-1;
+}
+
+int GltfWriter::AddTexture(const String &uri,int sampler)
+{
+  char key[16];
+  sprintf(key,"%d:",sampler);
+  String tkey = key+uri;
+
+  std::map< String, int >::const_iterator found = mTextureMap.find(tkey);
+  if ( found != mTextureMap.end() ) return (*found).second;
+
+  int image;
+  found = mImageMap.find(uri);
+  if ( found != mImageMap.end() )
+    image = (*found).second;
+  else
+  {
+    String json = "{\"uri\":";
+    Quote(json,uri.c_str());
+    json += "}";
+    image = (int)mImages.size();
+    mImages.push_back(json);
+    mImageMap[uri] = image;
+  }
+
+  char buf[64];
+  sprintf(buf,"{\"sampler\":%d,\"source\":%d}",sampler,image);
+  int texture = (int)mTextures.size();
+  mTextures.push_back(buf);
+  mTextureMap[tkey] = texture;
+  return texture;
+}
+
+int GltfWriter::FindMaterial(const char *name) const
+{
+  std::map< String, int >::const_iterator found = mMaterialMap.find(name);
+  if ( found == mMaterialMap.end() ) return -1;
+  return (*found).second;
+}
+
+int GltfWriter::AddMaterial(const char *name,const String &json)
+{
+  int material = (int)mMaterials.size();
+  mMaterials.push_back(json);
+  mMaterialMap[name] = material;
+  return material;
+}
+
+int GltfWriter::AddMesh(const String &json)
+{
+  mMeshes.push_back(json);
+  return (int)mMeshes.size()-1;
+}
+
+int GltfWriter::AddNode(const String &json,bool root)
+{
+  mNodes.push_back(json);
+  int node = (int)mNodes.size()-1;
+  if ( root ) mRoots.push_back(node);
+  return node;
+}
+
+void GltfWriter::Quote(String &out,const char *str)
+{
+  out += '"';
+  for (; *str; str++)
+  {
+    unsigned char c = (unsigned char) *str;
+    if ( c == '"' || c == '\\' )
+    {
+      out += '\\';
+      out += (char) c;
+    }
+    else if ( c < 0x20 )
+    {
+      char buf[8];
+      sprintf(buf,"\\u%04x",c);
+      out += buf;
+    }
+    else
+      out += (char) c;
+  }
+  out += '"';
+}
+
+// write "name":[a,b,..] unless the list is empty
+static void WriteArray(String &json,const char *name,const StringVector &items)
+{
+  if ( items.empty() ) return;
+  json += ",\"";
+  json += name;
+  json += "\":[";
+  for (unsigned int i=0; i<items.size(); i++)
+  {
+    if ( i ) json += ",";
+    json += items[i];
+  }
+  json += "]";
+}
+
+static void WriteUInt(FILE *fph,unsigned int v)
+{
+  unsigned char b[4] = { (unsigned char) v, (unsigned char) (v>>8),
+                         (unsigned char) (v>>16), (unsigned char) (v>>24) };
+  fwrite(b,4,1,fph);
+}
+
+bool GltfWriter::Save(const char *fname) const
+{
+  String json = "{\"asset\":{\"version\":\"2.0\",\"generator\":\"Q3BSP\"}";
+  if ( mUseLod ) json += ",\"extensionsUsed\":[\"MSFT_lod\"]";
+
+  json += ",\"scene\":0,\"scenes\":[{\"nodes\":[";
+  for (unsigned int i=0; i<mRoots.size(); i++)
+  {
+    char buf[16];
+    sprintf(buf,i ? ",%d" : "%d",mRoots[i]);
+    json += buf;
+  }
+  json += "]}]";
+
+  WriteArray(json,"nodes",mNodes);
+  WriteArray(json,"meshes",mMeshes);
+  WriteArray(json,"materials",mMaterials);
+  WriteArray(json,"textures",mTextures);
+  WriteArray(json,"images",mImages);
+  if ( !mTextures.empty() )
+    json += ",\"samplers\":[{\"wrapS\":10497,\"wrapT\":10497},{\"wrapS\":33071,\"wrapT\":33071}]";
+  WriteArray(json,"accessors",mAccessors);
+  WriteArray(json,"bufferViews",mBufferViews);
+
+  size_t binSize = (mBin.size()+3) & ~3;
+  if ( binSize )
+  {
+    char buf[64];
+    sprintf(buf,",\"buffers\":[{\"byteLength\":%u}]",(unsigned int)binSize);
+    json += buf;
+  }
+  json += "}";
+  while ( json.size() & 3 ) json += ' ';
+
+  FILE *fph = fopen(fname,"wb");
+  if ( !fph )
+  {
+    printf("Failed to open %s for writing\n",fname);
+    return false;
+  }
+  RecordOutput(fname);
+
+  unsigned int total = 12 + 8 + json.size();
+  if ( binSize ) total += 8 + binSize;
+
+  WriteUInt(fph,0x46546C67); // "glTF"
+  WriteUInt(fph,2);
+  WriteUInt(fph,total);
+
+  WriteUInt(fph,json.size());
+  WriteUInt(fph,0x4E4F534A); // "JSON"
+  fwrite(json.c_str(),json.size(),1,fph);
+
+  if ( binSize )
+  {
+    WriteUInt(fph,binSize);
+    WriteUInt(fph,0x004E4942); // "BIN"
+    if ( mBin.size() ) fwrite(&mBin[0],mBin.size(),1,fph);
+    static const unsigned char pad[3] = { 0, 0, 0 };
+    fwrite(pad,binSize-mBin.size(),1,fph);
+  }
+
+  bool ok = ferror(fph) == 0;
+  fclose(fph);
+  if ( !ok ) printf("Failed to write %s\n",fname);
+  return ok;
+}
+
+
+bool VertexMesh::SaveGLB(const String &name,VFormatOptions &options) const
+{
+  GltfWriter glb;
+
+  std::vector< VertexSection * > sections;
+  std::vector< VertexSection * > parts;
+  GetSections(options.maxSectionVertices,sections,parts);
+  for (unsigned int i=0; i<sections.size(); i++)
+    sections[i]->SaveGLB(glb,options);
+  for (unsigned int p=0; p<parts.size(); p++)
+    delete parts[p];
+
+  String oname = name+".glb";
+  return glb.Save(oname.c_str());
+}
+
+void VertexSection::SaveGLB(GltfWriter &glb,VFormatOptions &options) const
+{
+  int count = mPoints.GetVertexCount();
+  if ( !count || mIndices.empty() ) return;
+
+  // the coarser levels hang off the node of the finest one, a section with
+  // nothing at level 0 is skipped before anything is added to the file.
+  UIntVector scratchIndices;
+  if ( GetLodIndices(0,scratchIndices).empty() ) return;
+
+  // material: base texture on UV channel 1, lightmap on UV channel 2 as
+  // occlusion texture, the closest core glTF has to a lightmap.
+  int material = glb.FindMaterial(mName);
+  if ( material < 0 )
+  {
+    const char *foo = mName;
+    char scratch[256];
+    char *dest = scratch;
+    while ( *foo && *foo != '+' ) *dest++ = *foo++;
+    *dest = 0;
+
+    StringRef base(scratch);
+    bool hasLightMap = *foo == '+' && foo[1] && !(mShader && mShader->mNoLightMap);
+    if ( mShader ) mShader->GetBaseTexture(base);
+
+    String textureFileName;
+    CheckTexture(base,textureFileName);
+
+    String json = "{\"name\":";
+    GltfWriter::Quote(json,mName);
+    char buf[128];
+    sprintf(buf,",\"pbrMetallicRoughness\":{\"baseColorTexture\":{\"index\":%d},\"metallicFactor\":0}",
+            glb.AddTexture(textureFileName,GLTF_SAMPLER_REPEAT));
+    json += buf;
+    if ( hasLightMap )
+    {
+      String lightMapFileName = foo+1;
+      lightMapFileName += options.usePng ? ".png" : ".bmp";
+      sprintf(buf,",\"occlusionTexture\":{\"index\":%d,\"texCoord\":1}",
+              glb.AddTexture(lightMapFileName,GLTF_SAMPLER_CLAMP));
+      json += buf;
+    }
+    if ( mShader && mShader->mCullMode == SC_NONE )
+      json += ",\"doubleSided\":true";
+    json += "}";
+    material = glb.AddMaterial(mName,json);
+  }
+
+  // interleaved vertices, Y up like the VRML 2 output.
+  FloatVector verts(count*GLB_VERTEX_FLOATS);
+  float minp[3] = {  1e30f,  1e30f,  1e30f };
+  float maxp[3] = { -1e30f, -1e30f, -1e30f };
+  float *v = &verts[0];
+  for (int i=0; i<count; i++)
+  {
+    const LightMapVertex &vtx = mPoints.Get(i);
+    v[0] = vtx.mPos.x;
+    v[1] = options.yzFlip ? vtx.mPos.z : vtx.mPos.y;
+    v[2] = options.yzFlip ? vtx.mPos.y : vtx.mPos.z;
+    for (int k=0; k<3; k++)
+    {
+      if ( v[k] < minp[k] ) minp[k] = v[k];
+      if ( v[k] > maxp[k] ) maxp[k] = v[k];
+    }
+    v[3] = vtx.mTexel1.x;
+    v[4] = vtx.mTexel1.y;
+    v[5] = vtx.mTexel2.x;
+    v[6] = vtx.mTexel2.y;
+    v[7] = vtx.mColor.x;
+    v[8] = vtx.mColor.y;
+    v[9] = vtx.mColor.z;
+    v += GLB_VERTEX_FLOATS;
+  }
+
+  int stride = GLB_VERTEX_FLOATS*sizeof(float);
+  int view = glb.AddBufferView(&verts[0],verts.size()*sizeof(float),stride,GLTF_ARRAY_BUFFER);
+
+  char attributes[160];
+  sprintf(attributes,"{\"POSITION\":%d,\"TEXCOORD_0\":%d,\"TEXCOORD_1\":%d,\"COLOR_0\":%d}",
+          glb.AddAccessor(view,0,GLTF_FLOAT,count,"VEC3",minp,maxp),
+          glb.AddAccessor(view,3*sizeof(float),GLTF_FLOAT,count,"VEC2"),
+          glb.AddAccessor(view,5*sizeof(float),GLTF_FLOAT,count,"VEC2"),
+          glb.AddAccessor(view,7*sizeof(float),GLTF_FLOAT,count,"VEC3"));
+
+  // the indices of all LOD levels go into one bufferView, each level an
+  // accessor on its own range.  The faces are clockwise like the VRML 2
+  // output says with ccw FALSE, glTF wants them counterclockwise.
+  IntVector lodLevels;
+  GetLodLevels(lodLevels);
+
+  bool ccw = mShader && mShader->mCullMode == SC_BACK;
+  // 65535 is the primitive restart value glTF forbids in 16 bit indices.
+  bool small = count < 65536;
+  int isize = small ? 2 : 4;
+
+  UCharVector indexData;
+  UIntVector offsets;
+  UIntVector counts;
+  for (unsigned int l=0; l<lodLevels.size(); l++)
+  {
+    const UIntVector &indices = GetLodIndices(lodLevels[l],scratchIndices);
+    size_t start = indexData.size();
+    offsets.push_back(start);
+    counts.push_back(indices.size());
+    indexData.resize(start+indices.size()*isize);
+    unsigned char *dest = &indexData[0]+start;
+    for (size_t j=0; j+2<indices.size(); j+=3)
+    {
+      unsigned int tri[3] = { indices[j], indices[j+2], indices[j+1] };
+      if ( ccw )
+      {
+        tri[1] = indices[j+1];
+        tri[2] = indices[j+2];
+      }
+      for (int k=0; k<3; k++)
+      {
+        if ( small )
+        {
+          unsigned short s = (unsigned short) tri[k];
+          memcpy(dest,&s,2);
+        }
+        else
+          memcpy(dest,&tri[k],4);
+        dest += isize;
+      }
+    }
+    while ( indexData.size() & 3 ) indexData.push_back(0);
+  }
+  int iview = glb.AddBufferView(&indexData[0],indexData.size(),0,GLTF_ELEMENT_ARRAY_BUFFER);
+
+  // one mesh per level.  The coarser levels get nodes outside the scene
+  // that the node of the finest level lists through MSFT_lod.
+  int mesh0 = 0;
+  IntVector lodNodes;
+  for (unsigned int l=0; l<lodLevels.size(); l++)
+  {
+    if ( !counts[l] ) continue;
+    int accessor = glb.AddAccessor(iview,offsets[l],small ? GLTF_UNSIGNED_SHORT : GLTF_UNSIGNED_INT,
+                                   counts[l],"SCALAR");
+    String json = "{\"name\":";
+    GltfWriter::Quote(json,mName);
+    char buf[256];
+    sprintf(buf,",\"primitives\":[{\"attributes\":%s,\"indices\":%d,\"material\":%d}]}",
+            attributes,accessor,material);
+    json += buf;
+
+    int mesh = glb.AddMesh(json);
+    if ( l == 0 )
+      mesh0 = mesh;
+    else
+    {
+      sprintf(buf,"{\"mesh\":%d}",mesh);
+      lodNodes.push_back(glb.AddNode(buf,false));
+    }
+  }
+
+  char buf[64];
+  sprintf(buf,"{\"mesh\":%d",mesh0);
+  String json = buf;
+  if ( !lodNodes.empty() )
+  {
+    glb.UseLod();
+    json += ",\"extensions\":{\"MSFT_lod\":{\"ids\":[";
+    for (unsigned int l=0; l<lodNodes.size(); l++)
+    {
+      sprintf(buf,l ? ",%d" : "%d",lodNodes[l]);
+      json += buf;
+    }
+    json += "]}}";
+  }
+  json += "}";
+  glb.AddNode(json,true);
+}
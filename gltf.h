@@ -0,0 +1,84 @@
+#ifndef GLTF_H
+
+#define GLTF_H
+
+//############################################################################
+//##                                                                        ##
+//##  GLTF.H                                                                ##
+//##                                                                        ##
+//##  Collects the JSON and the binary buffer of a glTF 2.0 asset and       ##
+//##  writes them out as a single binary .glb file.                         ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include "stl.h"
+
+// bufferView targets
+#define GLTF_ARRAY_BUFFER          34962
+#define GLTF_ELEMENT_ARRAY_BUFFER  34963
+
+// accessor component types
+#define GLTF_UNSIGNED_SHORT 5123
+#define GLTF_UNSIGNED_INT   5125
+#define GLTF_FLOAT          5126
+
+// samplers, always present in the asset
+#define GLTF_SAMPLER_REPEAT 0
+#define GLTF_SAMPLER_CLAMP  1
+
+class GltfWriter
+{
+public:
+  GltfWriter(void) { mUseLod = false; };
+
+  // append data to the binary chunk as a new bufferView, 4 byte aligned.
+  // stride 0 means tightly packed, target 0 means none.
+  int AddBufferView(const void *data,size_t bytes,int stride,int target);
+
+  // min/max, if given, have as many components as 'type' has.
+  int AddAccessor(int view,size_t offset,int componentType,int count,
+                  const char *type,const float *min=NULL,const float *max=NULL);
+
+  // texture of an image file, shared by everything referencing the same
+  // file with the same sampler.
+  int AddTexture(const String &uri,int sampler);
+
+  // materials are shared by name, -1 if there is none yet.
+  int FindMaterial(const char *name) const;
+  int AddMaterial(const char *name,const String &json);
+
+  int AddMesh(const String &json);
+
+  // root nodes are listed in the scene, the others are only referenced
+  // by other nodes, like the coarser MSFT_lod levels.
+  int AddNode(const String &json,bool root);
+
+  // the MSFT_lod extension is declared when set.
+  void UseLod(void) { mUseLod = true; };
+
+  bool Save(const char *fname) const;
+
+  // append str to out as a quoted JSON string
+  static void Quote(String &out,const char *str);
+
+private:
+  UCharVector  mBin;
+  StringVector mBufferViews;
+  StringVector mAccessors;
+  StringVector mImages;
+  StringVector mTextures;
+  StringVector mMaterials;
+  StringVector mMeshes;
+  StringVector mNodes;
+  IntVector    mRoots;
+  std::map< String, int > mImageMap;
+  std::map< String, int > mTextureMap;
+  std::map< String, int > mMaterialMap;
+  bool         mUseLod;
+};
+
+#endif
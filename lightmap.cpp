@@ -0,0 +1,475 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+//############################################################################
+//##                                                                        ##
+//##  LIGHTMAP.CPP                                                          ##
+//##                                                                        ##
+//##  Decides how the lightmap pages of a BSP are written out as images     ##
+//##  and where the lightmap of every face ends up in them.                 ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include "lightmap.h"
+#include "q3def.h"
+#include "pngwrite.h"
+#include "parallel.h"
+#include "manifest.h"
+#include "stb_image_write.h"
+
+// smallest power of two of at least n, but no more than limit.
+static int FitSize(int n,int limit)
+{
+  int size = 1;
+  while ( size < n ) size *= 2;
+  return size < limit ? size : limit;
+}
+
+// <prefix><kind><code>NN, the prefix is the path of the BSP file and of
+// any length.
+static String ImageName(const StringRef &prefix,const char *kind,const StringRef &code,int n)
+{
+  char number[16];
+  sprintf(number,"%02d",n);
+  return String(prefix.Get()) + kind + code.Get() + number;
+}
+
+// FNV-1a
+static unsigned long long HashPage(const unsigned char *data)
+{
+  unsigned long long h = 14695981039346656037ull;
+  for (int i=0; i<LIGHTMAP_BYTES; i++) h = (h ^ data[i]) * 1099511628211ull;
+  return h;
+}
+
+void LightmapLayout::Dedup(const unsigned char *pages,int pageCount,bool vertexColour)
+{
+  mCanonical.resize(pageCount);
+  mColors.assign(pageCount,Vector3d<float>(1,1,1));
+  mSolid.assign(pageCount,-1);
+
+  int copies = 0, uniform = 0, solids = 0;
+  std::map< unsigned long long, IntVector > seen;
+  std::map< unsigned int, int > colours; // rgb to its first page
+  for (int p=0; p<pageCount; p++)
+  {
+    const unsigned char *data = pages + (size_t)p*LIGHTMAP_BYTES;
+
+    int i = 3;
+    while ( i < LIGHTMAP_BYTES && data[i] == data[i-3] ) i++;
+    if ( i == LIGHTMAP_BYTES )
+    {
+      mCanonical[p] = -1;
+      mColors[p].Set(data[0]/255.0f,data[1]/255.0f,data[2]/255.0f);
+      uniform++;
+      if ( !vertexColour )
+      {
+        unsigned int rgb = data[0] | (data[1]<<8) | (data[2]<<16);
+        std::map< unsigned int, int >::iterator found = colours.find(rgb);
+        if ( found == colours.end() )
+        {
+          found = colours.insert(std::make_pair(rgb,p)).first;
+          solids++;
+        }
+        mSolid[p] = found->second;
+      }
+      continue;
+    }
+
+    mCanonical[p] = p;
+    IntVector &same = seen[ HashPage(data) ];
+    for (size_t s=0; s<same.size(); s++)
+    {
+      if ( memcmp(pages + (size_t)same[s]*LIGHTMAP_BYTES,data,LIGHTMAP_BYTES) == 0 )
+      {
+        mCanonical[p] = same[s];
+        copies++;
+        break;
+      }
+    }
+    if ( mCanonical[p] == p ) same.push_back(p);
+  }
+
+  if ( (copies || uniform) && vertexColour )
+  {
+    printf("Lightmaps: %d pages, %d copies of other pages and %d of a single colour dropped.\n",
+           pageCount,copies,uniform);
+  }
+  else if ( copies || uniform )
+  {
+    printf("Lightmaps: %d pages, %d copies of other pages dropped, %d of a single colour\n"
+           "written as %d 1x1 images.\n",pageCount,copies,uniform,solids);
+  }
+}
+
+int LightmapLayout::GetFacePage(const QuakeFace &face,int pageCount,LightmapPlacement &p) const
+{
+  int page = face.GetLightmap();
+  if ( page < 0 || page >= pageCount ) return -1;
+  if ( page >= (int)mCanonical.size() ) return page;
+  if ( mCanonical[page] < 0 && mSolid[page] < 0 )
+  {
+    p.mUniform = true;
+    p.mColor = mColors[page];
+  }
+  return mCanonical[page];
+}
+
+void LightmapLayout::AddSolidImages(const QuakeFaceVector &faces,int pageCount,
+                                    const StringRef &prefix,const StringRef &code)
+{
+  IntVector pageImage(mSolid.size(),-1);
+  for (size_t p=0; p<mSolid.size(); p++)
+  {
+    if ( mSolid[p] != (int)p ) continue;
+    pageImage[p] = (int)mImages.size();
+
+    LightmapImage image;
+    image.mName   = ImageName(prefix,"lm",code,(int)p);
+    image.mWidth  = 1;
+    image.mHeight = 1;
+
+    LightmapBlit blit;
+    blit.mPage   = (int)p;
+    blit.mSrcX   = blit.mSrcY = 0;
+    blit.mWidth  = blit.mHeight = 1;
+    blit.mDstX   = blit.mDstY = 0;
+    blit.mBorder = 0;
+    image.mBlits.push_back(blit);
+    mImages.push_back(image);
+  }
+
+  // any lightmap coordinate lands on the one texel.
+  for (size_t f=0; f<faces.size(); f++)
+  {
+    int page = faces[f].GetLightmap();
+    if ( page < 0 || page >= pageCount || page >= (int)mSolid.size() || mSolid[page] < 0 )
+      continue;
+    const LightmapImage &image = mImages[ pageImage[ mSolid[page] ] ];
+    mPlacements[f].mImage = pageImage[ mSolid[page] ];
+    mPlacements[f].mName  = SGET(image.mName.c_str());
+  }
+}
+
+void LightmapLayout::GetPages(int pageCount,IntVector &pages) const
+{
+  pages.clear();
+  for (int p=0; p<pageCount; p++)
+  {
+    if ( p >= (int)mCanonical.size() || mCanonical[p] == p ) pages.push_back(p);
+  }
+}
+
+void LightmapLayout::SetPages(const QuakeFaceVector &faces,int pageCount,
+                              const StringRef &prefix,const StringRef &code)
+{
+  IntVector pages;
+  GetPages(pageCount,pages);
+  IntVector pageImage(pageCount,-1);
+
+  mImages.clear();
+  mImages.resize(pages.size());
+  for (size_t i=0; i<pages.size(); i++)
+  {
+    pageImage[ pages[i] ] = (int)i;
+
+    LightmapImage &image = mImages[i];
+    image.mName   = ImageName(prefix,"lm",code,pages[i]);
+    image.mWidth  = LIGHTMAP_WIDTH;
+    image.mHeight = LIGHTMAP_HEIGHT;
+
+    LightmapBlit blit;
+    blit.mPage   = pages[i];
+    blit.mSrcX   = blit.mSrcY = 0;
+    blit.mWidth  = LIGHTMAP_WIDTH;
+    blit.mHeight = LIGHTMAP_HEIGHT;
+    blit.mDstX   = blit.mDstY = 0;
+    blit.mBorder = 0;
+    image.mBlits.push_back(blit);
+  }
+
+  mPlacements.clear();
+  mPlacements.resize(faces.size());
+  for (size_t f=0; f<faces.size(); f++)
+  {
+    int page = GetFacePage(faces[f],pageCount,mPlacements[f]);
+    if ( page < 0 ) continue;
+    mPlacements[f].mImage = pageImage[page];
+    mPlacements[f].mName  = SGET(mImages[ pageImage[page] ].mName.c_str());
+  }
+  AddSolidImages(faces,pageCount,prefix,code);
+}
+
+void LightmapLayout::SetAtlases(const QuakeFaceVector &faces,int pageCount,int size,
+                                const StringRef &prefix,const StringRef &code)
+{
+  int cols = size / LIGHTMAP_WIDTH;
+  int rows = size / LIGHTMAP_HEIGHT;
+  if ( cols < 1 ) cols = 1;
+  if ( rows < 1 ) rows = 1;
+  int perAtlas = cols*rows;
+
+  IntVector pages;
+  GetPages(pageCount,pages);
+  IntVector pageSlot(pageCount,-1); // place in the order of all atlases
+  for (size_t i=0; i<pages.size(); i++) pageSlot[ pages[i] ] = (int)i;
+  int slots = (int)pages.size();
+  int atlasCount = (slots+perAtlas-1) / perAtlas;
+
+  // every atlas but the last is full, the last one shrinks to fit.
+  mImages.clear();
+  mImages.resize(atlasCount);
+  for (int a=0; a<atlasCount; a++)
+  {
+    int first = a*perAtlas;
+    int count = slots-first < perAtlas ? slots-first : perAtlas;
+
+    LightmapImage &image = mImages[a];
+    image.mName = ImageName(prefix,"atlas",code,a);
+    if ( count < cols )
+    {
+      image.mWidth  = FitSize(count*LIGHTMAP_WIDTH,cols*LIGHTMAP_WIDTH);
+      image.mHeight = LIGHTMAP_HEIGHT;
+    }
+    else
+    {
+      image.mWidth  = cols*LIGHTMAP_WIDTH;
+      image.mHeight = FitSize(((count+cols-1)/cols)*LIGHTMAP_HEIGHT,rows*LIGHTMAP_HEIGHT);
+    }
+
+    for (int i=0; i<count; i++)
+    {
+      LightmapBlit blit;
+      blit.mPage   = pages[first+i];
+      blit.mSrcX   = blit.mSrcY = 0;
+      blit.mWidth  = LIGHTMAP_WIDTH;
+      blit.mHeight = LIGHTMAP_HEIGHT;
+      blit.mDstX   = (i%cols)*LIGHTMAP_WIDTH;
+      blit.mDstY   = (i/cols)*LIGHTMAP_HEIGHT;
+      blit.mBorder = 0;
+      image.mBlits.push_back(blit);
+    }
+  }
+
+  mPlacements.clear();
+  mPlacements.resize(faces.size());
+  for (size_t f=0; f<faces.size(); f++)
+  {
+    LightmapPlacement &p = mPlacements[f];
+    int page = GetFacePage(faces[f],pageCount,p);
+    if ( page < 0 ) continue;
+
+    int slot = pageSlot[page];
+    const LightmapImage &image = mImages[slot/perAtlas];
+    const LightmapBlit &blit = image.mBlits[slot%perAtlas];
+
+    p.mImage   = slot/perAtlas;
+    p.mName    = SGET(image.mName.c_str());
+    p.mScaleU  = (float)LIGHTMAP_WIDTH / image.mWidth;
+    p.mScaleV  = (float)LIGHTMAP_HEIGHT / image.mHeight;
+    p.mOffsetU = (float)blit.mDstX / image.mWidth;
+    p.mOffsetV = (float)blit.mDstY / image.mHeight;
+  }
+  AddSolidImages(faces,pageCount,prefix,code);
+}
+
+// the rectangle of the page a face uses, the whole page if the face
+// does not say.
+static void GetFaceRect(const QuakeFace &face,LightmapBlit &r)
+{
+  face.GetLightmapRect(r.mSrcX,r.mSrcY,r.mWidth,r.mHeight);
+  if ( r.mSrcX < 0 || r.mSrcY < 0 || r.mWidth <= 0 || r.mHeight <= 0 ||
+       r.mSrcX+r.mWidth > LIGHTMAP_WIDTH || r.mSrcY+r.mHeight > LIGHTMAP_HEIGHT )
+  {
+    r.mSrcX = r.mSrcY = 0;
+    r.mWidth = LIGHTMAP_WIDTH;
+    r.mHeight = LIGHTMAP_HEIGHT;
+  }
+}
+
+class RectLess
+{
+public:
+  bool operator()(const LightmapBlit &a,const LightmapBlit &b) const
+  {
+    if ( a.mPage != b.mPage ) return a.mPage < b.mPage;
+    if ( a.mSrcX != b.mSrcX ) return a.mSrcX < b.mSrcX;
+    if ( a.mSrcY != b.mSrcY ) return a.mSrcY < b.mSrcY;
+    if ( a.mWidth != b.mWidth ) return a.mWidth < b.mWidth;
+    return a.mHeight < b.mHeight;
+  }
+};
+
+void LightmapLayout::SetRects(const QuakeFaceVector &faces,int pageCount,int size,int border,
+                              const StringRef &prefix,const StringRef &code)
+{
+  // the distinct rectangles in use, faces sharing one share its texels.
+  std::vector< LightmapBlit > rects;
+  IntVector faceRect(faces.size(),-1);
+  std::map< LightmapBlit, int, RectLess > found;
+  int largest = LIGHTMAP_WIDTH;
+  mPlacements.clear();
+  mPlacements.resize(faces.size());
+  for (size_t f=0; f<faces.size(); f++)
+  {
+    int page = GetFacePage(faces[f],pageCount,mPlacements[f]);
+    if ( page < 0 ) continue;
+
+    LightmapBlit r;
+    r.mPage = page;
+    GetFaceRect(faces[f],r);
+    r.mDstX = r.mDstY = 0;
+    r.mBorder = border;
+
+    std::map< LightmapBlit, int, RectLess >::iterator i = found.find(r);
+    if ( i == found.end() )
+    {
+      i = found.insert(std::make_pair(r,(int)rects.size())).first;
+      rects.push_back(r);
+      if ( r.mWidth+2*border > largest ) largest = r.mWidth+2*border;
+      if ( r.mHeight+2*border > largest ) largest = r.mHeight+2*border;
+    }
+    faceRect[f] = i->second;
+  }
+  if ( size < largest ) size = FitSize(largest,largest*2);
+
+  // shelf packing, tallest first
+  IntVector order(rects.size());
+  for (size_t i=0; i<rects.size(); i++) order[i] = (int)i;
+  std::stable_sort(order.begin(),order.end(),[&rects](int a,int b)
+  {
+    if ( rects[a].mHeight != rects[b].mHeight ) return rects[a].mHeight > rects[b].mHeight;
+    return rects[a].mWidth > rects[b].mWidth;
+  });
+
+  IntVector rectImage(rects.size());
+  IntVector usedWidth, usedHeight;
+  int x = 0, y = 0, shelf = 0;
+  for (size_t o=0; o<order.size(); o++)
+  {
+    LightmapBlit &r = rects[order[o]];
+    int wid = r.mWidth+2*border;
+    int hit = r.mHeight+2*border;
+    if ( x+wid > size ) // next shelf
+    {
+      x = 0;
+      y += shelf;
+      shelf = 0;
+    }
+    if ( usedWidth.empty() || y+hit > size ) // next image
+    {
+      usedWidth.push_back(0);
+      usedHeight.push_back(0);
+      x = y = shelf = 0;
+    }
+    int image = (int)usedWidth.size()-1;
+    r.mDstX = x;
+    r.mDstY = y;
+    rectImage[order[o]] = image;
+    x += wid;
+    if ( hit > shelf ) shelf = hit;
+    if ( x > usedWidth[image] ) usedWidth[image] = x;
+    if ( y+hit > usedHeight[image] ) usedHeight[image] = y+hit;
+  }
+
+  mImages.clear();
+  mImages.resize(usedWidth.size());
+  size_t area = 0;
+  for (size_t a=0; a<mImages.size(); a++)
+  {
+    LightmapImage &image = mImages[a];
+    image.mName   = ImageName(prefix,"atlas",code,(int)a);
+    image.mWidth  = FitSize(usedWidth[a],size);
+    image.mHeight = FitSize(usedHeight[a],size);
+    area += (size_t)image.mWidth*image.mHeight;
+  }
+  for (size_t i=0; i<rects.size(); i++)
+  {
+    mImages[ rectImage[i] ].mBlits.push_back(rects[i]);
+  }
+
+  // page texel u*128 moves from the rectangle's spot in the page to its
+  // spot in the image.
+  for (size_t f=0; f<faces.size(); f++)
+  {
+    if ( faceRect[f] < 0 ) continue;
+
+    const LightmapBlit &r = rects[ faceRect[f] ];
+    const LightmapImage &image = mImages[ rectImage[ faceRect[f] ] ];
+
+    LightmapPlacement &p = mPlacements[f];
+    p.mImage   = rectImage[ faceRect[f] ];
+    p.mName    = SGET(image.mName.c_str());
+    p.mScaleU  = (float)LIGHTMAP_WIDTH / image.mWidth;
+    p.mScaleV  = (float)LIGHTMAP_HEIGHT / image.mHeight;
+    p.mOffsetU = (float)(r.mDstX+border-r.mSrcX) / image.mWidth;
+    p.mOffsetV = (float)(r.mDstY+border-r.mSrcY) / image.mHeight;
+  }
+
+  if ( pageCount )
+  {
+    printf("Repacked %d lightmap rectangles of %d pages into %d images, %d%% of the texels.\n",
+           (int)rects.size(),pageCount,(int)mImages.size(),
+           (int)(area*100/((size_t)pageCount*LIGHTMAP_WIDTH*LIGHTMAP_HEIGHT)));
+  }
+  AddSolidImages(faces,pageCount,prefix,code);
+}
+
+void LightmapLayout::Save(const unsigned char *pages,int pageCount,bool usePng,
+                          int pngLevel,int jobs) const
+{
+  // images are independent, each is assembled and encoded on its own.
+  ParallelFor((int)mImages.size(),jobs,[&](int i)
+  {
+    const LightmapImage &image = mImages[i];
+    UCharVector pixels;
+    const unsigned char *data;
+
+    // a whole page is written straight out of the lump.
+    const LightmapBlit *blit = image.mBlits.size() == 1 ? &image.mBlits[0] : 0;
+    if ( blit && blit->mPage < pageCount && blit->mBorder == 0 &&
+         image.mWidth == LIGHTMAP_WIDTH && image.mHeight == LIGHTMAP_HEIGHT &&
+         blit->mWidth == LIGHTMAP_WIDTH && blit->mHeight == LIGHTMAP_HEIGHT )
+    {
+      data = pages + (size_t)blit->mPage*LIGHTMAP_BYTES;
+    }
+    else
+    {
+      pixels.assign((size_t)image.mWidth*image.mHeight*3,0);
+      for (size_t b=0; b<image.mBlits.size(); b++)
+      {
+        const LightmapBlit &r = image.mBlits[b];
+        if ( r.mPage >= pageCount ) continue;
+        const unsigned char *src = pages + (size_t)r.mPage*LIGHTMAP_BYTES;
+        int border = r.mBorder;
+        for (int y=-border; y<r.mHeight+border; y++)
+        {
+          int sy = y < 0 ? 0 : y >= r.mHeight ? r.mHeight-1 : y;
+          const unsigned char *row = src + ((r.mSrcY+sy)*LIGHTMAP_WIDTH + r.mSrcX)*3;
+          unsigned char *dest = &pixels[((size_t)(r.mDstY+border+y)*image.mWidth + r.mDstX)*3];
+          for (int x=0; x<border; x++,dest+=3) memcpy(dest,row,3);
+          memcpy(dest,row,r.mWidth*3);
+          dest += r.mWidth*3;
+          for (int x=0; x<border; x++,dest+=3) memcpy(dest,row+(r.mWidth-1)*3,3);
+        }
+      }
+      data = &pixels[0];
+    }
+
+    if (usePng) {
+      String bname = image.mName+".png";
+      RecordOutput(bname.c_str());
+      WritePng(bname.c_str(), image.mWidth, image.mHeight, 3, data, image.mWidth*3, pngLevel);
+    } else {
+      String bname = image.mName+".bmp";
+      RecordOutput(bname.c_str());
+      stbi_write_bmp(bname.c_str(), image.mWidth, image.mHeight, 3, data);
+    }
+  });
+}
@@ -0,0 +1,149 @@
+#ifndef LIGHTMAP_H
+
+#define LIGHTMAP_H
+
+//############################################################################
+//##                                                                        ##
+//##  LIGHTMAP.H                                                            ##
+//##                                                                        ##
+//##  Decides how the lightmap pages of a BSP are written out as images     ##
+//##  and where the lightmap of every face ends up in them.                 ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include "stl.h"
+#include "stringdict.h"
+#include "vector.h"
+
+class QuakeFace;
+typedef std::vector< QuakeFace > QuakeFaceVector;
+
+// a lightmap page of the BSP, 128x128 RGB texels.
+#define LIGHTMAP_WIDTH  128
+#define LIGHTMAP_HEIGHT 128
+#define LIGHTMAP_BYTES  (LIGHTMAP_WIDTH*LIGHTMAP_HEIGHT*3)
+
+// where the lightmap of a face ends up: the image and the mapping of its
+// lightmap texture coordinates into that image.
+class LightmapPlacement
+{
+public:
+  LightmapPlacement(void)
+  {
+    mImage = -1;
+    mUniform = false;
+    mColor.Set(1,1,1);
+    mScaleU = mScaleV = 1.0f;
+    mOffsetU = mOffsetV = 0.0f;
+  };
+
+  bool IsIdentity(void) const
+  {
+    return mScaleU == 1.0f && mScaleV == 1.0f && mOffsetU == 0.0f && mOffsetV == 0.0f;
+  };
+
+  void Map(Vector2d<float> &t) const
+  {
+    t.x = t.x*mScaleU + mOffsetU;
+    t.y = t.y*mScaleV + mOffsetV;
+  };
+
+  StringRef mName;  // image name without extension, when mImage >= 0
+  int       mImage; // index of the image, -1 for no lightmap
+  bool      mUniform; // the lightmap was one colour, it goes into the
+                      // vertex colours instead of an image
+  Vector3d<float> mColor;
+  float     mScaleU;
+  float     mScaleV;
+  float     mOffsetU;
+  float     mOffsetV;
+};
+
+typedef std::vector< LightmapPlacement > LightmapPlacementVector;
+
+// a rectangle of a BSP lightmap page copied into an image.  The edge
+// texels are repeated mBorder texels outwards, so the image area written
+// is (mWidth+2*mBorder) x (mHeight+2*mBorder) at mDstX,mDstY.
+class LightmapBlit
+{
+public:
+  int mPage;
+  int mSrcX;
+  int mSrcY;
+  int mWidth;
+  int mHeight;
+  int mDstX;
+  int mDstY;
+  int mBorder;
+};
+
+// an image file to write
+class LightmapImage
+{
+public:
+  String mName; // without extension
+  int    mWidth;
+  int    mHeight;
+  std::vector< LightmapBlit > mBlits;
+};
+
+class LightmapLayout
+{
+public:
+  // call before the Set methods to drop pages that are copies of an
+  // earlier page and pages of a single colour; the faces of a copy use
+  // the first page.  With vertexColour the faces of a single colour page
+  // get that colour as vertex colour and no lightmap, for exporters that
+  // draw vertex colours.  Else pages of the same colour share one 1x1
+  // image, named after the first of them.
+  void Dedup(const unsigned char *pages,int pageCount,bool vertexColour);
+  // every page an image of its own, named <prefix>lm<code>NN.
+  void SetPages(const QuakeFaceVector &faces,int pageCount,
+                const StringRef &prefix,const StringRef &code);
+
+  // the pages packed in a grid into atlases of at most size x size texels,
+  // named <prefix>atlas<code>NN.
+  void SetAtlases(const QuakeFaceVector &faces,int pageCount,int size,
+                  const StringRef &prefix,const StringRef &code);
+
+  // only the rectangle each face uses, grown by 'border' texels, packed
+  // into images of at most size x size texels, named like the atlases.
+  void SetRects(const QuakeFaceVector &faces,int pageCount,int size,int border,
+                const StringRef &prefix,const StringRef &code);
+
+  const LightmapPlacement & GetPlacement(int face) const { return mPlacements[face]; };
+
+  int GetImageCount(void) const { return (int)mImages.size(); };
+  const LightmapImage & GetImage(int i) const { return mImages[i]; };
+
+  // write every image as a png at pngLevel (see WritePng), else bmp, on up
+  // to 'jobs' threads.  'pages' is the lightmap lump.
+  void Save(const unsigned char *pages,int pageCount,bool usePng,
+            int pngLevel,int jobs) const;
+
+private:
+  // the page to use for the lightmap of a face, -1 if none.  Fills in the
+  // colour of a single colour page.
+  int GetFacePage(const QuakeFace &face,int pageCount,LightmapPlacement &p) const;
+
+  // the pages to write, in order
+  void GetPages(int pageCount,IntVector &pages) const;
+
+  // after a Set method: the 1x1 images of the single colour pages and the
+  // faces that use them.
+  void AddSolidImages(const QuakeFaceVector &faces,int pageCount,
+                      const StringRef &prefix,const StringRef &code);
+
+  IntVector                    mCanonical; // per page after Dedup, -1 uniform
+  std::vector< Vector3d<float> > mColors;  // per page, for uniform pages
+  IntVector                    mSolid; // per uniform page, the first one of
+                                       // its colour, -1 for vertex colour
+  std::vector< LightmapImage > mImages;
+  LightmapPlacementVector      mPlacements; // per face
+};
+
+#endif
@@ -29,7 +29,58 @@
 #define MAIN_STRLWR_STRUPR_IMPLEMENTATION
 #include "main.h"
 #include "q3bsp.h"
+#include "q3shader.h"
 #include "fload.h"
+#include "manifest.h"
+
+static void Usage(void)
+{
+  printf("Usage: q3bsp [-options] <name>.BSP\n");
+  printf("Where <name> is the name of a valid Quake3 BSP file.\n\n");
+  printf("This utility will convert a Quake3 BSP into a valid\n");
+  printf("polygon mesh and output the results into two seperate VRML 1.0\n");
+  printf("files.  The first VRML file contains all the U/V mapping and\n");
+  printf("texture mapping information for channel #1, and the second\n");
+  printf("VRML file will contain all of the U/V mapping and texture names\n");
+  printf("for the second U/V channel, which contains all lightmap\n");
+  printf("information.  You can then directly import these files into any\n");
+  printf("number of 3d editing tools, including 3d Studio Max\n");
+
+  printf("This tool also extracts the lightmap data and saves it out as a\n");
+  printf("series of .BMP files.\n\n");
+  printf("OpenSourced by John W. Ratcliff on December 5, 2000\n");
+  printf("Merry Christmas!\n\n");
+  printf("Contact Id Software about using Quake 3 data files in and\n");
+  printf("Quake 3 editing tools for commercial software development\n");
+  printf("projects.\n");
+  printf("Extended Options: \n");
+  printf("-1		VRML 1 output\n");
+  printf("-2		VRML 2 output 2 files \n");
+  printf("-2me	VRML 2 output with MultiTexture extension nodes & effects\n");
+  printf("-g		binary glTF 2.0 output (.glb)\n");
+  printf("--jobs N	threads used to build the mesh (default: one per core)\n");
+  printf("--split16	split sections so that every index fits in 16 bits\n");
+  printf("--decimals N	write VRML 2 floats with N decimals\n");
+  printf("--shortest	write VRML 2 floats with the fewest digits that read back exactly\n");
+  printf("--patchlod E0,E1,..	tessellate curved surfaces once per error tolerance\n");
+  printf("		and write the levels as LOD nodes (default: one level, 0.4)\n");
+  printf("--loderror A	switch to a coarser LOD level where its tolerance spans\n");
+  printf("		A radians on screen (default 0.01)\n");
+  printf("--vcache N	reorder triangles for a vertex cache of N entries (try 16 or 32)\n");
+  printf("--simplify R[,E]	keep R (0..1) of the triangles, stop early at an error of E;\n");
+  printf("		1,E collapses as far as the error E allows\n");
+  printf("--lmatlas N	pack the lightmap pages into atlases of up to NxN texels\n");
+  printf("--incremental	keep a manifest of inputs and skip outputs whose inputs\n");
+  printf("		and settings did not change since the last run\n");
+  printf("--shadercache F	keep the parsed shaders in file F, later runs only parse\n");
+  printf("		the shader scripts that changed\n");
+  printf("--lmdedup	write identical lightmap pages once, single colour pages\n");
+  printf("		as 1x1 images, or as vertex colours with -g\n");
+  printf("--pnglevel N	lightmap png compression, 0 none, 1 fast, else best (default)\n");
+  printf("--lmrepack B	keep only the lightmap texels faces use plus a B texel border,\n");
+  printf("		packed into pages of 128 (or the --lmatlas size)\n");
+  exit(1);
+}
 
 int  main(int argc,char **argv)
 {
@@ -37,40 +88,110 @@ int  main(int argc,char **argv)
   VFormatOptions option;
   char *options=NULL;
   char *fileArg = NULL;
+  int jobs = 0; // threads, 0 = one per core
+  int atlasSize = 0; // lightmap atlas size, 0 = one image per page
+  int repackBorder = -1; // lightmap rectangle border, -1 = whole pages
+  int pngLevel = PNG_LEVEL_DEFAULT;
+  bool lightmapDedup = false;
+  bool incremental = false;
+  char *shaderCache = NULL;
   
   int argi=1;	// the current argument 
 
-  if (argc>=2 && argv[argi][0]== '-') { // we have options 
-	  options = argv[argi];
-	  argi++;
+  while (argi < argc && argv[argi][0]== '-') { // we have options 
+	  if (strcmp(argv[argi],"--jobs") == 0 && argi+1 < argc) {
+		  jobs = atoi(argv[argi+1]);
+		  argi+=2;
+	  } 
+	  else if (strcmp(argv[argi],"--split16") == 0) {
+		  option.maxSectionVertices = 65536;
+		  argi++;
+	  } 
+	  else if (strcmp(argv[argi],"--decimals") == 0 && argi+1 < argc) {
+		  option.floatMode = atoi(argv[argi+1]);
+		  if (option.floatMode < 0) option.floatMode = 0;
+		  if (option.floatMode > 9) option.floatMode = 9;
+		  argi+=2;
+	  } 
+	  else if (strcmp(argv[argi],"--shortest") == 0) {
+		  option.floatMode = FLOAT_SHORTEST;
+		  argi++;
+	  } 
+	  else if (strcmp(argv[argi],"--patchlod") == 0 && argi+1 < argc) {
+		  // comma separated error tolerances, finest level first
+		  option.patchLods.clear();
+		  for (char *e = argv[argi+1]; e && *e; ) {
+			  option.patchLods.push_back((float)atof(e));
+			  e = strchr(e,',');
+			  if (e) e++;
+		  }
+		  if (option.patchLods.size() > MAX_LOD_LEVELS)
+			  option.patchLods.resize(MAX_LOD_LEVELS);
+		  argi+=2;
+	  } 
+	  else if (strcmp(argv[argi],"--loderror") == 0 && argi+1 < argc) {
+		  float angle = (float)atof(argv[argi+1]);
+		  if (angle > 0) option.lodScreenError = angle;
+		  argi+=2;
+	  } 
+	  else if (strcmp(argv[argi],"--vcache") == 0 && argi+1 < argc) {
+		  option.vertexCacheSize = atoi(argv[argi+1]);
+		  if (option.vertexCacheSize < 0) option.vertexCacheSize = 0;
+		  argi+=2;
+	  } 
+	  else if (strcmp(argv[argi],"--simplify") == 0 && argi+1 < argc) {
+		  // R or R,E: keep R of the triangles, collapse no edge costing more than E
+		  char *e = argv[argi+1];
+		  option.simplifyRatio = (float)atof(e);
+		  if (option.simplifyRatio < 0) option.simplifyRatio = 0;
+		  if (option.simplifyRatio > 1) option.simplifyRatio = 1;
+		  e = strchr(e,',');
+		  if (e) option.simplifyError = (float)atof(e+1);
+		  if (option.simplifyError < 0) option.simplifyError = 0;
+		  argi+=2;
+	  } 
+	  else if (strcmp(argv[argi],"--lmatlas") == 0 && argi+1 < argc) {
+		  // whole pages only
+		  atlasSize = atoi(argv[argi+1]);
+		  if (atlasSize < LIGHTMAP_WIDTH) atlasSize = LIGHTMAP_WIDTH;
+		  atlasSize -= atlasSize % LIGHTMAP_WIDTH;
+		  argi+=2;
+	  } 
+	  else if (strcmp(argv[argi],"--pnglevel") == 0 && argi+1 < argc) {
+		  pngLevel = atoi(argv[argi+1]);
+		  if (pngLevel < 0 || pngLevel > PNG_LEVEL_FAST) pngLevel = PNG_LEVEL_DEFAULT;
+		  argi+=2;
+	  } 
+	  else if (strcmp(argv[argi],"--incremental") == 0) {
+		  incremental = true;
+		  argi++;
+	  } 
+	  else if (strcmp(argv[argi],"--shadercache") == 0 && argi+1 < argc) {
+		  shaderCache = argv[argi+1];
+		  argi+=2;
+	  } 
+	  else if (strcmp(argv[argi],"--lmdedup") == 0) {
+		  lightmapDedup = true;
+		  argi++;
+	  } 
+	  else if (strcmp(argv[argi],"--lmrepack") == 0 && argi+1 < argc) {
+		  repackBorder = atoi(argv[argi+1]);
+		  if (repackBorder < 0) repackBorder = 0;
+		  argi+=2;
+	  } 
+	  else if (argv[argi][1] == '-') {
+		  // a long option we don't know, or one missing its argument; its
+		  // letters must not be taken for the single letter options below.
+		  printf("Unknown option %s\n\n",argv[argi]);
+		  Usage();
+	  }
+	  else {
+		  options = argv[argi];
+		  argi++;
+	  }
   }	
 
-  if ( argi >= argc )
-  {
-    printf("Usage: q3bsp [-options] <name>.BSP\n");
-    printf("Where <name> is the name of a valid Quake3 BSP file.\n\n");
-    printf("This utility will convert a Quake3 BSP into a valid\n");
-    printf("polygon mesh and output the results into two seperate VRML 1.0\n");
-    printf("files.  The first VRML file contains all the U/V mapping and\n");
-    printf("texture mapping information for channel #1, and the second\n");
-    printf("VRML file will contain all of the U/V mapping and texture names\n");
-    printf("for the second U/V channel, which contains all lightmap\n");
-    printf("information.  You can then directly import these files into any\n");
-    printf("number of 3d editing tools, including 3d Studio Max\n");
-
-    printf("This tool also extracts the lightmap data and saves it out as a\n");
-    printf("series of .BMP files.\n\n");
-    printf("OpenSourced by John W. Ratcliff on December 5, 2000\n");
-    printf("Merry Christmas!\n\n");
-    printf("Contact Id Software about using Quake 3 data files in and\n");
-    printf("Quake 3 editing tools for commercial software development\n");
-    printf("projects.\n");
-    printf("Extended Options: \n");
-    printf("-1		VRML 1 output\n");
-    printf("-2		VRML 2 output 2 files \n");
-    printf("-2me	VRML 2 output with MultiTexture extension nodes & effects\n");
-    exit(1);
-  }
+  if ( argi >= argc ) Usage();
 
   fileArg = argv[argi];
   if (options) {
@@ -101,59 +222,113 @@ int  main(int argc,char **argv)
 	  if (strchr(options,'n'))
 			option.noTextureCoordinates = true;
 
+	  if (strchr(options,'g'))
+			option.glb = true;
+
   }	
   
   Quake3BSP q( SGET(fileArg), SGET("a") );
+  q.SetJobs(jobs);
+  option.jobs = jobs;
+  SetTextureJobs(jobs);
+  QuakeShaderFactory::SetJobs(jobs);
+  if (shaderCache) QuakeShaderFactory::SetCache(shaderCache);
+  q.SetLightmapAtlas(atlasSize);
+  q.SetLightmapRepack(repackBorder);
+  q.SetPngLevel(pngLevel);
+  // of the exporters only glTF draws vertex colours under a texture.
+  q.SetLightmapDedup(lightmapDedup,option.glb);
 
-  VertexMesh *mesh = q.GetVertexMesh();
-  
-
-  if ( mesh )
+  if ( q.IsOk() )
   {
     String str = fileArg;
 	
 	char * del = strrchr(fileArg,'\\');
 	if (del) str = (del+1); // use file name part only
+
+	// with --incremental outputs made from the same files with the same
+	// settings as last time are left alone.
+	Manifest *manifest = 0;
+	String bspName = String(fileArg) + ".bsp";
+	if (incremental) manifest = new Manifest(str + ".manifest");
+
+    // every exporter below references the lightmap images.
+	String lightmapKey;
+	if (manifest) lightmapKey = q.GetLightmapSignature();
+	if (manifest && manifest->IsCurrent("lightmaps",lightmapKey)) {
+		printf("Lightmap images are up to date\n");
+	} else {
+		if (manifest) {
+			manifest->Begin("lightmaps",lightmapKey);
+			manifest->Depend(bspName.c_str());
+		}
+	    q.SaveLightmaps();
+		if (manifest) manifest->End();
+	}
 	
     String name1 = str + "1";
     String name2 = str + "2";
 
+	String meshKey;
+	if (manifest) meshKey = option.GetSignature() + " " + lightmapKey + " " +
+	                        QuakeShaderFactory::GetScriptSignature();
+	bool meshCurrent = manifest && manifest->IsCurrent("mesh",meshKey);
+	if (manifest && !meshCurrent) {
+		manifest->Begin("mesh",meshKey);
+		manifest->Depend(bspName.c_str());
+	}
 
+	if (meshCurrent) {
+		printf("Mesh files are up to date\n");
+	} else
+	if (option.glb) { // binary glTF 
+		printf("Saving binary glTF file %s.glb\n",str.c_str());
+		if (!q.GetVertexMesh(option)->SaveGLB(str,option)) {
+			WaitForTextures();
+			// keep the lightmap group, the mesh is made again next time
+			if (manifest) {
+				manifest->Abort();
+				manifest->Save();
+				delete manifest;
+			}
+			return -1;
+		}
+
+	} else
 	if (option.vrml2) { // VRML 2 style 
 
 		if (!option.useMultiTexturing) {
 		    // save VRML file using channel #1
-			// save VRML file using channel #2
+			// save VRML file using channel #2, both in one pass
 			name1+=".wrl";
 
 			FILE *fph = fopen(name1.c_str(),"wb");
+			RecordOutput(name1.c_str());
 			fprintf(fph,"#VRML V2.0 utf8 generated by QBSP from %s\n",fileArg);
 
 			printf("Saving U/V channel #1 to VRML2 file %s\n",name1.c_str());
+			printf("Saving U/V channel #2 to VRML2 file %s.wrl\n",name2.c_str());
+			name2+=".wrl";
+			FILE *fph2 = fopen(name2.c_str(),"wb");
+			RecordOutput(name2.c_str());
+			fprintf(fph2,"#VRML V2.0 utf8 generated by QBSP from %s\n",fileArg);
+
 			option.tex1= true;
-			mesh->SaveVRML2(fph,option);
+			VertexMesh *mesh = q.GetVertexMesh(option);
+			mesh->SaveVRML2(fph,fph2,option);
+			fclose(fph2);
 			
 			q.SaveEntitiesVRML2(fph,option);
 			
 			fclose(fph);
 
-
-			printf("Saving U/V channel #2 to VRML2 file %s.wrl\n",name2.c_str());
-			name2+=".wrl";
-			fph = fopen(name2.c_str(),"wb");
-			fprintf(fph,"#VRML V2.0 utf8 generated by QBSP from %s\n",fileArg);
-			option.tex1=false;
-			option.matDefined=false;
-			option.useMat = false;
-			mesh->SaveVRML2(fph,option);
-			fclose(fph);
-
 		} else {
 		    name1 = str;
 			printf("Saving MultiTexture extended VRML file %s.wrl\n",name1.c_str());
 
 		    String oname = name1+".wrl";
 			FILE *fph = fopen(oname.c_str(),"wb");
+			RecordOutput(oname.c_str());
 			fprintf(fph,"#VRML V2.0 utf8 generated by Q3BSP 1.1 from %s\n",fileArg);
 			fprintf(fph,"WorldInfo { title \"%s\" }\n\n",fileArg);
 			
@@ -162,6 +337,7 @@ int  main(int argc,char **argv)
 			// write some PROTO's for effects 
 			if (option.useEffects)
 			{
+				RecordDependency("q3effects.wrl");
 				Fload effects("q3effects.wrl");
 				if (!effects.GetData()) {
 					printf("***********q3effects.wrl NOT FOUND\n");
@@ -174,9 +350,9 @@ int  main(int argc,char **argv)
   
 
 			option.tex1= true;
-			if (option.useBsp) 
+			if (option.useBsp) // builds its own per leaf meshes
 				q.SaveNodesBsp(fph,option);
-			else mesh->SaveVRML2(fph,option);
+			else q.GetVertexMesh(option)->SaveVRML2(fph,option);
 			
 			q.SaveEntitiesVRML2(fph,option);
 
@@ -184,10 +360,19 @@ int  main(int argc,char **argv)
 		}
 
 	} else {	// VRML 1 style 
+		VertexMesh *mesh = q.GetVertexMesh(option);
 		printf("Saving U/V channel #1 to file %s.wrl\n",name1.c_str());
-		mesh->SaveVRML(name1,true);
 		printf("Saving U/V channel #2 to file %s.wrl\n",name2.c_str());
-		mesh->SaveVRML(name2,false);
+		mesh->SaveVRML(name1,name2,option.maxSectionVertices);
+	}
+
+	// the converted textures have to be there before the manifest hashes them
+	WaitForTextures();
+
+	if (manifest) {
+		manifest->End();
+		manifest->Save();
+		delete manifest;
 	}
   }
   else
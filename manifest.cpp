@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+//############################################################################
+//##                                                                        ##
+//##  MANIFEST.CPP                                                          ##
+//##                                                                        ##
+//##  Remembers which files the outputs of a run were made from, so the     ##
+//##  next run can skip the outputs whose inputs did not change.            ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include "manifest.h"
+#include "fload.h"
+
+Manifest *Manifest::gActive = 0;
+
+// FNV-1a over 8 byte words, then the tail bytes, with a final mix.  Not
+// meant to resist tampering, only to notice edits.
+unsigned long long HashBytes(const unsigned char *data,size_t len)
+{
+  unsigned long long h = 14695981039346656037ull ^ len;
+  size_t i = 0;
+  for (; i+8<=len; i+=8)
+  {
+    unsigned long long w;
+    memcpy(&w,data+i,8);
+    h = (h ^ w) * 1099511628211ull;
+    h ^= h >> 29;
+  }
+  for (; i<len; i++) h = (h ^ data[i]) * 1099511628211ull;
+  h ^= h >> 32;
+  h *= 0xD6E8FEB86659FD93ull;
+  h ^= h >> 32;
+  return h ? h : 1;
+}
+
+static unsigned long long HashText(const String &text)
+{
+  return HashBytes((const unsigned char *)text.c_str(),text.size());
+}
+
+unsigned long long HashFile(const char *fname)
+{
+  Fmap file(fname);
+  if ( file.GetData() )
+    return HashBytes((const unsigned char *)file.GetData(),file.GetLen());
+
+  // empty, or not there at all
+  FILE *fph = fopen(fname,"rb");
+  if ( !fph ) return 0;
+  fclose(fph);
+  return HashBytes(0,0);
+}
+
+Manifest::Manifest(const String &fname)
+{
+  mName = fname;
+  mCurrent = -1;
+  gActive = this;
+
+  FILE *fph = fopen(fname.c_str(),"rb");
+  if ( !fph ) return;
+
+  char line[2048];
+  if ( !fgets(line,sizeof(line),fph) || strncmp(line,"q3bsp-manifest 1",16) != 0 )
+  {
+    printf("Ignoring %s, not a manifest of this version.\n",fname.c_str());
+    fclose(fph);
+    return;
+  }
+
+  Group *group = 0;
+  while ( fgets(line,sizeof(line),fph) )
+  {
+    char *end = line+strlen(line);
+    while ( end > line && (end[-1] == '\n' || end[-1] == '\r') ) *--end = 0;
+
+    char name[256], src[1024], dst[1024];
+    unsigned long long hash;
+    int used = 0;
+    if ( sscanf(line,"group %255s %llx",name,&hash) == 2 )
+    {
+      mOld.push_back(Group());
+      group = &mOld.back();
+      group->name = name;
+      group->key = hash;
+    }
+    else if ( sscanf(line,"dep %llx %n",&hash,&used) == 1 && used && group )
+    {
+      group->deps.push_back(line+used);
+      group->hashes.push_back(hash);
+    }
+    else if ( strncmp(line,"out ",4) == 0 && group )
+    {
+      group->outs.push_back(line+4);
+    }
+    else if ( sscanf(line,"convert %llx %1023s %1023s",&hash,src,dst) == 3 )
+    {
+      mConversions[dst].src = src;
+      mConversions[dst].hash = hash;
+    }
+  }
+  fclose(fph);
+}
+
+Manifest::~Manifest(void)
+{
+  if ( gActive == this ) gActive = 0;
+}
+
+unsigned long long Manifest::GetHash(const String &fname)
+{
+  std::map< String, unsigned long long >::iterator found = mHashes.find(fname);
+  if ( found != mHashes.end() ) return found->second;
+  unsigned long long hash = HashFile(fname.c_str());
+  mHashes[fname] = hash;
+  return hash;
+}
+
+bool Manifest::IsCurrent(const char *name,const String &key)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  for (size_t g=0; g<mOld.size(); g++)
+  {
+    const Group &old = mOld[g];
+    if ( old.name != name ) continue;
+    if ( old.key != HashText(key) ) return false;
+    for (size_t d=0; d<old.deps.size(); d++)
+    {
+      if ( GetHash(old.deps[d]) != old.hashes[d] ) return false;
+    }
+    for (size_t o=0; o<old.outs.size(); o++)
+    {
+      if ( !GetHash(old.outs[o]) ) return false;
+    }
+    mGroups.push_back(old);
+    return true;
+  }
+  return false;
+}
+
+void Manifest::Begin(const char *name,const String &key)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mCurrent = (int)mGroups.size();
+  mGroups.push_back(Group());
+  mGroups[mCurrent].name = name;
+  mGroups[mCurrent].key = HashText(key);
+}
+
+void Manifest::End(void)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mCurrent = -1;
+}
+
+void Manifest::Abort(void)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  if ( mCurrent < 0 ) return;
+  String name = mGroups[mCurrent].name;
+  mGroups.erase(mGroups.begin()+mCurrent);
+  for (size_t g=mOld.size(); g-- > 0; )
+  {
+    if ( mOld[g].name == name ) mOld.erase(mOld.begin()+g);
+  }
+  mCurrent = -1;
+}
+
+void Manifest::Depend(const char *fname)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  if ( mCurrent < 0 ) return;
+  Group &group = mGroups[mCurrent];
+  for (size_t d=0; d<group.deps.size(); d++)
+  {
+    if ( group.deps[d] == fname ) return;
+  }
+  group.deps.push_back(fname);
+}
+
+void Manifest::Output(const char *fname)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mHashes.erase(fname); // changed under us
+  if ( mCurrent >= 0 ) mGroups[mCurrent].outs.push_back(fname);
+}
+
+bool Manifest::IsConversionCurrent(const char *src,const char *dst)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  std::map< String, Conversion >::iterator found = mConversions.find(dst);
+  if ( found == mConversions.end() || found->second.src != src ) return true;
+  if ( mCurrent >= 0 )
+  {
+    StringVector &deps = mGroups[mCurrent].deps;
+    if ( std::find(deps.begin(),deps.end(),String(src)) == deps.end() ) deps.push_back(src);
+  }
+  unsigned long long hash = GetHash(src);
+  return !hash || hash == found->second.hash;
+}
+
+void Manifest::Converted(const char *src,const char *dst)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mHashes.erase(dst);
+  mConversions[dst].src = src;
+  mConversions[dst].hash = GetHash(src);
+}
+
+bool Manifest::Save(void)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  FILE *fph = fopen(mName.c_str(),"wb");
+  if ( !fph )
+  {
+    printf("Failed to write manifest %s\n",mName.c_str());
+    return false;
+  }
+
+  fprintf(fph,"q3bsp-manifest 1\n");
+
+  // the groups of this run first, then those it did not touch.
+  std::vector< Group > groups = mGroups;
+  for (size_t g=0; g<mOld.size(); g++)
+  {
+    bool seen = false;
+    for (size_t n=0; n<mGroups.size(); n++) seen |= mGroups[n].name == mOld[g].name;
+    if ( !seen ) groups.push_back(mOld[g]);
+  }
+
+  for (size_t g=0; g<groups.size(); g++)
+  {
+    Group &group = groups[g];
+    fprintf(fph,"group %s %016llx\n",group.name.c_str(),group.key);
+    for (size_t d=0; d<group.deps.size(); d++)
+    {
+      // taken after the run, as the outputs were made from.
+      unsigned long long hash = d < group.hashes.size() ? group.hashes[d] : GetHash(group.deps[d]);
+      fprintf(fph,"dep %016llx %s\n",hash,group.deps[d].c_str());
+    }
+    for (size_t o=0; o<group.outs.size(); o++)
+    {
+      fprintf(fph,"out %s\n",group.outs[o].c_str());
+    }
+  }
+
+  std::map< String, Conversion >::iterator i;
+  for (i=mConversions.begin(); i!=mConversions.end(); ++i)
+  {
+    fprintf(fph,"convert %016llx %s %s\n",i->second.hash,i->second.src.c_str(),i->first.c_str());
+  }
+
+  fclose(fph);
+  return true;
+}
+
+void RecordDependency(const char *fname)
+{
+  Manifest *manifest = Manifest::GetActive();
+  if ( manifest ) manifest->Depend(fname);
+}
+
+void RecordOutput(const char *fname)
+{
+  Manifest *manifest = Manifest::GetActive();
+  if ( manifest ) manifest->Output(fname);
+}
@@ -0,0 +1,107 @@
+#ifndef MANIFEST_H
+
+#define MANIFEST_H
+
+//############################################################################
+//##                                                                        ##
+//##  MANIFEST.H                                                            ##
+//##                                                                        ##
+//##  Remembers which files the outputs of a run were made from, so the     ##
+//##  next run can skip the outputs whose inputs did not change.            ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include <mutex>
+#include "stl.h"
+
+// The outputs are made in groups (the lightmap images, the mesh files).
+// A group is keyed by a text that holds everything besides files that
+// changes its outputs, like the options, and depends on the files read
+// while it was made.  Every file is compared by a hash of its content.
+//
+// manifest file, one record per line:
+//   q3bsp-manifest 1
+//   group <name> <key hash>
+//   dep <content hash> <file>        files the group above depends on
+//   out <file>                       files the group above made
+//   convert <content hash> <src> <dst>  textures converted, any group
+class Manifest
+{
+public:
+  // reads the manifest of the previous run, if there is one, and makes
+  // this the manifest the Record functions below go to.
+  Manifest(const String &fname);
+  ~Manifest(void);
+
+  // true if the previous run made group 'name' with the same key, none of
+  // the files it depended on changed and all of its outputs are still
+  // there; the group is then kept as it was.
+  bool IsCurrent(const char *name,const String &key);
+
+  // record the files of group 'name' from here to End, replacing what
+  // the previous run had for it.
+  void Begin(const char *name,const String &key);
+  void End(void);
+
+  // the group begun did not complete: it is dropped along with what the
+  // previous run had for it, so the next run makes it again.
+  void Abort(void);
+
+  void Depend(const char *fname);
+  void Output(const char *fname);
+
+  // false if dst was converted from src by an earlier run and src changed
+  // since, dst then has to be converted again.  When dst came from src the
+  // group being made depends on src too.
+  bool IsConversionCurrent(const char *src,const char *dst);
+  void Converted(const char *src,const char *dst);
+
+  bool Save(void);
+
+  // the manifest of this run, NULL if there is none.
+  static Manifest * GetActive(void) { return gActive; };
+
+private:
+  class Group
+  {
+  public:
+    String                name;
+    unsigned long long    key;
+    StringVector          deps;
+    std::vector< unsigned long long > hashes;
+    StringVector          outs;
+  };
+
+  class Conversion
+  {
+  public:
+    String             src;
+    unsigned long long hash;
+  };
+
+  unsigned long long GetHash(const String &fname);
+
+  String                          mName;
+  std::vector< Group >            mOld;
+  std::vector< Group >            mGroups;
+  int                             mCurrent; // group being made, -1 none
+  std::map< String, Conversion >  mConversions; // by dst
+  std::map< String, unsigned long long > mHashes; // files hashed this run
+  std::mutex                      mMutex;
+
+  static Manifest *gActive;
+};
+
+// content hash of a file, 0 if it does not exist.
+unsigned long long HashFile(const char *fname);
+unsigned long long HashBytes(const unsigned char *data,size_t len); // never 0
+
+// To the active manifest, if any.  Safe from any thread.
+void RecordDependency(const char *fname);
+void RecordOutput(const char *fname);
+
+#endif
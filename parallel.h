@@ -0,0 +1,144 @@
+#ifndef PARALLEL_H
+
+#define PARALLEL_H
+
+//############################################################################
+//##                                                                        ##
+//##  PARALLEL.H                                                            ##
+//##                                                                        ##
+//##  Minimal helper to spread independent work items over threads.         ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "stl.h"
+
+// number of threads to use for a requested job count, 0 or less means one
+// per hardware thread.
+inline int GetJobCount(int jobs)
+{
+  if ( jobs > 0 ) return jobs;
+  int hw = (int) std::thread::hardware_concurrency();
+  return hw > 0 ? hw : 1;
+}
+
+// Calls func(i) for every i in [0,count) on up to 'jobs' threads.  Items are
+// handed out in increasing order but may finish in any order, so func must
+// only write to state owned by item i.  Returns when all items are done.
+template <class Func> void ParallelFor(int count,int jobs,const Func &func)
+{
+  jobs = GetJobCount(jobs);
+  if ( jobs > count ) jobs = count;
+
+  if ( jobs <= 1 )
+  {
+    for (int i=0; i<count; i++) func(i);
+    return;
+  }
+
+  std::atomic<int> next(0);
+  std::vector< std::thread > threads;
+  threads.reserve(jobs-1);
+
+  struct Worker
+  {
+    static void Run(std::atomic<int> *next,int count,const Func *func)
+    {
+      for (int i=(*next)++; i<count; i=(*next)++) (*func)(i);
+    }
+  };
+
+  for (int t=1; t<jobs; t++)
+  {
+    threads.push_back( std::thread(Worker::Run,&next,count,&func) );
+  }
+  Worker::Run(&next,count,&func); // this thread works too.
+
+  for (size_t t=0; t<threads.size(); t++) threads[t].join();
+}
+
+// Runs jobs in the background on up to 'jobs' threads, started as work
+// comes in.  Jobs run in any order; Wait returns once all jobs added so
+// far are done.  The destructor waits too.
+class JobQueue
+{
+public:
+  JobQueue(int jobs)
+  {
+    mJobs = GetJobCount(jobs);
+    mBusy = 0;
+    mStop = false;
+  };
+
+  ~JobQueue(void)
+  {
+    Wait();
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mStop = true;
+    }
+    mWake.notify_all();
+    for (size_t t=0; t<mThreads.size(); t++) mThreads[t].join();
+  };
+
+  void Add(const std::function<void()> &job)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mPending.push_back(job);
+      if ( (int)mThreads.size() < mJobs && mBusy+mPending.size() > mThreads.size() )
+      {
+        mThreads.push_back( std::thread(&JobQueue::Run,this) );
+      }
+    }
+    mWake.notify_one();
+  };
+
+  void Wait(void)
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mDone.wait(lock,[this] { return mPending.empty() && mBusy == 0; });
+  };
+
+private:
+  JobQueue(const JobQueue &copy);            // not copyable
+  JobQueue& operator=(const JobQueue &copy);
+
+  void Run(void)
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while ( 1 )
+    {
+      mWake.wait(lock,[this] { return mStop || !mPending.empty(); });
+      if ( mPending.empty() ) return; // stopping
+
+      std::function<void()> job = mPending.front();
+      mPending.pop_front();
+      mBusy++;
+      lock.unlock();
+      job();
+      lock.lock();
+      mBusy--;
+      if ( mPending.empty() && mBusy == 0 ) mDone.notify_all();
+    }
+  };
+
+  int                                  mJobs;
+  size_t                               mBusy;
+  bool                                 mStop;
+  std::deque< std::function<void()> >  mPending;
+  std::vector< std::thread >           mThreads;
+  std::mutex                           mMutex;
+  std::condition_variable              mWake;
+  std::condition_variable              mDone;
+};
+
+#endif
@@ -23,44 +23,47 @@
 
 #include "patch.h"
 
+// The subdivision kernel works on all vertex components of many curves at
+// once, 8 floats at a time with AVX, 4 with SSE.
+#if defined(__AVX__)
+#include <immintrin.h>
+#define PATCH_LANES 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PATCH_LANES 4
+#else
+#define PATCH_LANES 1
+#endif
+
 #define LEVEL_WIDTH(lvl) ((1 << (lvl+1)) + 1)
 #define MAXMESHLEVEL 5
-#define MINDIST (0.4f*0.4f)
+
+// floats of a LightMapVertex that get interpolated: pos, texel1, texel2, color
+#define VERTEX_COMPONENTS 10
 
 
 PatchSurface::PatchSurface(const LightMapVertex *cp,
                            int npoints,
                            int controlx,
-                           int controly)
+                           int controly,
+                           float maxError)
 {
   int sizex,sizey;
-  FindSize(controlx,controly,cp,sizex,sizey);
+  FindSize(controlx,controly,cp,maxError,sizex,sizey);
+  mSizeX = sizex;
+  mSizeY = sizey;
 
   int size = sizex*sizey;
   mPoints = new LightMapVertex[size];
 
-  int stepx = (sizex-1) / (controlx-1);
-  int stepy = (sizey-1) / (controly-1);
-  const LightMapVertex *control = cp;
-
-  for (int y=0; y<sizey; y+=stepy)
-  {
-    for (int x=0; x<sizex; x+=stepx)
-    {
-      int p = y*sizex+x;
-      mPoints[p] = *control++;
-    }
-  }
-
-
-  FillPatch(controlx,controly,sizex,sizey,mPoints);
+  FillPatch(cp,controlx,controly,sizex,sizey,mPoints);
 
   mCount = (sizex-1)*(sizey-1)*6;
 
   if ( 1 )
   {
-    mIndices = new unsigned short[mCount];
-    unsigned short *foo = mIndices;
+    mIndices = new unsigned int[mCount];
+    unsigned int *foo = mIndices;
     for (int y=0; y < sizey-1; ++y)
     {
     	for (int x = 0; x < sizex-1; ++x)
@@ -79,14 +82,16 @@ PatchSurface::PatchSurface(const LightMapVertex *cp,
 
 PatchSurface::~PatchSurface(void)
 {
-  delete mIndices;
-  delete mPoints;
+  delete [] mIndices;
+  delete [] mPoints;
 }
 
 
 
-bool PatchSurface::FindSize(int controlx,int controly,const LightMapVertex *cp,int &sizex,int &sizey) const
+bool PatchSurface::FindSize(int controlx,int controly,const LightMapVertex *cp,float maxError,int &sizex,int &sizey)
 {
+  float maxError2 = maxError*maxError;
+
   /* Find non-coincident pairs in u direction */
 
   bool found=false;
@@ -120,7 +125,7 @@ bool PatchSurface::FindSize(int controlx,int controly,const LightMapVertex *cp,i
   }
 
   /* Find subdivision level in u */
-  int levelx = FindLevel(a[0].mPos,a[1].mPos,b[0].mPos);
+  int levelx = FindLevel(a[0].mPos,a[1].mPos,b[0].mPos,maxError2);
   sizex = (LEVEL_WIDTH(levelx) - 1) * ((controlx-1) / 2) + 1;
 
 
@@ -150,7 +155,7 @@ bool PatchSurface::FindSize(int controlx,int controly,const LightMapVertex *cp,i
   }
 
   /* Find subdivision level in u */
-  int levely = FindLevel(a[0].mPos,a[1].mPos,b[0].mPos);
+  int levely = FindLevel(a[0].mPos,a[1].mPos,b[0].mPos,maxError2);
   sizey = (LEVEL_WIDTH(levely) - 1) * ((controly-1) / 2) + 1;
 
   return true;
@@ -159,7 +164,8 @@ bool PatchSurface::FindSize(int controlx,int controly,const LightMapVertex *cp,i
 
 int PatchSurface::FindLevel(const Vector3d<float> &cv0,
                             const Vector3d<float> &cv1,
-                            const Vector3d<float> &cv2) const
+                            const Vector3d<float> &cv2,
+                            float maxError2)
 {
   int level;
   Vector3d<float> a,b,dist;
@@ -180,7 +186,7 @@ int PatchSurface::FindLevel(const Vector3d<float> &cv0,
     dist = v2-v1;
 
     float dist2 = dist.x*dist.x + dist.y*dist.y + dist.z*dist.z;
-    if ( dist2 < MINDIST ) break;
+    if ( dist2 < maxError2 ) break;
 
 	  /* Insert new middle vertex */
     v1 = a;
@@ -189,46 +195,154 @@ int PatchSurface::FindLevel(const Vector3d<float> &cv0,
   return level;
 }
 
-void PatchSurface::FillPatch(int controlx,int controly,int sizex,int sizey,LightMapVertex *p)
+static void GetComponents(const LightMapVertex &v,float *c)
 {
-  int stepx = (sizex-1) / (controlx-1);
-  for (int u = 0; u < sizex; u += stepx)
+  c[0] = v.mPos.x;
+  c[1] = v.mPos.y;
+  c[2] = v.mPos.z;
+  c[3] = v.mTexel1.x;
+  c[4] = v.mTexel1.y;
+  c[5] = v.mTexel2.x;
+  c[6] = v.mTexel2.y;
+  c[7] = v.mColor.x;
+  c[8] = v.mColor.y;
+  c[9] = v.mColor.z;
+}
+
+static void SetComponents(LightMapVertex &v,const float *c)
+{
+  v.mPos.x    = c[0];
+  v.mPos.y    = c[1];
+  v.mPos.z    = c[2];
+  v.mTexel1.x = c[3];
+  v.mTexel1.y = c[4];
+  v.mTexel2.x = c[5];
+  v.mTexel2.y = c[6];
+  v.mColor.x  = c[7];
+  v.mColor.y  = c[8];
+  v.mColor.z  = c[9];
+}
+
+// lanes subdivided together, small enough for all rows of a curve to stay
+// in the L1 cache.
+#define LANE_BLOCK 64
+
+// One de Casteljau split of the quadratic p0,pm,p2 on 'lanes' lanes:
+//   a = avg(p0,pm)  b = avg(pm,p2)  pm = avg(a,b)
+// Every average is (to-from)*0.5+from, the same operations in the same
+// order as LightMapVertex::Lerp.
+static void SplitRows(const float *p0,float *pm,const float *p2,float *a,float *b,int lanes)
+{
+  int i = 0;
+#if PATCH_LANES == 8
+  const __m256 half = _mm256_set1_ps(0.5f);
+  for (; i+8<=lanes; i+=8)
+  {
+    __m256 v0 = _mm256_loadu_ps(p0+i);
+    __m256 vm = _mm256_loadu_ps(pm+i);
+    __m256 v2 = _mm256_loadu_ps(p2+i);
+    __m256 va = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(vm,v0),half),v0);
+    __m256 vb = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(v2,vm),half),vm);
+    _mm256_storeu_ps(pm+i,_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(vb,va),half),va));
+    _mm256_storeu_ps(a+i,va);
+    _mm256_storeu_ps(b+i,vb);
+  }
+#endif
+#if PATCH_LANES >= 4
+  const __m128 half4 = _mm_set1_ps(0.5f);
+  for (; i+4<=lanes; i+=4)
+  {
+    __m128 v0 = _mm_loadu_ps(p0+i);
+    __m128 vm = _mm_loadu_ps(pm+i);
+    __m128 v2 = _mm_loadu_ps(p2+i);
+    __m128 va = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(vm,v0),half4),v0);
+    __m128 vb = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(v2,vm),half4),vm);
+    _mm_storeu_ps(pm+i,_mm_add_ps(_mm_mul_ps(_mm_sub_ps(vb,va),half4),va));
+    _mm_storeu_ps(a+i,va);
+    _mm_storeu_ps(b+i,vb);
+  }
+#endif
+  for (; i<lanes; i++)
   {
-  	FillCurve(controly, sizey,sizex,p+u);
+    float va = (pm[i]-p0[i])*0.5f+p0[i];
+    float vb = (p2[i]-pm[i])*0.5f+pm[i];
+    pm[i] = (vb-va)*0.5f+va;
+    a[i] = va;
+    b[i] = vb;
   }
-  for (int v = 0; v < sizey; v++)
+}
+
+// Subdivides 'lanes' independent curves at once.  Row r, 'pitch' floats
+// apart, holds point r of every curve.  Rows at multiples of
+// (size-1)/(numcp-1) must hold the control points, all other rows are
+// filled in.  The lanes are worked through in blocks so that the rows
+// being split stay in the cache.
+static void FillCurves(int numcp,int size,int lanes,int pitch,float *rows)
+{
+  float scratch[2*LANE_BLOCK];
+
+  for (int lane=0; lane<lanes; lane+=LANE_BLOCK)
   {
-  	FillCurve(controlx, sizex, 1, p + v * sizex);
+    int count = lanes-lane < LANE_BLOCK ? lanes-lane : LANE_BLOCK;
+    float *base = rows+lane;
+    int step = (size-1) / (numcp-1);
+
+    while (step > 0)
+    {
+      int halfstep = step / 2;
+      for (int i=0; i < size-1; i += step*2)
+      {
+        float *a = scratch;
+        float *b = scratch+LANE_BLOCK;
+        if (halfstep > 0)
+        {
+          a = base + (i+halfstep)*pitch;
+          b = base + (i+3*halfstep)*pitch;
+        }
+        SplitRows(base + i*pitch, base + (i+step)*pitch, base + (i+step*2)*pitch, a, b, count);
+      }
+      step /= 2;
+    }
   }
 }
 
-void PatchSurface::FillCurve(int numcp, int size, int stride,LightMapVertex *p)
+// Tessellates the patch in structure of arrays form, the floats of a
+// vertex being lanes next to each other.  The control rows are subdivided
+// first, in a small buffer holding the control rows side by side for every
+// x.  They are then copied into their rows of the patch, where a row of
+// vertices is a row of lanes, so the columns are subdivided in place for
+// the whole width at once.
+void PatchSurface::FillPatch(const LightMapVertex *cp,int controlx,int controly,int sizex,int sizey,LightMapVertex *p)
 {
-  int step, halfstep, i, mid;
-  LightMapVertex a,b;
+  assert( sizeof(LightMapVertex) == sizeof(float)*VERTEX_COMPONENTS );
+
+  int stepx = (sizex-1) / (controlx-1);
+  int stepy = (sizey-1) / (controly-1);
+
+  int lanes = VERTEX_COMPONENTS*controly; // lanes of the row pass
 
-  step = (size-1) / (numcp-1);
+  // per thread work space, grown as needed.
+  static thread_local std::vector< float > rows;
+  if ( rows.size() < (size_t)(sizex*lanes) ) rows.resize(sizex*lanes);
 
-  while (step > 0)
+  for (int y=0; y<controly; y++)
   {
-	  halfstep = step / 2;
-  	for (i=0; i < size-1; i += step*2)
-	  {
-	    mid = (i+step)*stride;
-      a.Lerp(p[i*stride],p[mid],0.5f);
-      b.Lerp(p[mid],p[(i+step*2)*stride],0.5f);
-      p[mid].Lerp(a,b,0.5f);
-
-//	    vec_avg(p[i*stride], p[mid], a);
-//	    vec_avg(p[mid], p[(i+step*2)*stride], b);
-//	    vec_avg(a, b, p[mid]);
-
-	    if (halfstep > 0)
-	    {
-		    p[(i+halfstep)*stride]   = a;
-    		p[(i+3*halfstep)*stride] = b;
-	    }
-	  }
-  	step /= 2;
+    for (int x=0; x<controlx; x++)
+    {
+      GetComponents(*cp++,&rows[x*stepx*lanes+y*VERTEX_COMPONENTS]);
+    }
   }
+
+  FillCurves(controlx,sizex,lanes,lanes,&rows[0]);
+
+  for (int y=0; y<controly; y++)
+  {
+    LightMapVertex *dest = p + y*stepy*sizex;
+    for (int x=0; x<sizex; x++)
+    {
+      SetComponents(dest[x],&rows[x*lanes+y*VERTEX_COMPONENTS]);
+    }
+  }
+
+  FillCurves(controly,sizey,VERTEX_COMPONENTS*sizex,VERTEX_COMPONENTS*sizex,(float *)p);
 }
@@ -22,28 +22,42 @@
 
 #include "vformat.h"
 
+// default geometric error tolerance of the tessellation: a curve is
+// subdivided until splitting it moves its middle by less than this.
+#define PATCH_MAX_ERROR 0.4f
+
 class PatchSurface
 {
 public:
-  PatchSurface(const LightMapVertex *control_points,int npoints,int controlx,int controly);
+  PatchSurface(const LightMapVertex *control_points,int npoints,int controlx,int controly,
+               float maxError=PATCH_MAX_ERROR);
   ~PatchSurface(void);
 
   const LightMapVertex * GetVerts(void) const { return mPoints; };
-  const unsigned short * GetIndices(void) const { return mIndices; };
+  const unsigned int * GetIndices(void) const { return mIndices; };
   int GetIndiceCount(void) const { return mCount; };
 
+  // vertices along u and v, equal sizes mean equal tessellations.
+  int GetSizeX(void) const { return mSizeX; };
+  int GetSizeY(void) const { return mSizeY; };
+
+  // vertices along u and v the patch gets at tolerance maxError, without
+  // tessellating it.
+  static bool FindSize(int controlx,int controly,const LightMapVertex *cp,float maxError,int &sizex,int &sizey);
+
 private:
-  bool FindSize(int controlx,int controly,const LightMapVertex *cp,int &sizex,int &sizey) const;
-  void FillPatch(int controlx,int controly,int sizex,int sizey,LightMapVertex *points);
-  void FillCurve(int numcp, int size, int stride,LightMapVertex *p);
+  void FillPatch(const LightMapVertex *cp,int controlx,int controly,int sizex,int sizey,LightMapVertex *points);
 
-  int FindLevel(const Vector3d<float> &cv0,
-                const Vector3d<float> &cv1,
-                const Vector3d<float> &cv2) const;
+  static int FindLevel(const Vector3d<float> &cv0,
+                       const Vector3d<float> &cv1,
+                       const Vector3d<float> &cv2,
+                       float maxError2);
 
+  int                  mSizeX;
+  int                  mSizeY;
   int                  mCount;
   LightMapVertex      *mPoints;       // vertices produced.
-  unsigned short      *mIndices;      // indices into those vertices
+  unsigned int        *mIndices;      // indices into those vertices
 };
 
 #endif
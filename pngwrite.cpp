@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+//############################################################################
+//##                                                                        ##
+//##  PNGWRITE.CPP                                                          ##
+//##                                                                        ##
+//##  Writes 8 bit RGB/RGBA PNG files, with a fast deflate for the low     ##
+//##  compression levels.                                                   ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include "pngwrite.h"
+#include "stl.h"
+#include "stb_image_write.h"
+#include <mutex>
+
+// part of stb_image_write, not declared in its header
+unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len);
+
+static unsigned int Crc32(unsigned int crc,const unsigned char *data,size_t len)
+{
+  static const struct CrcTable
+  {
+    CrcTable(void)
+    {
+      for (unsigned int n=0; n<256; n++)
+      {
+        unsigned int c = n;
+        for (int k=0; k<8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        mTable[n] = c;
+      }
+    }
+    unsigned int mTable[256];
+  } table;
+
+  crc = ~crc;
+  for (size_t i=0; i<len; i++) crc = table.mTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+static unsigned int Adler32(const unsigned char *data,size_t len)
+{
+  unsigned int a = 1, b = 0;
+  while ( len )
+  {
+    size_t n = len < 5552 ? len : 5552; // no overflow before the modulo
+    len -= n;
+    while ( n-- )
+    {
+      a += *data++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return (b << 16) | a;
+}
+
+// deflate bit stream, least significant bit first
+class BitWriter
+{
+public:
+  BitWriter(UCharVector &out) : mOut(out) { mBits = 0; mCount = 0; };
+
+  void Put(unsigned int bits,int count)
+  {
+    mBits |= (unsigned long long)bits << mCount;
+    mCount += count;
+    while ( mCount >= 8 )
+    {
+      mOut.push_back((unsigned char)mBits);
+      mBits >>= 8;
+      mCount -= 8;
+    }
+  };
+
+  void Align(void) { if ( mCount ) Put(0,8-mCount); };
+
+private:
+  UCharVector       &mOut;
+  unsigned long long mBits;
+  int                mCount;
+};
+
+static const unsigned short gLengthBase[29] =
+{ 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const unsigned char gLengthExtra[29] =
+{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const unsigned short gDistBase[30] =
+{ 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,
+  4097,6145,8193,12289,16385,24577 };
+static const unsigned char gDistExtra[30] =
+{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+// the fixed Huffman codes of deflate, bit reversed for the LSB first stream
+class FixedCodes
+{
+public:
+  FixedCodes(void)
+  {
+    for (int i=0; i<288; i++)
+    {
+      int code, len;
+      if ( i < 144 )      { code = 0x30+i;        len = 8; }
+      else if ( i < 256 ) { code = 0x190+i-144;   len = 9; }
+      else if ( i < 280 ) { code = i-256;         len = 7; }
+      else                { code = 0xC0+i-280;    len = 8; }
+      mLit[i] = (unsigned short)Reverse(code,len);
+      mLitLen[i] = (unsigned char)len;
+    }
+    for (int i=0; i<30; i++) mDist[i] = (unsigned char)Reverse(i,5);
+    for (int l=3, c=0; l<=258; l++)
+    {
+      while ( c < 28 && l >= gLengthBase[c+1] ) c++;
+      mLengthCode[l] = (unsigned char)c;
+    }
+  };
+
+  static unsigned int Reverse(unsigned int code,int len)
+  {
+    unsigned int r = 0;
+    for (int i=0; i<len; i++) r |= ((code >> i) & 1) << (len-1-i);
+    return r;
+  };
+
+  unsigned short mLit[288];
+  unsigned char  mLitLen[288];
+  unsigned char  mDist[30];
+  unsigned char  mLengthCode[259];
+};
+
+static int DistCode(int dist)
+{
+  int c = 29;
+  while ( gDistBase[c] > dist ) c--;
+  return c;
+}
+
+#define FAST_HASH_BITS 15
+#define FAST_WINDOW    32768
+
+// one fixed Huffman block; matches are found with a single probe of a
+// hash of the next 4 bytes, good enough for lightmaps and fast.
+static void DeflateFast(const unsigned char *data,size_t len,UCharVector &out)
+{
+  static const FixedCodes codes;
+
+  BitWriter bits(out);
+  bits.Put(1,1); // last block
+  bits.Put(1,2); // fixed Huffman codes
+
+  IntVector head(1<<FAST_HASH_BITS,-1);
+  size_t i = 0;
+  while ( i < len )
+  {
+    int length = 0;
+    int dist = 0;
+    if ( i+4 <= len )
+    {
+      unsigned int v;
+      memcpy(&v,data+i,4);
+      unsigned int h = (v*2654435761u) >> (32-FAST_HASH_BITS);
+      int cand = head[h];
+      head[h] = (int)i;
+      if ( cand >= 0 && i-cand <= FAST_WINDOW && memcmp(data+cand,data+i,4) == 0 )
+      {
+        size_t limit = len-i < 258 ? len-i : 258;
+        size_t n = 4;
+        while ( n < limit && data[cand+n] == data[i+n] ) n++;
+        length = (int)n;
+        dist = (int)(i-cand);
+      }
+    }
+
+    if ( length )
+    {
+      int lc = codes.mLengthCode[length];
+      bits.Put(codes.mLit[257+lc],codes.mLitLen[257+lc]);
+      bits.Put(length-gLengthBase[lc],gLengthExtra[lc]);
+      int dc = DistCode(dist);
+      bits.Put(codes.mDist[dc],5);
+      bits.Put(dist-gDistBase[dc],gDistExtra[dc]);
+      i += length;
+    }
+    else
+    {
+      bits.Put(codes.mLit[data[i]],codes.mLitLen[data[i]]);
+      i++;
+    }
+  }
+  bits.Put(codes.mLit[256],codes.mLitLen[256]); // end of block
+  bits.Align();
+}
+
+static void DeflateStore(const unsigned char *data,size_t len,UCharVector &out)
+{
+  size_t i = 0;
+  do
+  {
+    size_t n = len-i < 65535 ? len-i : 65535;
+    out.push_back(i+n == len ? 1 : 0);
+    out.push_back((unsigned char)n);
+    out.push_back((unsigned char)(n >> 8));
+    out.push_back((unsigned char)~n);
+    out.push_back((unsigned char)(~n >> 8));
+    out.insert(out.end(),data+i,data+i+n);
+    i += n;
+  } while ( i < len );
+}
+
+static void PutBig32(UCharVector &out,unsigned int v)
+{
+  out.push_back((unsigned char)(v >> 24));
+  out.push_back((unsigned char)(v >> 16));
+  out.push_back((unsigned char)(v >> 8));
+  out.push_back((unsigned char)v);
+}
+
+static void PutChunk(UCharVector &out,const char *type,const unsigned char *data,size_t len)
+{
+  PutBig32(out,(unsigned int)len);
+  size_t start = out.size();
+  out.insert(out.end(),type,type+4);
+  if ( len ) out.insert(out.end(),data,data+len);
+  PutBig32(out,Crc32(0,&out[start],len+4));
+}
+
+bool WritePng(const char *fname,int wid,int hit,int comp,
+              const unsigned char *data,int stride,int level)
+{
+  if ( level != PNG_LEVEL_STORE && level != PNG_LEVEL_FAST )
+  {
+    // stb fills its crc table on first use, which is not thread safe, so
+    // have one image written before any threads race for it.
+    static std::once_flag stbReady;
+    std::call_once(stbReady,[]
+    {
+      unsigned char pixel[4] = { 0, 0, 0, 0 };
+      int len;
+      free(stbi_write_png_to_mem(pixel,4,1,1,4,&len));
+    });
+    return stbi_write_png(fname,wid,hit,comp,data,stride) != 0;
+  }
+
+  // every row filtered with 'up', which suits smooth lightmaps.
+  size_t row = (size_t)wid*comp;
+  UCharVector filtered((row+1)*hit);
+  for (int y=0; y<hit; y++)
+  {
+    unsigned char *dest = &filtered[(row+1)*y];
+    const unsigned char *src = data + (size_t)y*stride;
+    if ( y == 0 )
+    {
+      dest[0] = 0;
+      memcpy(dest+1,src,row);
+      continue;
+    }
+    const unsigned char *above = src - stride;
+    dest[0] = 2;
+    for (size_t x=0; x<row; x++) dest[x+1] = (unsigned char)(src[x] - above[x]);
+  }
+
+  UCharVector zlib;
+  zlib.reserve(filtered.size()/2+64);
+  zlib.push_back(0x78);
+  zlib.push_back(0x01);
+  if ( level == PNG_LEVEL_STORE )
+    DeflateStore(filtered.size() ? &filtered[0] : 0,filtered.size(),zlib);
+  else
+    DeflateFast(filtered.size() ? &filtered[0] : 0,filtered.size(),zlib);
+  PutBig32(zlib,Adler32(filtered.size() ? &filtered[0] : 0,filtered.size()));
+
+  static const unsigned char colorType[5] = { 0, 0, 4, 2, 6 };
+  unsigned char ihdr[13];
+  UCharVector header;
+  PutBig32(header,(unsigned int)wid);
+  PutBig32(header,(unsigned int)hit);
+  memcpy(ihdr,&header[0],8);
+  ihdr[8]  = 8;
+  ihdr[9]  = colorType[comp];
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+  static const unsigned char signature[8] = { 0x89,'P','N','G','\r','\n',0x1A,'\n' };
+  UCharVector png(signature,signature+8);
+  PutChunk(png,"IHDR",ihdr,13);
+  PutChunk(png,"IDAT",&zlib[0],zlib.size());
+  PutChunk(png,"IEND",0,0);
+
+  FILE *fph = fopen(fname,"wb");
+  if ( !fph ) return false;
+  bool ok = fwrite(&png[0],png.size(),1,fph) == 1;
+  fclose(fph);
+  return ok;
+}
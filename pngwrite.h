@@ -0,0 +1,29 @@
+#ifndef PNGWRITE_H
+
+#define PNGWRITE_H
+
+//############################################################################
+//##                                                                        ##
+//##  PNGWRITE.H                                                            ##
+//##                                                                        ##
+//##  Writes 8 bit RGB/RGBA PNG files, with a fast deflate for the low     ##
+//##  compression levels.                                                   ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#define PNG_LEVEL_DEFAULT -1 // stb_image_write at its own level
+#define PNG_LEVEL_STORE    0 // no compression at all
+#define PNG_LEVEL_FAST     1 // fixed Huffman codes and a single probe match
+                             // finder, several times faster than zlib
+
+// Any other level leaves the file to stbi_write_png, which picks the best
+// filter for every row and searches harder for matches.  Safe to call from
+// several threads at once.  'comp' is 1 to 4 bytes per pixel.
+bool WritePng(const char *fname,int wid,int hit,int comp,
+              const unsigned char *data,int stride,int level);
+
+#endif
@@ -23,15 +23,26 @@
 
 #include "q3bsp.h"
 #include "q3shader.h"
+#include "arglist.h"
 #include "patch.h"
 
 #include "fload.h"
+#include "parallel.h"
 #include "stb_image_write.h"
 
 Quake3BSP::Quake3BSP(const StringRef &fname,
                      const StringRef &code)
 {
   mMesh = 0;
+  mJobs = 0;
+  mLightmapsSaved = false;
+  mAtlasSize = 0;
+  mRepackBorder = -1;
+  mLightmapDedup = false;
+  mLightmapColour = false;
+  mPngLevel = PNG_LEVEL_DEFAULT;
+  mLightmaps = 0;
+  mEntitiesRead = false;
 
   mOk = false;
   mName     = fname;
@@ -47,23 +58,23 @@ Quake3BSP::Quake3BSP(const StringRef &fname,
   if (del) mLmPrefix = (del+1); // use file name part only
   else mLmPrefix=fname.Get();
 
-  Fload data(str);
+  mFile = new Fmap(str);
 
-  void *mem = data.GetData();
-  int   len = data.GetLen();
+  const void *mem = mFile->GetData();
+  size_t      len = mFile->GetLen();
   if ( mem )
   {
 
-    mOk = mHeader.SetHeader(mem);
+    mOk = mHeader.SetHeader(mem,len);
 
     if ( mOk )
     {
+      // only the cheap lump reads happen up front, the mesh, lightmap
+      // images and entities wait until somebody asks for them.
       ReadFaces(mem);
       ReadElements(mem);
       ReadVertices(mem);
-      ReadLightmaps(mem);
       ReadShaders(mem);
-      BuildVertexBuffers();
 
 	  ReadPlanes(mem);
 	  ReadLeaves(mem);
@@ -71,7 +82,6 @@ Quake3BSP::Quake3BSP(const StringRef &fname,
 
 	  ReadNodes(mem);
 	  // brushes 
-	  ReadEntities(mem);
     }
   }
 }
@@ -79,12 +89,65 @@ Quake3BSP::Quake3BSP(const StringRef &fname,
 Quake3BSP::~Quake3BSP(void)
 {
   delete mMesh;
+  delete mLightmaps;
+  delete mFile;
 }
 
+VertexMesh * Quake3BSP::GetVertexMesh(const VFormatOptions &options)
+{
+  if ( mOk && !mMesh )
+  {
+    BuildVertexBuffers(options);
+  }
+  return mMesh;
+}
+
+void Quake3BSP::SaveLightmaps(void)
+{
+  if ( mOk && !mLightmapsSaved )
+  {
+    ReadLightmaps(mFile->GetData());
+    mLightmapsSaved = true;
+  }
+}
+
+String Quake3BSP::GetLightmapSignature(void) const
+{
+  // the prefix is the path of the BSP file, of any length.
+  char scratch[256];
+  sprintf(scratch," png=%d atlas=%d repack=%d dedup=%d colour=%d pnglevel=%d",
+          mUsePng,mAtlasSize,mRepackBorder,mLightmapDedup,mLightmapColour,mPngLevel);
+  return String("prefix=") + mLmPrefix.Get() + " code=" + mCodeName.Get() + scratch;
+}
+
+const LightmapLayout & Quake3BSP::GetLightmapLayout(void)
+{
+  if ( !mLightmaps )
+  {
+    mLightmaps = new LightmapLayout;
+    int pageCount = 0;
+    if ( mOk )
+    {
+      LumpSpan<unsigned char> lmaps = mHeader.Lump<unsigned char>(Q3_LIGHTMAPS,mFile->GetData());
+      pageCount = (int)(lmaps.size() / LIGHTMAP_BYTES);
+      if ( mLightmapDedup ) mLightmaps->Dedup(lmaps.begin(),pageCount,mLightmapColour);
+    }
+    if ( mRepackBorder >= 0 )
+      mLightmaps->SetRects(mFaces,pageCount,mAtlasSize > 0 ? mAtlasSize : LIGHTMAP_WIDTH,
+                           mRepackBorder,mLmPrefix,mCodeName);
+    else if ( mAtlasSize > 0 )
+      mLightmaps->SetAtlases(mFaces,pageCount,mAtlasSize,mLmPrefix,mCodeName);
+    else
+      mLightmaps->SetPages(mFaces,pageCount,mLmPrefix,mCodeName);
+  }
+  return *mLightmaps;
+}
 
 
-bool QuakeHeader::SetHeader(const void *mem)  // returns true if valid quake header.
+
+bool QuakeHeader::SetHeader(const void *mem,size_t len)  // returns true if valid quake header.
 {
+  if ( len < sizeof(int)*2 + sizeof(QuakeLump)*NUM_LUMPS ) return false;
   const int *ids = (const int *) mem;
   #define BSPHEADERID  (*(int*)"IBSP")
   #define BSPVERSION 46
@@ -93,88 +156,35 @@ bool QuakeHeader::SetHeader(const void *mem)  // returns true if valid quake hea
   mId      = ids[0];
   mVersion = ids[1];
   const QuakeLump *lump = (const QuakeLump *) &ids[2];
-  for (int i=0; i<NUM_LUMPS; i++) mLumps[i] = *lump++;
+  for (int i=0; i<NUM_LUMPS; i++)
+  {
+    mLumps[i] = *lump++;
+    // lumps are handed out as pointers into the file, so they must fit in it.
+    int ofs = mLumps[i].GetFileOffset();
+    int flen = mLumps[i].GetFileLength();
+    if ( ofs < 0 || flen < 0 || (size_t)ofs + (size_t)flen > len )
+    {
+      printf("Lump %d lies outside of the BSP file\n",i);
+      return false;
+    }
+  }
   return true;
 }
 
 void Quake3BSP::ReadShaders(const void *mem)
 {
   assert( mOk );
-  int lsize;
-  int lcount;
-
-  const unsigned char *smem = (const unsigned char *) mHeader.LumpInfo(Q3_SHADERREFS,mem,lsize,lcount);
+  LumpSpan<dshader_t> shaders = mHeader.Lump<dshader_t>(Q3_SHADERREFS,mem);
 
   mShaders.clear();
-  mShaders.reserve( lcount );
+  mShaders.reserve( shaders.size() );
 
-  for (int i=0; i<lcount; i++)
+  for (size_t i=0; i<shaders.size(); i++)
   {
-    ShaderReference s(smem);
+    ShaderReference s( (const unsigned char *) &shaders[i] );
     mShaders.push_back(s);
-    smem+=lsize;
-  }
-
-}
-
-const void * QuakeHeader::LumpInfo(QuakeLumps lump,
-                                 const void *mem,
-                                 int &lsize,
-                                 int &lcount)
-{
-
-  switch ( lump )
-  {
-   case LUMP_ENTITIES :
-      lsize = 1;
-      break;
-
-    case Q3_SHADERREFS: // LUMP_SHADERS
-      lsize = sizeof(dshader_t); 
-      break;
-    case Q3_PLANES: // LUMP_PLANES
-      lsize = sizeof(float)*4; // size of a plane equations.
-      break;
-    case Q3_NODES: //LUMP_NODES
-      lsize = sizeof(dnode_t); // sizeof(int)*9;
-      break;
-    case Q3_LEAFS:
-      lsize = sizeof(dleaf_t); // sizeof(int)*12;
-      break;
-    case Q3_FACES:
-      lsize = sizeof(int)*26;
-      break;
-    case Q3_VERTS:
-      lsize = sizeof(int)*11;
-      break;
-    case Q3_LFACES:
-      lsize = sizeof(int);
-      break;
-    case Q3_ELEMS:
-      lsize = sizeof(int);
-      break;
-    case Q3_MODELS:
-      lsize = sizeof(int)*10;
-      break;
-    case Q3_LIGHTMAPS:
-      lsize = 1;
-      break;
-    case Q3_VISIBILITY:
-      lsize = 1;
-      break;
-    default:
-      assert( 0 ); // unsupported query type
   }
 
-  int flen = mLumps[lump].GetFileLength();
-
-  assert( flen );
-  assert( (flen%lsize) == 0 ); // must be evenly divisible by lump size.
-  lcount = flen/lsize; // number of lump items.
-
-  const char *foo = (const char *)mem;
-  foo = &foo[ mLumps[lump].GetFileOffset() ];
-  return (const void *) foo;
 }
 
 QuakeNode::QuakeNode(const int *node)
@@ -220,23 +230,14 @@ QuakeLeaf::QuakeLeaf(const int *node)
 void Quake3BSP::ReadPlanes(const void *mem)
 {
   assert( mOk );
-  int lsize;
-  int lcount;
-  const dplane_t *planes = (const dplane_t *) mHeader.LumpInfo(Q3_PLANES,mem,lsize,lcount);
-
-  mPlanes.assign(planes,planes+lcount);
+  mPlanes = mHeader.Lump<dplane_t>(Q3_PLANES,mem);
 
 }
 // read the dnode_t nodes 
 void Quake3BSP::ReadNodes(const void *mem)
 {
   assert( mOk );
-  int lsize;
-  int lcount;
-  const dnode_t *nodes= (const dnode_t *) mHeader.LumpInfo(Q3_NODES,mem,lsize,lcount);
-
-
-  mNodes.assign(nodes,nodes+lcount);
+  mNodes = mHeader.Lump<dnode_t>(Q3_NODES,mem);
 
 }
 
@@ -244,13 +245,7 @@ void Quake3BSP::ReadNodes(const void *mem)
 void Quake3BSP::ReadLeaves(const void *mem)
 {
   assert( mOk );
-  int lsize;
-  int lcount;
-  const dleaf_t *nodes= (const dleaf_t *) mHeader.LumpInfo(Q3_LEAFS,mem,lsize,lcount);
-
-
-  mLeaves.assign(nodes,nodes+lcount);
-  assert(mLeaves.size() == lcount);
+  mLeaves = mHeader.Lump<dleaf_t>(Q3_LEAFS,mem);
 
 }
 
@@ -258,12 +253,7 @@ void Quake3BSP::ReadLeaves(const void *mem)
 void Quake3BSP::ReadLeafSurfaces(const void *mem)
 {
   assert( mOk );
-  int lsize;
-  int lcount;
-  const int *nodes= (const int *) mHeader.LumpInfo(Q3_LFACES,mem,lsize,lcount);
-
-
-  mLeafSurfaces.assign(nodes,nodes+lcount);
+  mLeafSurfaces = mHeader.Lump<int>(Q3_LFACES,mem);
 
 }
 
@@ -367,40 +357,34 @@ QuakeVertex::QuakeVertex(const int *vert)
 void Quake3BSP::ReadFaces(const void *mem)
 {
   assert( mOk );
-  int lsize;
-  int lcount;
-  const int *faces = (const int *) mHeader.LumpInfo(Q3_FACES,mem,lsize,lcount);
-  assert( lsize == sizeof(int)*26 );
+  LumpSpan<dsurface_t> faces = mHeader.Lump<dsurface_t>(Q3_FACES,mem);
+  assert( sizeof(dsurface_t) == sizeof(int)*26 );
 
   mFaces.clear();
-  mFaces.reserve( lcount );
+  mFaces.reserve( faces.size() );
 
-  for (int i=0; i<lcount; i++)
+  for (size_t i=0; i<faces.size(); i++)
   {
-    QuakeFace f(faces);
+    QuakeFace f( (const int *) &faces[i] );
 
     mFaces.push_back(f);
-
-    faces+=26;
   }
 }
 
 void Quake3BSP::ReadVertices(const void *mem)
 {
   assert( mOk );
-  int lsize;
-  int lcount;
-  const int *vertices = (const int *) mHeader.LumpInfo(Q3_VERTS,mem,lsize,lcount);
-  assert( lsize == sizeof(int)*11 );
+  LumpSpan<drawVert_t> vertices = mHeader.Lump<drawVert_t>(Q3_VERTS,mem);
+  assert( sizeof(drawVert_t) == sizeof(int)*11 );
 
   mVertices.clear();
-  mVertices.reserve( lcount );
+  mVertices.reserve( vertices.size() );
 
   mBound.InitMinMax();
 
-  for (int i=0; i<lcount; i++)
+  for (size_t i=0; i<vertices.size(); i++)
   {
-    QuakeVertex v(vertices);
+    QuakeVertex v( (const int *) &vertices[i] );
 
     #define RECIP (1.0f/45.0f)
 
@@ -410,7 +394,6 @@ void Quake3BSP::ReadVertices(const void *mem)
 
     mBound.MinMax(v.mPos);
     mVertices.push_back(v);
-    vertices+=11;
   }
 }
 
@@ -418,63 +401,27 @@ void Quake3BSP::ReadLightmaps(const void *mem)
 {
   assert( mOk );
 
-  int lsize;
-  int lcount;
-  const unsigned char *maps = (const unsigned char *) mHeader.LumpInfo(Q3_LIGHTMAPS,mem,lsize,lcount);
-  unsigned char *lmaps = new unsigned char[lcount];
-  memcpy(lmaps,maps,lcount);
-
-  for (int j=0; j<lcount; j++)
-  {
-    unsigned int c = lmaps[j];
-    lmaps[j] = (unsigned char) c;
-  }
-
-  #define LMWID 128
-  #define LMHIT 128
-  #define LMSIZE (LMWID*LMHIT*3)
-
-  int texcount = lcount / LMSIZE;
+  // pages are encoded straight out of the file image.
+  LumpSpan<unsigned char> lmaps = mHeader.Lump<unsigned char>(Q3_LIGHTMAPS,mem);
 
-  unsigned char *map = lmaps;
-
-  for (int i=0; i<texcount; i++)
-  {
-    char scratch[256];
-    sprintf(scratch,"%slm%s%02d",mLmPrefix.Get(),mCodeName.Get(),i);
-    String sname = scratch;
-    if (mUsePng) {
-      String bname = sname+".png";
-      stbi_write_png(bname.c_str(), LMWID, LMHIT, 3, map, LMWID*3);
-    } else {
-      String bname = sname+".bmp";
-      stbi_write_bmp(bname.c_str(), LMWID, LMHIT, 3, map);
-    }
-    map+=LMSIZE;
-  }
-
-
-  delete lmaps;
+  int texcount = (int)(lmaps.size() / LIGHTMAP_BYTES);
 
+  GetLightmapLayout().Save(lmaps.begin(),texcount,mUsePng,mPngLevel,mJobs);
 }
 
 void Quake3BSP::ReadElements(const void *mem)
 {
   assert( mOk );
-  int lsize;
-  int lcount;
   // LUMP_DRAWINDEXES
-  const int *elements = (const int *) mHeader.LumpInfo(Q3_ELEMS,mem,lsize,lcount);
-  assert( lsize == sizeof(int) );
+  LumpSpan<int> elements = mHeader.Lump<int>(Q3_ELEMS,mem);
 
   mElements.clear();
-  mElements.reserve( lcount );
+  mElements.reserve( elements.size() );
 
-  for (int i=0; i<lcount; i++)
+  for (size_t i=0; i<elements.size(); i++)
   {
-    unsigned short ic = (unsigned short)(*elements);
+    unsigned int ic = (unsigned int)elements[i];
     mElements.push_back(ic);
-    elements++;
   }
 }
 
@@ -496,47 +443,115 @@ void QuakeVertex::Get(LightMapVertex &vtx) const
   vtx.mColor.z    = float((mColor>>16) & 0xFF) / 255.0f;
 }
 
-void Quake3BSP::BuildVertexBuffers(void)
+void Quake3BSP::BuildVertexBuffers(const VFormatOptions &options)
 {
   mMesh = 0;
   mMesh = new VertexMesh;
 
-  QuakeFaceVector::iterator i;
-  for (i=mFaces.begin(); i!=mFaces.end(); ++i)
+  int fcount = (int)mFaces.size();
+
+  // shader lookup may load shader files and grows the string table, none
+  // of which is thread safe, so resolve every face up front in face order.
+  const LightmapLayout &lightmaps = GetLightmapLayout();
+  StringRefVector mats(fcount);
+  std::vector< QuakeShader * > shaders(fcount);
+  for (int f=0; f<fcount; f++)
   {
-    (*i).Build(mElements,mVertices,mShaders,mLmPrefix,mName,mCodeName,*mMesh);
+    mats[f] = mFaces[f].Resolve(mShaders,lightmaps.GetPlacement(f),shaders[f]);
   }
-}
 
-void QuakeFace::Build(const UShortVector &elements,
-                      const QuakeVertexVector &vertices,
-                      ShaderReferenceVector &shaders,
-                      const StringRef &lmPrefix,
-                      const StringRef &sourcename,
-                      const StringRef &code,
-                      VertexMesh &mesh)
-{
-  assert( mVcount < 1024 );
-  assert( mShader >= 0 && mShader < shaders.size() );
-  StringRef mat;
+  std::vector< char > emitted(fcount);
 
+  int jobs = GetJobCount(mJobs);
+  if ( jobs <= 1 || fcount < 2 )
+  {
+    for (int f=0; f<fcount; f++)
+    {
+      emitted[f] = mFaces[f].Emit(mats[f],mElements,mVertices,options.patchLods,lightmaps.GetPlacement(f),*mMesh);
+    }
+  }
+  else
+  {
+    // every worker fills its own partial mesh from a contiguous run of
+    // faces.  Merging the parts back in face order feeds each section's
+    // vertex pool the same vertex sequence as a serial build, so the
+    // result is identical.
+    int chunks = jobs*4;
+    if ( chunks > fcount ) chunks = fcount;
 
-  static StringRef oname = StringDict::gStringDict().Get("outside");
-  static StringRef inside  = StringDict::gStringDict().Get("inside");
+    std::vector< VertexMesh * > parts(chunks);
 
-  StringRef name = inside;
+    ParallelFor(chunks,jobs,[&](int c)
+    {
+      int first = (int)( (long long)fcount*c/chunks );
+      int last  = (int)( (long long)fcount*(c+1)/chunks );
+      VertexMesh *part = new VertexMesh;
+      for (int f=first; f<last; f++)
+      {
+        emitted[f] = mFaces[f].Emit(mats[f],mElements,mVertices,options.patchLods,lightmaps.GetPlacement(f),*part);
+      }
+      parts[c] = part;
+    });
 
+    for (int c=0; c<chunks; c++)
+    {
+      mMesh->Merge(*parts[c]);
+      delete parts[c];
+    }
+  }
 
-  int type = 0;
+  // Build() hands the face's shader to whichever section received the
+  // last triangle so far, replay that in face order.
+  VertexSection *last = 0;
+  for (int f=0; f<fcount; f++)
+  {
+    if ( emitted[f] ) last = mMesh->FindSection(mats[f]);
+    if ( last && shaders[f] ) last->SetShader(shaders[f]);
+  }
 
-  LightMapVertex verts[1024];
+  if ( options.simplifyRatio < 1 || options.simplifyError > 0 )
+  {
+    int before = 0, after = 0;
+    mMesh->Simplify(options.simplifyRatio,options.simplifyError,jobs,before,after);
+    printf("Simplified %d triangles to %d\n",before,after);
+  }
 
-  for (int i=0; i<mVcount; i++)
+  if ( options.vertexCacheSize > 0 )
   {
-    vertices[ i+mFirstVertice ].Get(verts[i]);
+    int tris = 0, before = 0, after = 0;
+    mMesh->OptimizeVertexCache(options.vertexCacheSize,jobs,tris,before,after);
+    if ( tris )
+    {
+      printf("Vertex cache of %d: ACMR %.3f before, %.3f after, %d triangles\n",
+             options.vertexCacheSize,(float)before/tris,(float)after/tris,tris);
+    }
   }
+}
+
+void QuakeFace::Build(const UIntVector &elements,
+                      const QuakeVertexVector &vertices,
+                      const FloatVector &patchLods,
+                      ShaderReferenceVector &shaders,
+                      const LightmapPlacement &lightmap,
+                      const StringRef &sourcename,
+                      VertexMesh &mesh)
+{
+  QuakeShader *shader;
+  StringRef mat = Resolve(shaders,lightmap,shader);
+
+  Emit(mat,elements,vertices,patchLods,lightmap,mesh);
+
+  if (mesh.mLastSection && shader) 
+	  mesh.mLastSection->SetShader(shader);
+}
+
+StringRef QuakeFace::Resolve(ShaderReferenceVector &shaders,
+                             const LightmapPlacement &lightmap,
+                             QuakeShader *&shader) const
+{
+  assert( mShader >= 0 && mShader < shaders.size() );
+  StringRef mat;
 
-  char scratch[256];
   char texname[256];
 
   //shaders[ mShader ].GetTextureName(texname);
@@ -547,14 +562,9 @@ void QuakeFace::Build(const UShortVector &elements,
 	  return;
 */
 
-#if 0
-  if ( mLightmap < 0 ) 
-	  return;
-#endif
-
   StringRef basetexture = StringDict::gStringDict().Get(texname);
 
-  QuakeShader *shader = QuakeShaderFactory::gQuakeShaderFactory().Locate(basetexture);
+  shader = QuakeShaderFactory::gQuakeShaderFactory().Locate(basetexture);
 
   if ( shader )
   {
@@ -569,37 +579,63 @@ void QuakeFace::Build(const UShortVector &elements,
 	    printf("shader for : %s\n",basetexture.Get());
 	  }
 
-	// try to load a matching shader from disk 
-    shaders[mShader].GetShaderFileName(scratch); 
-	strcat(scratch,".shader");
-    mat = StringDict::gStringDict().Get(scratch);
-
-	if (!QuakeShaderFactory::gQuakeShaderFactory().ShaderFileLoaded(mat)
-		&& 	QuakeShaderFactory::gQuakeShaderFactory().AddShader(mat)) 
-	{
-	     shader = QuakeShaderFactory::gQuakeShaderFactory().Locate(basetexture);
-	}
-
-	if (!shader) {
-	    printf("No shader for : '%s'\n",basetexture.Get());
-
-	}
+	// every script in scripts/ is indexed, there is nowhere else to look.
+	printf("No shader for : '%s'\n",basetexture.Get());
   }	
   
   // geometry sorted by shader  string
 
-  if ( mLightmap < 0 ) // no lightmap
-	  sprintf(scratch,"%s+",basetexture.Get());
-  else	
-	sprintf(scratch,"%s+%slm%s%02d",basetexture.Get(),lmPrefix.Get(),
-          code.Get(),
-          mLightmap);
+  // the lightmap name holds the path of the BSP file, of any length.
+  String name = String(basetexture.Get()) + "+";
+  if ( lightmap.mImage >= 0 ) name += lightmap.mName.Get();
+
+  mat = StringDict::gStringDict().Get(name.c_str());
+
+  return mat;
+}
+
+bool QuakeFace::Emit(const StringRef &mat,
+                     const UIntVector &elements,
+                     const QuakeVertexVector &vertices,
+                     const FloatVector &patchLods,
+                     const LightmapPlacement &lightmap,
+                     VertexMesh &mesh) const
+{
+  bool added = false;
 
-  mat = StringDict::gStringDict().Get(scratch);
+#if 0
+  if ( mLightmap < 0 ) 
+	  return false;
+#endif
 
-  char lmapspace[256];
-  sprintf(lmapspace,"lm%s%02d",code.Get(),mLightmap);
-  StringRef lmap = SGET(lmapspace);
+  // a face referencing data outside of the lumps is skipped.
+  if ( mVcount < 0 || mFirstVertice < 0 ||
+       (size_t)mFirstVertice+mVcount > vertices.size() )
+    return false;
+
+  // per thread scratch copy of the face vertices, grown as needed.
+  static thread_local VertexVector scratch;
+  if ( scratch.size() < (size_t)mVcount ) scratch.resize(mVcount);
+  LightMapVertex *verts = scratch.empty() ? 0 : &scratch[0];
+
+  for (int i=0; i<mVcount; i++)
+  {
+    vertices[ i+mFirstVertice ].Get(verts[i]);
+  }
+
+  // lightmap coordinates into the image the lightmap went to, before
+  // patches are tessellated, the mapping is affine.
+  if ( !lightmap.IsIdentity() )
+  {
+    for (int i=0; i<mVcount; i++) lightmap.Map(verts[i].mTexel2);
+  }
+
+  // a single colour lightmap is carried by the vertex colours, the layout
+  // only does that for exporters that draw them.
+  if ( lightmap.mUniform )
+  {
+    for (int i=0; i<mVcount; i++) verts[i].mColor = lightmap.mColor;
+  }
 
   switch ( mType )
   {
@@ -608,38 +644,75 @@ void QuakeFace::Build(const UShortVector &elements,
           if ( 1 )
           {
             assert( (mEcount%3) == 0 );
-            const unsigned short *idx = &elements[mFirstElement];
+            if ( mEcount <= 0 || mFirstElement < 0 ||
+                 (size_t)mFirstElement+mEcount > elements.size() )
+              break;
+            const unsigned int *idx = &elements[mFirstElement];
             int tcount = mEcount/3;
             for (int j=0; j<tcount; j++)
             {
-              int i1 = idx[0];
-              int i2 = idx[1];
-              int i3 = idx[2];
-
-              mesh.AddTri(mat,verts[i1], verts[i2], verts[i3] );
+              unsigned int i1 = idx[0];
+              unsigned int i2 = idx[1];
+              unsigned int i3 = idx[2];
 
               idx+=3;
+
+              if ( i1 >= (unsigned int)mVcount ||
+                   i2 >= (unsigned int)mVcount ||
+                   i3 >= (unsigned int)mVcount )
+                continue;
+
+              mesh.AddTri(mat,verts[i1], verts[i2], verts[i3] );
+              added = true;
             }
           }
           break;
     case FACETYPE_MESH:
         if ( 1 )
         {
-          PatchSurface surface(verts,mVcount,mControlX,mControlY);
-          const LightMapVertex *vlist = surface.GetVerts();
-          const unsigned short *indices = surface.GetIndices();
-          int tcount = surface.GetIndiceCount()/3;
+          int levels = (int)patchLods.size();
+          if ( levels > MAX_LOD_LEVELS ) levels = MAX_LOD_LEVELS;
 
-          for (int j=0; j<tcount; j++)
+          int lod = 0;
+          do
           {
+            float error = levels ? patchLods[lod] : PATCH_MAX_ERROR;
 
-            int i1 = *indices++;
-            int i2 = *indices++;
-            int i3 = *indices++;
+            // following levels that come out the same share the triangles.
+            unsigned char lods = (unsigned char)(1<<lod);
+            int sizex,sizey;
+            int next = lod+1;
+            if ( levels > 1 && PatchSurface::FindSize(mControlX,mControlY,verts,error,sizex,sizey) )
+            {
+              int nsizex,nsizey;
+              while ( next < levels &&
+                      PatchSurface::FindSize(mControlX,mControlY,verts,patchLods[next],nsizex,nsizey) &&
+                      nsizex == sizex && nsizey == sizey )
+              {
+                lods |= (unsigned char)(1<<next);
+                next++;
+              }
+            }
+            if ( lod == 0 && next >= levels ) lods = LOD_ALL; // the same in every level
 
-            mesh.AddTri(mat,vlist[i1], vlist[i2], vlist[i3] );
+            PatchSurface surface(verts,mVcount,mControlX,mControlY,error);
+            const LightMapVertex *vlist = surface.GetVerts();
+            const unsigned int *indices = surface.GetIndices();
+            int tcount = surface.GetIndiceCount()/3;
 
-          }
+            for (int j=0; j<tcount; j++)
+            {
+
+              int i1 = *indices++;
+              int i2 = *indices++;
+              int i3 = *indices++;
+
+              mesh.AddTri(mat,vlist[i1], vlist[i2], vlist[i3], lods );
+              added = true;
+
+            }
+            lod = next;
+          } while ( lod < levels );
         }
         break;
     case FACETYPE_FLARE:
@@ -648,10 +721,8 @@ void QuakeFace::Build(const UShortVector &elements,
 //      assert( 0 );
       break;
   }
-  if (mesh.mLastSection && shader) 
-	  mesh.mLastSection->SetShader(shader);
-
 
+  return added;
 }
 
 void ShaderReference::GetTextureName(char *tname)
@@ -699,18 +770,14 @@ void ShaderReference::GetShaderFileName(char *tname)
 void Quake3BSP::ReadEntities(const void *mem)
 {
   assert( mOk );
-  int lsize;
-  int lcount;
-  
-  const char *elements = (const char *) mHeader.LumpInfo(Q3_ENTITIES,mem,lsize,lcount);
-  assert( lsize == sizeof(char) );
+  LumpSpan<char> elements = mHeader.Lump<char>(Q3_ENTITIES,mem);
 
   mEntities.clear();
 
-  const char *estart=elements;
+  const char *estart=elements.begin();
   const char *p=estart;
   int level=0;
-  for (int i=0; i<lcount; i++)
+  for (size_t i=0; i<elements.size(); i++)
   {
 	 if (*p == '{') {
 		 level++;
@@ -804,8 +871,14 @@ void Quake3BSP::SaveEntity(const EntityReference &entity,
 // save the entities 
 void Quake3BSP::SaveEntitiesVRML2(
 			FILE *fph,
-            VFormatOptions &options) const 
+            VFormatOptions &options)
 {
+  if ( mOk && !mEntitiesRead )
+  {
+    ReadEntities(mFile->GetData());
+    mEntitiesRead = true;
+  }
+
   if ( mEntities.size() )
   {
     if ( fph )
@@ -943,9 +1016,17 @@ void Quake3BSP::SaveNodeBsp(
 		surface = mLeafSurfaces[surface];
 		fprintf(fph,"## surface %d \n",surface);
 
-		mFaces[surface].Build(mElements,mVertices,mShaders,mLmPrefix,mName,mCodeName,mesh);
+		mFaces[surface].Build(mElements,mVertices,options.patchLods,mShaders,GetLightmapLayout().GetPlacement(surface),mName,mesh);
 	}
 
+	if (options.simplifyRatio < 1 || options.simplifyError > 0) {
+		int before = 0, after = 0;
+		mesh.Simplify(options.simplifyRatio,options.simplifyError,1,before,after);
+	}
+	if (options.vertexCacheSize > 0) {
+		int tris = 0, before = 0, after = 0;
+		mesh.OptimizeVertexCache(options.vertexCacheSize,1,tris,before,after);
+	}
 	mesh.SaveVRML2(fph,options);
 
 	if (node->numLeafSurfaces >1) {
@@ -89,18 +89,38 @@ SOURCE=.\arglist.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\fileindex.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\fload.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\gltf.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\lightmap.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\main.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\manifest.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\patch.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\pngwrite.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\q3bsp.cpp
 # End Source File
 # Begin Source File
@@ -109,10 +129,18 @@ SOURCE=.\q3shader.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\shadercache.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\stringdict.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\textwriter.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\vformat.cpp
 # End Source File
 # End Group
@@ -125,18 +153,42 @@ SOURCE=.\arglist.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\fileindex.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\fload.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\gltf.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\lightmap.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\main.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\manifest.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\parallel.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\patch.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\pngwrite.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\plane.h
 # End Source File
 # Begin Source File
@@ -161,6 +213,10 @@ SOURCE=.\rect.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\shadercache.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\stable.h
 # End Source File
 # Begin Source File
@@ -181,6 +237,10 @@ SOURCE=.\stringdict.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\textwriter.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\vector.h
 # End Source File
 # Begin Source File
@@ -24,8 +24,10 @@
 #include "q3def.h" // include quake3 data structures.
 #include "stringdict.h"
 #include "vector.h"
+#include "pngwrite.h"
 
 class VFormatOptions;
+class Fmap;
 
 // Loads a quake3 bsp file.
 class Quake3BSP
@@ -37,7 +39,44 @@ public:
   ~Quake3BSP(void);
 
 
-  VertexMesh * GetVertexMesh(void) const { return mMesh; };
+  bool IsOk(void) const { return mOk; };
+
+  // Each stage below runs on first use only, so a caller pays just for what
+  // it asks for.
+
+  // organized mesh of all faces, tessellated on first call with the patch
+  // LOD settings of 'options'.
+  VertexMesh * GetVertexMesh(const VFormatOptions &options);
+
+  // write the lightmap pages as image files, once.
+  void SaveLightmaps(void);
+
+  // threads used to build the mesh, 0 means one per hardware thread.
+  void SetJobs(int jobs) { mJobs = jobs; };
+
+  // pack the lightmap pages into atlases of at most size x size texels,
+  // 0 writes every page on its own.  Call before the mesh or the
+  // lightmaps are asked for.
+  void SetLightmapAtlas(int size) { mAtlasSize = size; };
+
+  // write only the part of each page the faces use, grown by 'border'
+  // texels, packed into new images; -1 keeps whole pages.
+  void SetLightmapRepack(int border) { mRepackBorder = border; };
+
+  // write each distinct lightmap page once, and single colour pages as
+  // vertex colours when the exporter draws them, else as 1x1 images.
+  void SetLightmapDedup(bool dedup,bool vertexColour)
+  {
+    mLightmapDedup = dedup;
+    mLightmapColour = vertexColour;
+  };
+
+  // compression of the lightmap png files, see WritePng.
+  void SetPngLevel(int level) { mPngLevel = level; };
+
+  // the lightmap settings as text, they change the lightmap images and
+  // the names the mesh uses for them.
+  String GetLightmapSignature(void) const;
 
 
 private:
@@ -63,8 +102,12 @@ private:
   
   void ReadEntities(const void *mem); // entities
 
-  void BuildVertexBuffers(void);
+  void BuildVertexBuffers(const VFormatOptions &options);
+
+  // how the lightmap pages are written, decided on first call.
+  const LightmapLayout & GetLightmapLayout(void);
 
+  Fmap             *mFile;     // memory mapped image of the BSP file.
   bool              mOk;       // quake BSP properly loaded.
   StringRef         mName;     // name of quake BSP
   StringRef         mCodeName;     // short reference code for BSP
@@ -72,20 +115,30 @@ private:
   QuakeFaceVector   mFaces;    // all faces
   QuakeVertexVector mVertices; // all vertices.
   ShaderReferenceVector mShaders; // shader references
-  UShortVector      mElements; // indices for draw primitives.
+  UIntVector        mElements; // indices for draw primitives.
   Rect3d<float>     mBound;
-  VertexMesh       *mMesh; // organized mesh
-
-  std::vector< dplane_t > mPlanes; // the planes 
-  std::vector< dnode_t > mNodes; // the nodes
-
-  std::vector<int>		mLeafSurfaces;
+  VertexMesh       *mMesh; // organized mesh, null until first requested
+  int               mJobs;  // threads for BuildVertexBuffers
+  bool              mLightmapsSaved; // lightmap pages written out
+  int               mAtlasSize; // lightmap atlas size, 0 = one image per page
+  int               mRepackBorder; // border of repacked lightmaps, -1 = off
+  bool              mLightmapDedup; // drop copied and single colour pages
+  bool              mLightmapColour; // single colour pages to vertex colours
+  int               mPngLevel; // lightmap png compression level
+  LightmapLayout   *mLightmaps; // null until first requested
+  bool              mEntitiesRead;   // mEntities parsed from the lump
+
+  // views straight into mFile, no copies.
+  LumpSpan< dplane_t > mPlanes; // the planes 
+  LumpSpan< dnode_t > mNodes; // the nodes
+
+  LumpSpan<int>		mLeafSurfaces;
   std::vector<int>		mLeafBrushes;
 
   std::vector<dbrush_t > mBrushes;
   std::vector<dbrushside_t > mBbrushSides;
 
-  std::vector< dleaf_t > mLeaves; // the leaves
+  LumpSpan< dleaf_t > mLeaves; // the leaves
 
   EntityReferenceVector mEntities;	// list of entities
 
@@ -98,7 +151,7 @@ public :
   // save the entities 
   void SaveEntitiesVRML2(
 			FILE *fph,
-            VFormatOptions &options) const ;
+            VFormatOptions &options);
 
   void SaveEntity(const EntityReference &entity,FILE *f,VFormatOptions &options) const;
 
@@ -26,6 +26,7 @@
 #include "rect.h"
 #include "plane.h"
 #include "vformat.h"
+#include "lightmap.h"
 
 typedef std::vector< Plane > PlaneVector;
 class LightMapVertex;
@@ -586,11 +587,56 @@ private:
   int mFileLength;         // file length of lump.
 };
 
+// Typed read-only view of a lump, pointing straight into the loaded file.
+// Only valid for as long as the file image it was taken from.
+template <class Type> class LumpSpan
+{
+public:
+  LumpSpan(void)
+  {
+    mData  = 0;
+    mCount = 0;
+  };
+
+  LumpSpan(const Type *data,size_t count)
+  {
+    mData  = data;
+    mCount = count;
+  };
+
+  const Type * begin(void) const { return mData; };
+  const Type * end(void) const { return mData+mCount; };
+
+  size_t size(void) const { return mCount; };
+  bool empty(void) const { return mCount == 0; };
+
+  const Type& operator[](size_t i) const
+  {
+    assert( i < mCount );
+    return mData[i];
+  };
+
+private:
+  const Type *mData;
+  size_t      mCount;
+};
+
 class QuakeHeader
 {
 public:
-  bool SetHeader(const void *mem); // returns true if valid quake header.
-  const void * LumpInfo(QuakeLumps lump,const void *mem,int &lsize,int &lcount);
+  // returns true if valid quake header and every lump lies inside the file.
+  bool SetHeader(const void *mem,size_t len);
+
+  // view of a lump as an array of its records.
+  template <class Type> LumpSpan<Type> Lump(QuakeLumps lump,const void *mem) const
+  {
+    size_t flen = (size_t) mLumps[lump].GetFileLength();
+    assert( (flen%sizeof(Type)) == 0 ); // must be evenly divisible by lump size.
+    const char *foo = (const char *)mem;
+    foo = &foo[ mLumps[lump].GetFileOffset() ];
+    return LumpSpan<Type>( (const Type *) foo, flen/sizeof(Type) );
+  };
+
 private:
 // Exactly conforms to raw data in Quake3 BSP file.
   int  mId;        // id number.
@@ -683,16 +729,45 @@ public:
   QuakeFace(const int *face);
   ~QuakeFace(void);
 
-  void Build(const UShortVector &elements,
+  void Build(const UIntVector &elements,
              const QuakeVertexVector &vertices,
+             const FloatVector &patchLods,
              ShaderReferenceVector &shaders,
-             const StringRef &lmPrefix,
+             const LightmapPlacement &lightmap,
              const StringRef &name,
-             const StringRef &code,
              VertexMesh &mesh);
 
+  // Build() in two steps.  Resolve() finds the shader and the section name
+  // and may load shader files, so it must run on one thread at a time.
+  // Emit() only reads the face data and writes into 'mesh', so faces can be
+  // emitted concurrently into separate meshes.  Emit() returns true if it
+  // added any triangles.  Patches are tessellated once per tolerance in
+  // patchLods, each as its own LOD level, or once at the default
+  // tolerance if patchLods is empty.  'lightmap' tells which image the
+  // lightmap of the face went to and how its texture coordinates move.
+  StringRef Resolve(ShaderReferenceVector &shaders,
+                    const LightmapPlacement &lightmap,
+                    QuakeShader *&shader) const;
+
+  bool Emit(const StringRef &mat,
+            const UIntVector &elements,
+            const QuakeVertexVector &vertices,
+            const FloatVector &patchLods,
+            const LightmapPlacement &lightmap,
+            VertexMesh &mesh) const;
+
   
   bool HasLightMap() const 	{ return mLightmap >= 0; }
+  int GetLightmap() const 	{ return mLightmap; }
+
+  // the part of the lightmap page the face uses
+  void GetLightmapRect(int &x,int &y,int &wid,int &hit) const
+  {
+    x = mOffsetX;
+    y = mOffsetY;
+    wid = mSizeX;
+    hit = mSizeY;
+  }
 
 private:
   int      mFrameNo;
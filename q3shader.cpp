@@ -2,6 +2,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <ctype.h>
+#include <charconv>
 
 
 //############################################################################
@@ -24,95 +26,460 @@
 #include "q3shader.h"
 #include "fload.h"
 #include "main.h"
+#include "manifest.h"
+#include "fileindex.h"
+#include "parallel.h"
+#include "shadercache.h"
 
 QuakeShaderFactory *QuakeShaderFactory::gSingleton=0; // global instance of data
+int QuakeShaderFactory::gJobs=0;
+String QuakeShaderFactory::gCacheName;
+
+// the scripts that used to be the only ones loaded, in their old order,
+// so that a shader defined in several scripts keeps the definition it
+// always had.  Every other script in scripts/ comes after them.
+static const char *gScriptOrder[] =
+{
+  "sfx.shader", "sfx2.shader",
+
+  "base.shader", "base_button.shader", "base_floor.shader",
+  "base_floor2.shader", "base_light.shader", "base_object.shader",
+  "base_support.shader", "base_trim.shader", "base_wall.shader",
+  "base_wall2.shader", "common.shader", "ctf.shader", "ctf2.shader",
+  "eerie.shader", "flayer.shader", "gallery.shader", "gfx.shader",
+  "gfx2.shader", "gothic_block.shader", "gothic_floor.shader",
+  "gothic_floor2.shader", "gothic_light.shader", "gothic_trim.shader",
+  "gothic_wall.shader", "hell.shader", "jim_test.shader", "jk_dm1.shader",
+  "jk_tourney1.shader",
+
+  "liquid.shader", "liquid2.shader", "menu.shader", "models.shader",
+  "models2.shader", "models3.shader", "mre.shader", "multiplant.shader",
+  "museum.shader", "nateleaf.shader", "nateshad.shader",
+
+  "organics.shader", "outdoors.shader", "proto2.shader", "shrine.shader",
+  "skin.shader", "sky.shader", "stone2.shader", "team.shader",
+  "terrain.shader",
+
+  "test.shader", "tim.shader", "ui.shader", "ui_hud.shader",
+  "ui_kc.shader", "work.shader", "work_tri1.shader",
+
+  "nvidia.shader", // NV15
+
+  0
+};
+
+// the keywords Process knows, found with a perfect hash of the length and
+// the first and last letter, without case.
+enum ShaderKeyword
+{
+  SK_NONE,
+  SK_CULL,
+  SK_SURFACEPARM,
+  SK_SKYPARMS,
+  SK_MAP,
+  SK_CLAMPMAP,
+  SK_ANIMMAP,
+  SK_BLENDFUNC,
+  SK_ALPHAFUNC,
+  SK_TCMOD,
+  SK_TCGEN,
+  SK_RGBGEN,
+  SK_ALPHAGEN,
+  SK_SORT
+};
+
+class ShaderKeywordEntry
+{
+public:
+  const char   *mName;
+  ShaderKeyword mKeyword;
+};
+
+#define SHADER_KEYWORD_HASH(len,first,last) ( ( (len)*3 + (first)*2 + (last) ) & 31 )
+
+static const ShaderKeywordEntry gShaderKeywords[32] =
+{
+  { "alphafunc",   SK_ALPHAFUNC },   // 0
+  { 0,             SK_NONE },
+  { "blendfunc",   SK_BLENDFUNC },   // 2
+  { 0,             SK_NONE },
+  { "rgbgen",      SK_RGBGEN },      // 4
+  { "tcgen",       SK_TCGEN },       // 5
+  { "sort",        SK_SORT },        // 6
+  { "animmap",     SK_ANIMMAP },     // 7
+  { "alphagen",    SK_ALPHAGEN },    // 8
+  { 0,             SK_NONE },
+  { 0,             SK_NONE },
+  { 0,             SK_NONE },
+  { 0,             SK_NONE },
+  { 0,             SK_NONE },
+  { "clampmap",    SK_CLAMPMAP },    // 14
+  { 0,             SK_NONE },
+  { 0,             SK_NONE },
+  { "skyparms",    SK_SKYPARMS },    // 17
+  { 0,             SK_NONE },
+  { "map",         SK_MAP },         // 19
+  { "surfaceparm", SK_SURFACEPARM }, // 20
+  { 0,             SK_NONE },
+  { 0,             SK_NONE },
+  { 0,             SK_NONE },
+  { 0,             SK_NONE },
+  { 0,             SK_NONE },
+  { 0,             SK_NONE },
+  { "tcmod",       SK_TCMOD },       // 27
+  { 0,             SK_NONE },
+  { 0,             SK_NONE },
+  { "cull",        SK_CULL },        // 30
+  { 0,             SK_NONE },
+};
+
+// the names of the compiled keywords, in the order of their enums.  Empty
+// names never match.
+static const char *gBlendFactorNames[] =
+{
+  "", "GL_ZERO", "GL_ONE", "GL_SRC_COLOR", "GL_ONE_MINUS_SRC_COLOR",
+  "GL_DST_COLOR", "GL_ONE_MINUS_DST_COLOR", "GL_SRC_ALPHA",
+  "GL_ONE_MINUS_SRC_ALPHA", "GL_DST_ALPHA", "GL_ONE_MINUS_DST_ALPHA",
+  "GL_SRC_ALPHA_SATURATE", 0
+};
+
+static const char *gTextureModeNames[] =
+{
+  "ADD", "MODULATE", "REPLACE", "BLENDTEXTUREALPHA", 0
+};
+
+static const char *gWaveFormNames[] =
+{
+  "", "sin", "triangle", "square", "sawtooth", "inversesawtooth", "noise", 0
+};
+
+static const char *gColorSourceNames[] =
+{
+  "", "identity", "identityLighting", "wave", "vertex", "exactVertex",
+  "oneMinusVertex", "entity", "oneMinusEntity", "lightingDiffuse",
+  "lightingSpecular", "const", "portal", 0
+};
+
+static const char *gTcModNames[] =
+{
+  "scroll", "scale", "rotate", "stretch", "turb", "transform",
+  "entityTranslate", 0
+};
+
+static const char *gTcGenNames[] =
+{
+  "base", "lightmap", "environment", "vector", 0
+};
+
+// indexed by the sort number
+static const char *gSortNames[] =
+{
+  "", "portal", "sky", "opaque", "decal", "seeThrough", "banner", "",
+  "underwater", "", "additive", "", "", "", "", "", "nearest", 0
+};
+
+static bool SameNoCase(const std::string_view &a,const char *b)
+{
+  size_t i = 0;
+  for (; i<a.size(); i++)
+  {
+    if ( !b[i] || tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]) ) return false;
+  }
+  return b[i] == 0;
+}
+
+// index of word in a list of names, 'missing' if it is not there.
+static int FindName(const std::string_view &word,const char * const *names,int missing)
+{
+  for (int i=0; names[i]; i++)
+  {
+    if ( names[i][0] && SameNoCase(word,names[i]) ) return i;
+  }
+  return missing;
+}
+
+const char * GetTextureModeName(ShaderTextureMode mode)
+{
+  return gTextureModeNames[mode];
+}
+
+static ShaderKeyword GetKeyword(const std::string_view &word)
+{
+  if ( word.empty() ) return SK_NONE;
+  unsigned int first = tolower((unsigned char)word[0]);
+  unsigned int last  = tolower((unsigned char)word[word.size()-1]);
+  const ShaderKeywordEntry &e = gShaderKeywords[ SHADER_KEYWORD_HASH((unsigned int)word.size(),first,last) ];
+  if ( e.mName && SameNoCase(word,e.mName) ) return e.mKeyword;
+  return SK_NONE;
+}
+
+// the string table wants zero terminated text, terminate a copy on the
+// stack unless the argument is too long for it.
+static StringRef GetRef(const std::string_view &str,bool upper=false)
+{
+  char scratch[1024];
+  if ( str.size() >= sizeof(scratch) )
+  {
+    String text(str.data(),str.size());
+    for (size_t i=0; upper && i<text.size(); i++) text[i] = (char)toupper((unsigned char)text[i]);
+    return StringDict::gStringDict().Get(text);
+  }
+  for (size_t i=0; i<str.size(); i++)
+  {
+    scratch[i] = upper ? (char)toupper((unsigned char)str[i]) : str[i];
+  }
+  scratch[str.size()] = 0;
+  return StringDict::gStringDict().Get(scratch);
+}
+
+// what atof gives for the argument, parsed in place.  0 if it is no number.
+static float GetFloat(const std::string_view &str)
+{
+  const char *first = str.data();
+  const char *last = first + str.size();
+  if ( first != last && *first == '+' ) first++;
+  double v = 0;
+  std::from_chars(first,last,v);
+  return (float)v;
+}
+
+// up to count floats from the arguments starting at 'first', the brackets
+// of "( 1 0 0 )" left out.  Missing ones stay as they are.
+static void GetFloats(const ShaderLine &args,int first,float *v,int count)
+{
+  int n = 0;
+  for (int i=first; i<args.size() && n<count; i++)
+  {
+    std::string_view arg = args[i];
+    while ( !arg.empty() && arg.front() == '(' ) arg.remove_prefix(1);
+    while ( !arg.empty() && arg.back() == ')' ) arg.remove_suffix(1);
+    if ( !arg.empty() ) v[n++] = GetFloat(arg);
+  }
+}
+
+// <base> <amp> <phase> <freq> from 'first' on
+static void GetWaveParams(const ShaderLine &args,int first,ShaderWave &wave)
+{
+  wave.mBase      = GetFloat(args[first]);
+  wave.mAmplitude = GetFloat(args[first+1]);
+  wave.mPhase     = GetFloat(args[first+2]);
+  wave.mFrequency = GetFloat(args[first+3]);
+}
+
+static void GetWave(const ShaderLine &args,int first,ShaderWave &wave)
+{
+  wave.mForm = (ShaderWaveForm) FindName(args[first],gWaveFormNames,SWF_NONE);
+  GetWaveParams(args,first+1,wave);
+}
+
+// rgbGen or alphaGen <source> ..
+static void GetColorGen(const ShaderLine &args,ShaderColorGen &gen)
+{
+  gen.mSource = (ShaderColorSource) FindName(args[1],gColorSourceNames,SCS_UNKNOWN);
+  if ( gen.mSource == SCS_WAVE )
+    GetWave(args,2,gen.mWave);
+  else if ( gen.mSource == SCS_CONST )
+    GetFloats(args,2,gen.mValue,3);
+  else if ( gen.mSource == SCS_PORTAL )
+    gen.mValue[0] = GetFloat(args[2]);
+}
+
+static ShaderBlendFactor GetBlendFactor(const std::string_view &arg)
+{
+  return (ShaderBlendFactor) FindName(arg,gBlendFactorNames,SBF_UNKNOWN);
+}
+
+bool ShaderTokenizer::NextLine(ShaderLine &line,int maxArgs)
+{
+  line.mCount = 0;
+  while ( 1 )
+  {
+    // line breaks as Fload::GetString sees them
+    while ( mPos < mLen && ( mData[mPos] == 0 || mData[mPos] == 10 || mData[mPos] == 13 ) ) mPos++;
+    if ( mPos >= mLen ) return false;
+    mLineStart = mPos;
+
+    while ( mPos < mLen && mData[mPos] && mData[mPos] != 10 && mData[mPos] != 13 )
+    {
+      char c = mData[mPos];
+      if ( isspace((unsigned char)c) )
+      {
+        mPos++;
+        continue;
+      }
+      if ( line.mCount >= maxArgs ||
+           ( c == '/' && mPos+1 < mLen && mData[mPos+1] == '/' ) ) // comment to the end of the line
+      {
+        while ( mPos < mLen && mData[mPos] && mData[mPos] != 10 && mData[mPos] != 13 ) mPos++;
+        break;
+      }
+
+      size_t start = mPos;
+      if ( c == '"' )
+      {
+        start = ++mPos;
+        while ( mPos < mLen && mData[mPos] != '"' && mData[mPos] && mData[mPos] != 10 && mData[mPos] != 13 ) mPos++;
+        line.Push( std::string_view(mData+start,mPos-start) );
+        if ( mPos < mLen && mData[mPos] == '"' ) mPos++;
+        continue;
+      }
+
+      while ( mPos < mLen && !isspace((unsigned char)mData[mPos]) && mData[mPos] &&
+              !( mData[mPos] == '/' && mPos+1 < mLen && mData[mPos+1] == '/' ) ) mPos++;
+      line.Push( std::string_view(mData+start,mPos-start) );
+    }
+
+    if ( line.mCount ) return true;
+  }
+}
+
+String QuakeShaderFactory::GetScriptSignature(void)
+{
+  StringVector scripts;
+  FileIndex::gFileIndex().List("scripts/",".shader",scripts);
+
+  String names;
+  for (unsigned int i=0; i<scripts.size(); i++)
+  {
+    names += scripts[i];
+    names += "\n";
+  }
+  char scratch[64];
+  sprintf(scratch,"scripts=%d:%016llx",(int)scripts.size(),
+          HashBytes((const unsigned char *)names.c_str(),names.size()));
+  return scratch;
+}
 
 QuakeShaderFactory::QuakeShaderFactory(void)
 {
-#if 0
-// try to load dynamic 
-  // shader where names not match ed skies ==> sky 	
-  AddShader("base.shader");
-
-  AddShader("liquid.shader");
-  AddShader("liquid2.shader"); // xx
-  AddShader("skin.shader");
-  AddShader("sky.shader");
-  AddShader("gfx.shader");
-  AddShader("gfx2.shader"); //xx
-  AddShader("sfx.shader");
-  AddShader("sfx2.shader");
-
-#else
-
-// added teamarena3 & nv15 shaders 
-  AddShader("sfx.shader");
-  AddShader("sfx2.shader");
-
-  AddShader("base.shader");
-  AddShader("base_button.shader");
-  AddShader("base_floor.shader");
-  AddShader("base_floor2.shader"); // xx
-  AddShader("base_light.shader");
-  AddShader("base_object.shader");
-  AddShader("base_support.shader");
-  AddShader("base_trim.shader");
-  AddShader("base_wall.shader");
-  AddShader("base_wall2.shader"); // xx
-  AddShader("common.shader");
-  AddShader("ctf.shader");
-  AddShader("ctf2.shader");	// xx
-  AddShader("eerie.shader");
-  AddShader("flayer.shader"); //xx 
-  AddShader("gallery.shader"); //xx 
-  AddShader("gfx.shader");
-  AddShader("gfx2.shader"); //xx
-  AddShader("gothic_block.shader");
-  AddShader("gothic_floor.shader");
-  AddShader("gothic_floor2.shader");
-  AddShader("gothic_light.shader");
-  AddShader("gothic_trim.shader");
-  AddShader("gothic_wall.shader");
-  AddShader("hell.shader");
-  AddShader("jim_test.shader");
-  AddShader("jk_dm1.shader");
-  AddShader("jk_tourney1.shader");
-
-  AddShader("liquid.shader");
-  AddShader("liquid2.shader"); // xx
-  AddShader("menu.shader");
-  AddShader("models.shader");
-  AddShader("models2.shader"); //x
-  AddShader("models3.shader"); //x
-  AddShader("mre.shader"); //x
-  AddShader("multiplant.shader"); //x
-  AddShader("museum.shader"); //x
-  AddShader("nateleaf.shader"); //x
-  AddShader("nateshad.shader"); //x
-
-  AddShader("organics.shader");
-  AddShader("outdoors.shader");
-  AddShader("proto2.shader");
-//  AddShader("sfx.shader");
-  //AddShader("sfx2.shader");
-  AddShader("shrine.shader");
-  AddShader("skin.shader");
-  AddShader("sky.shader");
-  AddShader("stone2.shader");
-  AddShader("team.shader");
-  AddShader("terrain.shader");
-
-  AddShader("test.shader");
-  AddShader("tim.shader");
-  AddShader("ui.shader");
-  AddShader("ui_hud.shader");
-  AddShader("ui_kc.shader");
-  AddShader("work.shader");
-  AddShader("work_tri1.shader");
-
-  AddShader("nvidia.shader"); // NV15 
-
-#endif
+  mCache = 0;
+
+  StringVector scripts;
+  FileIndex::gFileIndex().List("scripts/",".shader",scripts);
+
+  StringVector order;
+  std::set< String > ordered;
+  for (int i=0; gScriptOrder[i]; i++)
+  {
+    String key = FileIndex::GetKey( (String("scripts/")+gScriptOrder[i]).c_str() );
+    if ( std::binary_search(scripts.begin(),scripts.end(),key) )
+    {
+      order.push_back(gScriptOrder[i]);
+      ordered.insert(key);
+    }
+  }
+  for (unsigned int i=0; i<scripts.size(); i++)
+  {
+    if ( !ordered.count(scripts[i]) ) order.push_back(scripts[i].c_str()+strlen("scripts/"));
+  }
+
+  if ( !gCacheName.empty() )
+  {
+    mCache = new ShaderCache;
+    mCache->Load(gCacheName.c_str());
+  }
+
+  // scan the scripts on worker threads, then index them in order so that
+  // the first definition of a shader wins just as with one thread.  With
+  // a cache only the scripts that changed are read.
+  int count = (int)order.size();
+  std::vector< Fmap * > maps(count);
+  std::vector< ShaderNameVector > names(count);
+  std::vector< const ShaderCacheScript * > cached(count);
+  std::vector< ShaderFileStamp > stamps(count);
+  ParallelFor(count,gJobs,[&](int i)
+  {
+    String path = "scripts/" + order[i];
+    if ( mCache )
+    {
+      cached[i] = mCache->Find(path,stamps[i],maps[i]);
+      if ( cached[i] ) return;
+    }
+    if ( !maps[i] ) maps[i] = new Fmap(path);
+    ScanScript(*maps[i],names[i]);
+  });
+
+  if ( mCache ) UpdateCache(order,maps,names,cached,stamps);
+
+  for (int i=0; i<count; i++)
+  {
+    if ( cached[i] )
+    {
+      delete maps[i];
+      AddCachedScript(order[i].c_str(),*cached[i]);
+    }
+    else
+    {
+      AddScript(order[i].c_str(),maps[i],names[i]);
+    }
+  }
+
+  printf("Indexed %d shaders in %d shader files\n",(int)mLocations.size(),(int)mScriptNames.size());
+}
+
+void QuakeShaderFactory::UpdateCache(const StringVector &order,
+                                     const std::vector< Fmap * > &maps,
+                                     const std::vector< ShaderNameVector > &names,
+                                     std::vector< const ShaderCacheScript * > &cached,
+                                     const std::vector< ShaderFileStamp > &stamps)
+{
+  int count = (int)order.size();
+  int changed = 0;
+  for (int i=0; i<count; i++)
+  {
+    if ( !cached[i] ) changed++;
+  }
+  if ( !changed && mCache->GetScriptCount() == count ) return;
+
+  // the unchanged scripts keep their records, the others are parsed now.
+  ShaderCacheWriter writer;
+  for (int i=0; i<count; i++)
+  {
+    String path = "scripts/" + order[i];
+    ShaderFileStamp stamp = stamps[i];
+    if ( cached[i] )
+    {
+      writer.AddScript(path,stamp);
+      const std::vector< ShaderCacheName > &cnames = cached[i]->mNames;
+      for (unsigned int j=0; j<cnames.size(); j++)
+      {
+        const unsigned char *data;
+        size_t len;
+        if ( cnames[j].mRecord != SHADER_CACHE_NONE && mCache->GetRecord(cnames[j].mRecord,data,len) )
+          writer.AddRecord(cnames[j].mName,data,len);
+        else
+          writer.AddShader(cnames[j].mName,0);
+      }
+      continue;
+    }
+
+    const Fmap *script = maps[i];
+    if ( !stamp.mHash )
+    {
+      if ( script->GetData() )
+        stamp.mHash = HashBytes((const unsigned char *)script->GetData(),script->GetLen());
+      else
+        stamp.mHash = HashBytes(0,0);
+    }
+    writer.AddScript(path,stamp);
+    for (unsigned int j=0; j<names[i].size(); j++)
+    {
+      QuakeShader *shader = ParseText(*script,names[i][j].mOffset,GetRef(names[i][j].mName));
+      writer.AddShader(names[i][j].mName,shader);
+      delete shader;
+    }
+  }
+
+  // the old entries point into the old cache, which goes away now.
+  UCharVector data;
+  writer.Get(data);
+  mCache->Load(data);
+  mCache->Save(gCacheName.c_str());
+  for (int i=0; i<count; i++)
+  {
+    if ( cached[i] ) cached[i] = mCache->Get("scripts/" + order[i]);
+  }
+  printf("Shader cache %s: %d of %d shader files parsed again\n",gCacheName.c_str(),changed,count);
 }
 
 QuakeShaderFactory::~QuakeShaderFactory(void)
@@ -123,6 +490,11 @@ QuakeShaderFactory::~QuakeShaderFactory(void)
     QuakeShader *shader = (*i).second;
     delete shader;
   }
+  for (unsigned int j=0; j<mScripts.size(); j++)
+  {
+    delete mScripts[j];
+  }
+  delete mCache;
 }
 
 QuakeShader * QuakeShaderFactory::Locate(const String &str)
@@ -135,98 +507,147 @@ QuakeShader * QuakeShaderFactory::Locate(const StringRef &str)
   QuakeShaderMap::iterator found;
   found = mShaders.find(str);
   if ( found != mShaders.end() ) return (*found).second;
-  return 0;
-}
 
+  ShaderLocationMap::iterator indexed = mLocations.find(str);
+  if ( indexed == mLocations.end() ) return 0;
 
-bool 
-QuakeShaderFactory::ShaderFileLoaded(const StringRef &str)
-{
-  QuakeShaderFileMap::iterator found;
-  found = mShaderFiles.find(str);
-  if ( found != mShaderFiles.end() ) 
-	  return (*found).second;
-  return false;
-}
+  const ShaderLocation &loc = (*indexed).second;
+  QuakeShader *shader;
+  if ( loc.mScript < 0 )
+    shader = mCache->ReadShader( (unsigned int) loc.mOffset );
+  else
+    shader = ParseText(*mScripts[loc.mScript],loc.mOffset,str);
 
+  mShaders[str] = shader; // NULL for broken text, don't parse it again
+  if ( shader ) printf("Added shader: %s\n",str.Get());
+  return shader;
+}
 
 bool  QuakeShaderFactory::AddShader(const StringRef &sname)
 {
+  Fmap *script = new Fmap( String("scripts/") + sname.Get() );
+  ShaderNameVector names;
+  ScanScript(*script,names);
+  return AddScript(sname.Get(),script,names);
+}
 
-  mBraceCount = 0;
-  mCurrent    = 0;
-
-  mCurrentStage = 0;
+void QuakeShaderFactory::ScanScript(const Fmap &script,ShaderNameVector &names)
+{
+  // the name of every shader is the first argument of a line outside of
+  // braces.  Only the first argument of a line opens or closes a brace,
+  // just like Process sees it.
+  ShaderTokenizer tokens((const char *)script.GetData(),script.GetLen());
+  ShaderLine line;
+  int braces = 0;
+  while ( tokens.NextLine(line,1) )
+  {
+    std::string_view arg = line[0];
+    if ( arg == "{" )
+    {
+      braces++;
+    }
+    else if ( arg == "}" )
+    {
+      if ( braces > 0 ) braces--;
+    }
+    else if ( braces == 0 )
+    {
+      ShaderName name;
+      name.mName = arg;
+      name.mOffset = tokens.GetLineStart();
+      names.push_back(name);
+    }
+  }
+}
 
+bool QuakeShaderFactory::AddScript(const char *sname,Fmap *script,const ShaderNameVector &names)
+{
   char filename[1024];
-  sprintf(filename, "scripts/%s", sname.Get());
-  Fload shader(filename);
+  sprintf(filename, "scripts/%s", sname);
+  RecordDependency(filename);
 
-  if (!shader.GetData()) {
-    printf("***********SHADER FILE NOT FOUND in scripts/ : %s \n",sname.c_str());
+  if (!script || !script->GetData()) {
+    printf("***********SHADER FILE NOT FOUND in scripts/ : %s \n",sname);
+    delete script;
     return false;
   }
 
-  // TODO (vlaube): should we use the full filename here?
-  mShaderFiles[sname] = true; 
+  int index = (int)mScripts.size();
+  mScripts.push_back(script);
+  mScriptNames.push_back(filename);
 
-  printf("***********SHADER FILE PROCESS : %s \n",sname.c_str());
-
-  while ( 1 )
+  for (unsigned int i=0; i<names.size(); i++)
   {
-
-    char *str = shader.GetString();
-
-    if ( !str ) break;
-
-    ShaderString(str); // process one string.
+    AddLocation(GetRef(names[i].mName),index,names[i].mOffset);
   }
-
-  delete mCurrent;
-  mCurrent = 0;
-  delete mCurrentStage;
-  mCurrentStage = 0;
   return true;
-
 }
 
-void QuakeShaderFactory::ShaderString(const char *str)
+bool QuakeShaderFactory::AddCachedScript(const char *sname,const ShaderCacheScript &script)
 {
-  char workspace[1024];
+  char filename[1024];
+  sprintf(filename, "scripts/%s", sname);
+  RecordDependency(filename);
+
+  // a script that could not be read is cached as empty
+  if ( !script.mStamp.mSize ) {
+    printf("***********SHADER FILE NOT FOUND in scripts/ : %s \n",sname);
+    return false;
+  }
 
-  char *dest = workspace;
+  mScriptNames.push_back(filename);
 
-  while ( *str )
+  for (unsigned int i=0; i<script.mNames.size(); i++)
   {
-    if ( str[0] == '/' && str[1] == '/' ) 
-		break;
-    *dest++ = *str++;
+    AddLocation(GetRef(script.mNames[i].mName),-1,script.mNames[i].mRecord);
   }
-  *dest = 0;
-  int len = strlen(workspace);
-  if ( len == 0 ) return;
-
-  ArgList::Set( workspace ); // crunch it into arguments.
-  // now ready to process it as a series of arguments!
-  if ( mArgs.size() ) Process(mArgs);
+  return true;
 }
 
-
-// bad code, but what 
-void strlwr(const String &l,String &dest)
+void QuakeShaderFactory::AddLocation(const StringRef &ref,int script,size_t offset)
 {
- char workspace[1024];
- strcpy(workspace,l.c_str());
- dest = strlwr(workspace);
+  if ( mLocations.find(ref) != mLocations.end() )
+  {
+    printf("Can't add shader %s, it already exists!!\n",ref.Get());
+  }
+  else
+  {
+    ShaderLocation &loc = mLocations[ref];
+    loc.mScript = script;
+    loc.mOffset = offset;
+  }
 }
-void strupr(const String &l,String &dest)
+
+QuakeShader * QuakeShaderFactory::ParseText(const Fmap &script,size_t offset,const StringRef &name)
 {
- char workspace[1024];
- strcpy(workspace,l.c_str());
- dest = strupr(workspace);
+  ShaderTokenizer tokens((const char *)script.GetData(),script.GetLen(),offset);
+  QuakeShaderMap parsed;
+  {
+    ShaderParser parser(parsed);
+
+    // the name line, then everything up to the brace that closes it.
+    bool opened = false;
+    ShaderLine line;
+    while ( tokens.NextLine(line) )
+    {
+      parser.Process(line);
+      if ( parser.GetBraceCount() > 0 ) opened = true;
+      else if ( opened || !parser.InShader() ) break;
+    }
+  }
+
+  // broken text can finish some other shader instead
+  QuakeShader *shader = 0;
+  QuakeShaderMap::iterator i;
+  for (i=parsed.begin(); i!=parsed.end(); ++i)
+  {
+    if ( (*i).first == name ) shader = (*i).second;
+    else delete (*i).second;
+  }
+  return shader;
 }
 
-void QuakeShaderFactory::Process(const StringVector &args)
+void ShaderParser::Process(const ShaderLine &args)
 {
 
   if ( args[0] == "{" )
@@ -253,7 +674,6 @@ void QuakeShaderFactory::Process(const StringVector &args)
           else
           {
             mShaders[ref] = mCurrent;
-            printf("Added shader: %s\n",ref.Get());
             mCurrent = 0;
           }
         }
@@ -287,30 +707,40 @@ void QuakeShaderFactory::Process(const StringVector &args)
 		delete mCurrentStage; // if didn't process the last one
         mCurrentStage = 0;
 
-		// new shader start
-        char name[256];
-        //if ( GetName(args[0],name))
-		strcpy(name,args[0].c_str()); // we take the full path name 
-        {
-          StringRef ref = StringDict::gStringDict().Get(name);
-          mCurrent = new QuakeShader(ref);
-        }
+		// new shader start, we take the full path name 
+        mCurrent = new QuakeShader( GetRef(args[0]) );
       }
       else
       if (mCurrent) {
+		  ShaderKeyword keyword = GetKeyword(args[0]);
+
 		  if (mBraceCount == 1) { // at shader level 
-		    if ( args[0] == "cull" && args.size() == 2)
+		    if ( keyword == SK_CULL && args.size() == 2)
 	        {		// disable none trans alphashadow nomarks
-				 mCurrent->mCull = args[1];
+				 mCurrent->mCull = GetRef(args[1]);
+				 if ( args[1] == "none" || args[1] == "disable" )
+					 mCurrent->mCullMode = SC_NONE;
+				 else if ( args[1] == "back" )
+					 mCurrent->mCullMode = SC_BACK;
+				 else
+					 mCurrent->mCullMode = SC_FRONT;
 			}
-		    else if ( args[0] == "surfaceparm" && args.size() == 2)
+		    else if ( keyword == SK_SORT && args.size() == 2)
+	        {
+				int sort = FindName(args[1],gSortNames,-1);
+				if ( sort < 0 ) sort = (int)GetFloat(args[1]);
+				if ( sort < 0 ) sort = 0;
+				if ( sort > SS_NEAREST ) sort = SS_NEAREST;
+				mCurrent->mSort = (ShaderSort)sort;
+			}
+		    else if ( keyword == SK_SURFACEPARM && args.size() == 2)
 	        {
 				if ( args[1] == "nolightmap" )
 					 mCurrent->mNoLightMap = true;
 				else if ( args[1] == "sky" )
 					 mCurrent->mSky = true;
 			}
-			else if ( args[0] == "skyparms")
+			else if ( keyword == SK_SKYPARMS )
 	        {
 
 			}
@@ -319,165 +749,154 @@ void QuakeShaderFactory::Process(const StringVector &args)
 		    if (!mCurrentStage) 
 				mCurrentStage = new ShaderStage;
 
-
-			String arg0; 
-			strlwr(args[0],arg0);
-
 			// process command!
 			// store data in mCurrentStage
-
-			if ( arg0 == "map"  && args.size() == 2  )
+			switch ( keyword )
 			{
-			  //char name[256];
-			  // this strips the extension ?	
-			  //if ( GetName(args[1],name) )
+			case SK_MAP:
+			case SK_CLAMPMAP:
+			  if ( args.size() != 2 ) break;
 			  if (args[1] != "$lightmap")	
 			  {
-				const StringRef ref = StringDict::gStringDict().Get(args[1]);
+				const StringRef ref = GetRef(args[1]);
 				mCurrentStage->map = ref;
+				if ( keyword == SK_CLAMPMAP ) mCurrentStage->clamp = true;
 				mCurrent->AddTexture(ref);
-				//printf("Adding texture %s\n",ref.Get());
 			  } else {
 				  mCurrentStage->isLightMap = true;
 			  }	
-			}
-			else if ( arg0 == "clampmap"  && args.size() == 2  )
-			{
-			  if (args[1] != "$lightmap")	
-			  {
-				const StringRef ref = StringDict::gStringDict().Get(args[1]);
-				mCurrentStage->map = ref;
- 				mCurrentStage->clamp = true;
+			  break;
 
-				mCurrent->AddTexture(ref);
-				//printf("Adding texture %s\n",ref.Get());
-			  } else {
-				  mCurrentStage->isLightMap = true;
-				  //if (mCurrentStage->textureBlendMode == String(""))
-				  //mCurrentStage->textureBlendMode = "ADD";
-			  }	
-			}
-			else if ( arg0 == "animmap") {
+			case SK_ANIMMAP:
 				mCurrentStage->isAnimMap = true;
-				mCurrentStage->animMapFrequency = (float)atof(args[1].c_str());
-				for (unsigned int i=2; i< args.size(); i++) 
-					mCurrentStage->animMap.push_back(args[i]);
-			}
-			else if ( arg0 == "blendfunc")
-			{
-					//blendFunc GL_DST_COLOR GL_ZERO
-					//blendFunc GL_DST_COLOR GL_ONE_MINUS_DST_ALPHA
-					//blendFunc GL_ONE GL_ONE
-					//blendFunc GL_ONE GL_ZERO
-					//blendFunc blend
-					//blendFunc filter
-					// [Source * <srcBlend>] + [Destination * <dstBlend>]
-					if (args.size() == 3) {
-
-						String arg1; 
-						strupr(args[1],arg1);
-						String arg2; 
-						strupr(args[2],arg2);
-
-
-						mCurrentStage->blendFuncSrc = arg1;
-						mCurrentStage->blendFuncDst = arg2;
-
-						if (arg1=="GL_SRC_ALPHA")
-							mCurrentStage->textureBlendMode = "BLENDTEXTUREALPHA";
-
-						if (arg1=="GL_ONE" &&  arg2=="GL_ZERO")
-							mCurrentStage->textureBlendMode = "REPLACE";
-						else 
-						if (arg1=="GL_ONE" &&  arg2=="GL_ONE")
-							mCurrentStage->textureBlendMode = "ADD";
-						else 
-						if (arg1=="GL_SRC_ALPHA" && arg2=="GL_ONE_MINUS_SRC_ALPHA")
-							mCurrentStage->textureBlendMode = "BLENDTEXTUREALPHA";
-						else 
-						if (arg1=="GL_DST_COLOR" &&  arg2 =="GL_ONE_MINUS_DST_ALPHA")
-							//mCurrentStage->textureBlendMode = "BLENDCURRENTALPHA"; // ??? 
-							mCurrentStage->textureBlendMode = "MODULATE"; // ??? 
-						else if (arg1=="GL_DST_COLOR" &&  arg2=="GL_ZERO")
-							mCurrentStage->textureBlendMode = "MODULATE"; 
-
-
-					   // GL_DST_COLOR GL_ONE_MINUS_DST_ALPHA
-					   // GL_DST_COLOR GL_ZERO
-					}
-					else mCurrentStage->blendFuncSrc = args[1];
-					if (args[1]=="add") {
-						mCurrentStage->textureBlendMode = "ADD";
-						mCurrentStage->blendFuncSrc = "GL_ONE";
-						mCurrentStage->blendFuncDst = "GL_ONE";
-					} else 
-					if (args[1]=="filter") {
-						mCurrentStage->textureBlendMode = "MODULATE";
-						mCurrentStage->blendFuncSrc = "GL_DST_COLOR";
-						mCurrentStage->blendFuncDst = "GL_ZERO";
-					} else 
-					if (args[1]=="blend") { // ??
-						mCurrentStage->textureBlendMode = "BLENDTEXTUREALPHA";
-						mCurrentStage->blendFuncSrc = "GL_SRC_ALPHA";
-						mCurrentStage->blendFuncDst = "GL_ONE_MINUS_SRC_ALPHA";
-					}
-
-					//tcmod scroll 0 1
-					//tcMod turb 0 .25 0 5.6
-					//tcmod scale 1.5 1.5
-					//tcGen environment
-					//tcMod scroll 0.15 0.15
-					//depthWrite
-					//map $lightmap
-					
-					//rgbGen identity
-					//rgbGen wave sin .5 .5 0 .5	
-					//depthfunc equal
-
+				mCurrentStage->animMapFrequency = GetFloat(args[1]);
+				for (int i=2; i< args.size(); i++) 
+					mCurrentStage->animMap.push_back( GetRef(args[i]) );
+				break;
+
+			case SK_BLENDFUNC:
+				// [Source * <srcBlend>] + [Destination * <dstBlend>]
+				if (args.size() == 3) {
+					mCurrentStage->blendFuncSrc = GetRef(args[1],true);
+					mCurrentStage->blendFuncDst = GetRef(args[2],true);
+					ShaderBlendFactor src = GetBlendFactor(args[1]);
+					ShaderBlendFactor dst = GetBlendFactor(args[2]);
+					mCurrentStage->blendSrc = src;
+					mCurrentStage->blendDst = dst;
+
+					if (src == SBF_SRC_ALPHA)
+						mCurrentStage->blendMode = STM_BLENDTEXTUREALPHA;
+
+					if (src == SBF_ONE && dst == SBF_ZERO)
+						mCurrentStage->blendMode = STM_REPLACE;
+					else 
+					if (src == SBF_ONE && dst == SBF_ONE)
+						mCurrentStage->blendMode = STM_ADD;
+					else 
+					if (src == SBF_SRC_ALPHA && dst == SBF_ONE_MINUS_SRC_ALPHA)
+						mCurrentStage->blendMode = STM_BLENDTEXTUREALPHA;
+					else 
+					if (src == SBF_DST_COLOR && dst == SBF_ONE_MINUS_DST_ALPHA)
+						mCurrentStage->blendMode = STM_MODULATE; // ??? 
+					else if (src == SBF_DST_COLOR && dst == SBF_ZERO)
+						mCurrentStage->blendMode = STM_MODULATE; 
+				}
+				else {
+					mCurrentStage->blendFuncSrc = GetRef(args[1]);
+					mCurrentStage->blendSrc = GetBlendFactor(args[1]);
+				}
+				if (args[1]=="add") {
+					mCurrentStage->blendMode = STM_ADD;
+					mCurrentStage->blendFuncSrc = "GL_ONE";
+					mCurrentStage->blendFuncDst = "GL_ONE";
+					mCurrentStage->blendSrc = SBF_ONE;
+					mCurrentStage->blendDst = SBF_ONE;
+				} else 
+				if (args[1]=="filter") {
+					mCurrentStage->blendMode = STM_MODULATE;
+					mCurrentStage->blendFuncSrc = "GL_DST_COLOR";
+					mCurrentStage->blendFuncDst = "GL_ZERO";
+					mCurrentStage->blendSrc = SBF_DST_COLOR;
+					mCurrentStage->blendDst = SBF_ZERO;
+				} else 
+				if (args[1]=="blend") { // ??
+					mCurrentStage->blendMode = STM_BLENDTEXTUREALPHA;
+					mCurrentStage->blendFuncSrc = "GL_SRC_ALPHA";
+					mCurrentStage->blendFuncDst = "GL_ONE_MINUS_SRC_ALPHA";
+					mCurrentStage->blendSrc = SBF_SRC_ALPHA;
+					mCurrentStage->blendDst = SBF_ONE_MINUS_SRC_ALPHA;
+				}
+				mCurrentStage->textureBlendMode = GetTextureModeName(mCurrentStage->blendMode);
+				break;
 
+			case SK_ALPHAFUNC: // GE128 
+				break;
 
-			}
-			else if (arg0 == "alphafunc") 
-			{  // GE128 
-			}
-			else if (arg0 == "tcmod")
-			{
+			case SK_TCMOD:
 				if (mCurrentStage->tcmod.length()>0) 	mCurrentStage->tcmod += ',';
 
 				if (args[1] == "scale" || args[1] == "scroll" || args[1] == "rotate") {
-					for (unsigned int i=1; i< args.size(); i++) {
+					for (int i=1; i< args.size(); i++) {
 						mCurrentStage->tcmodOk += args[i];
 						mCurrentStage->tcmodOk += ' ';
 					}
 
 				} else {
-					for (unsigned int i=1; i< args.size(); i++) {
+					for (int i=1; i< args.size(); i++) {
 						mCurrentStage->tcmod += args[i];
 						mCurrentStage->tcmod += ' ';
 					}
 				}
-			}
-			else if (arg0 == "tcgen")
-			{
+
+				{
+					int type = FindName(args[1],gTcModNames,-1);
+					if (type < 0) break;
+					ShaderTcMod mod;
+					mod.mType = (ShaderTcModType)type;
+					if (mod.mType == STC_STRETCH)
+						GetWave(args,2,mod.mWave);
+					else if (mod.mType == STC_TURB) {
+						mod.mWave.mForm = SWF_SIN;
+						GetWaveParams(args,2,mod.mWave);
+					}
+					else GetFloats(args,2,mod.mParams,6);
+					mCurrentStage->tcMods.push_back(mod);
+				}
+				break;
+
+			case SK_TCGEN:
 				if (mCurrentStage->tcmod.length()>0) 	mCurrentStage->tcmod += ',';
 				mCurrentStage->tcmod += "tcgen ";
-				for (unsigned int i=1; i< args.size(); i++) {
+				for (int i=1; i< args.size(); i++) {
 					mCurrentStage->tcmod += args[i];
 					mCurrentStage->tcmod += ' ';
 				}
-			}
-			else if (arg0 == "rgbgen")
-			{
+				mCurrentStage->tcGen = (ShaderTcGen) FindName(args[1],gTcGenNames,STG_BASE);
+				if (mCurrentStage->tcGen == STG_VECTOR)
+					GetFloats(args,2,mCurrentStage->tcGenVector,6);
+				break;
+
+			case SK_RGBGEN:
 				// identityLighting
 				// identity
 				// wave <func> <base> <amp> <phase> <freq>
-				for (unsigned int i=1; i< args.size(); i++) {
+				for (int i=1; i< args.size(); i++) {
 					if (i>1) mCurrentStage->rgbGen += ' ';
 					mCurrentStage->rgbGen += args[i];
 				}
-			}
-			else {
+				GetColorGen(args,mCurrentStage->rgb);
+				break;
+
+			case SK_ALPHAGEN:
+				for (int i=1; i< args.size(); i++) {
+					if (i>1) mCurrentStage->alphaGen += ' ';
+					mCurrentStage->alphaGen += args[i];
+				}
+				GetColorGen(args,mCurrentStage->alpha);
+				break;
 
+			default:
+				break;
 			}
 		  } // braceCount == 2
       }
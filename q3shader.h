@@ -21,8 +21,160 @@
 
 
 
+#include <string_view>
 #include "stringdict.h"
-#include "arglist.h"
+
+// the shader keywords compiled into enums and numbers when the shader is
+// parsed, so that writing and evaluating it needs no string compares.
+// The text they came from is kept next to them.
+
+// a blendFunc factor
+enum ShaderBlendFactor
+{
+  SBF_NONE, // no blendFunc
+  SBF_ZERO,
+  SBF_ONE,
+  SBF_SRC_COLOR,
+  SBF_ONE_MINUS_SRC_COLOR,
+  SBF_DST_COLOR,
+  SBF_ONE_MINUS_DST_COLOR,
+  SBF_SRC_ALPHA,
+  SBF_ONE_MINUS_SRC_ALPHA,
+  SBF_DST_ALPHA,
+  SBF_ONE_MINUS_DST_ALPHA,
+  SBF_SRC_ALPHA_SATURATE,
+  SBF_UNKNOWN
+};
+
+// the VRML MultiTexture mode of a stage
+enum ShaderTextureMode
+{
+  STM_ADD,
+  STM_MODULATE,
+  STM_REPLACE,
+  STM_BLENDTEXTUREALPHA
+};
+
+// "ADD", "MODULATE" ..
+const char * GetTextureModeName(ShaderTextureMode mode);
+
+enum ShaderWaveForm
+{
+  SWF_NONE,
+  SWF_SIN,
+  SWF_TRIANGLE,
+  SWF_SQUARE,
+  SWF_SAWTOOTH,
+  SWF_INVERSESAWTOOTH,
+  SWF_NOISE
+};
+
+// <func> <base> <amp> <phase> <freq>
+class ShaderWave
+{
+public:
+  ShaderWave(void)
+  {
+    mForm = SWF_NONE;
+    mBase = mAmplitude = mPhase = mFrequency = 0;
+  };
+
+  ShaderWaveForm mForm;
+  float          mBase;
+  float          mAmplitude;
+  float          mPhase;
+  float          mFrequency;
+};
+
+// where rgbGen and alphaGen take the colour from
+enum ShaderColorSource
+{
+  SCS_NONE, // not given
+  SCS_IDENTITY,
+  SCS_IDENTITYLIGHTING,
+  SCS_WAVE,
+  SCS_VERTEX,
+  SCS_EXACTVERTEX,
+  SCS_ONEMINUSVERTEX,
+  SCS_ENTITY,
+  SCS_ONEMINUSENTITY,
+  SCS_LIGHTINGDIFFUSE,
+  SCS_LIGHTINGSPECULAR,
+  SCS_CONST,
+  SCS_PORTAL,
+  SCS_UNKNOWN
+};
+
+class ShaderColorGen
+{
+public:
+  ShaderColorGen(void)
+  {
+    mSource = SCS_NONE;
+    mValue[0] = mValue[1] = mValue[2] = 0;
+  };
+
+  ShaderColorSource mSource;
+  ShaderWave        mWave;     // SCS_WAVE
+  float             mValue[3]; // SCS_CONST colour or alpha, SCS_PORTAL range
+};
+
+enum ShaderTcModType
+{
+  STC_SCROLL,    // s t per second
+  STC_SCALE,     // s t
+  STC_ROTATE,    // degrees per second
+  STC_STRETCH,   // mWave
+  STC_TURB,      // mWave, always a sine
+  STC_TRANSFORM, // m00 m01 m10 m11 t0 t1
+  STC_ENTITYTRANSLATE
+};
+
+class ShaderTcMod
+{
+public:
+  ShaderTcMod(void)
+  {
+    mType = STC_SCROLL;
+    for (int i=0; i<6; i++) mParams[i] = 0;
+  };
+
+  ShaderTcModType mType;
+  float           mParams[6];
+  ShaderWave      mWave;
+};
+
+typedef std::vector< ShaderTcMod > ShaderTcModVector;
+
+enum ShaderTcGen
+{
+  STG_BASE,
+  STG_LIGHTMAP,
+  STG_ENVIRONMENT,
+  STG_VECTOR // the s and t vectors in tcGenVector
+};
+
+enum ShaderCull
+{
+  SC_FRONT,
+  SC_BACK, // cull back
+  SC_NONE  // cull none or disable
+};
+
+// the sort keyword, a number or one of these names
+enum ShaderSort
+{
+  SS_NONE       = 0, // not given
+  SS_PORTAL     = 1,
+  SS_SKY        = 2,
+  SS_OPAQUE     = 3,
+  SS_DECAL      = 4,
+  SS_SEETHROUGH = 5,
+  SS_BANNER     = 6,
+  SS_UNDERWATER = 8,
+  SS_ADDITIVE   = 10,
+  SS_NEAREST    = 16
+};
 
 // storing info about one blending stage 
 class ShaderStage 
@@ -31,9 +183,13 @@ public :
 
 	ShaderStage() : 
 	    animMapFrequency(1.0f),
+		blendSrc(SBF_NONE),blendDst(SBF_NONE),
+		tcGen(STG_BASE),
 		isLightMap(false),isAnimMap(false),clamp(false),
-		textureBlendMode("ADD")
+		textureBlendMode("ADD"),
+		blendMode(STM_ADD)
 	{ 
+		for (int i=0; i<6; i++) tcGenVector[i] = 0;
 	}
 		
 	StringRef map;
@@ -46,12 +202,20 @@ public :
 	StringRef blendFuncDst;
 	StringRef alphaFunc;
 	StringRef depthFunc;
+	ShaderBlendFactor blendSrc;
+	ShaderBlendFactor blendDst;
 
 
 	String tcmodOk;	// tcmod tokens known, can be used in VRML 
 	String tcmod;	// tcmod tokens 
+	ShaderTcModVector tcMods; // every tcMod in order, unknown ones left out
+	ShaderTcGen tcGen;
+	float tcGenVector[6];
 
 	String rgbGen;
+	String alphaGen;
+	ShaderColorGen rgb;
+	ShaderColorGen alpha;
 
 
 	bool isLightMap;
@@ -60,6 +224,7 @@ public :
 
 	// texure blend mode in Multi Texturing 
     StringRef textureBlendMode;	  // 
+	ShaderTextureMode blendMode;
 
 };
 
@@ -75,6 +240,8 @@ public:
 	mNoLightMap = false;
 	mSky = false;
 	mLightMapStage=0;
+	mCullMode = SC_FRONT;
+	mSort = SS_NONE;
   };
   
   const StringRef& GetName(void) const { return mName; };
@@ -94,8 +261,12 @@ public:
     ref = mTextures[0];
     return true;
   }
+
+  const StringRefVector & GetTextures(void) const { return mTextures; };
   
   StringRef mCull;	  // cull property : none
+  ShaderCull mCullMode;
+  ShaderSort mSort;
 
   bool		mTrans;		  // transparent
 
@@ -107,10 +278,10 @@ public:
   String	skyBox;
 
 
-  // add an stage 
+  // add an stage, its contents are moved over
   void AddStage (ShaderStage *stage) 
   {
-	 mStages.push_back(*stage);
+	 mStages.push_back(std::move(*stage));
   }	
 
   int GetNumStages() const  { return mStages.size(); }
@@ -125,9 +296,118 @@ private:
 
 
 typedef std::map< StringRef, QuakeShader *> QuakeShaderMap;
-typedef std::map< StringRef, bool > QuakeShaderFileMap;
 
-class QuakeShaderFactory : public ArgList
+class Fmap;
+class ShaderCache;
+class ShaderCacheScript;
+class ShaderFileStamp;
+
+// where a not yet parsed shader is: the line with its name in one of the
+// indexed scripts, or its record in the shader cache.
+class ShaderLocation
+{
+public:
+  int    mScript; // index into mScripts, -1 for a cache record
+  size_t mOffset; // of the line, or the record
+};
+
+typedef std::map< StringRef, ShaderLocation > ShaderLocationMap;
+
+// the arguments of one line of a shader script, pointing into the script
+// text.  A "//" ends the line, double quotes group an argument.
+#define SHADER_MAX_ARGS 64
+
+class ShaderLine
+{
+public:
+  ShaderLine(void) { mCount = 0; };
+
+  int size(void) const { return mCount; };
+
+  // empty past the last argument
+  std::string_view operator[](int i) const
+  {
+    return i < mCount ? mArgs[i] : std::string_view();
+  };
+
+  void Push(const std::string_view &arg)
+  {
+    if ( mCount < SHADER_MAX_ARGS ) mArgs[mCount++] = arg;
+  };
+
+  int              mCount;
+  std::string_view mArgs[SHADER_MAX_ARGS];
+};
+
+// splits shader script text into lines of arguments without copying it.
+class ShaderTokenizer
+{
+public:
+  ShaderTokenizer(const char *data,size_t len,size_t pos=0)
+  {
+    mData = data;
+    mLen = data ? len : 0;
+    mPos = pos;
+    mLineStart = pos;
+  };
+
+  // the next line with any arguments, false at the end of the text.  Only
+  // the first maxArgs arguments are split off.
+  bool NextLine(ShaderLine &line,int maxArgs=SHADER_MAX_ARGS);
+
+  // offset of the line NextLine returned last
+  size_t GetLineStart(void) const { return mLineStart; };
+
+private:
+  const char *mData;
+  size_t      mLen;
+  size_t      mPos;
+  size_t      mLineStart;
+};
+
+// the name of a shader in a script and the offset of its line
+class ShaderName
+{
+public:
+  std::string_view mName;
+  size_t           mOffset;
+};
+
+typedef std::vector< ShaderName > ShaderNameVector;
+
+// the state of parsing shader script text, line by line.  Finished
+// shaders go into 'shaders', unless one of that name is there already.
+class ShaderParser
+{
+public:
+  ShaderParser(QuakeShaderMap &shaders)
+    : mShaders(shaders)
+  {
+    mBraceCount = 0;
+    mCurrent = 0;
+    mCurrentStage = 0;
+  };
+
+  ~ShaderParser(void) // drops a shader that was not finished
+  {
+    delete mCurrent;
+    delete mCurrentStage;
+  };
+
+  // one line of a shader script
+  void Process(const ShaderLine &args);
+
+  int  GetBraceCount(void) const { return mBraceCount; };
+  bool InShader(void) const { return mCurrent != 0; };
+
+private:
+  QuakeShaderMap &mShaders;
+  int          mBraceCount;
+  QuakeShader *mCurrent;
+  ShaderStage *mCurrentStage;
+};
+
+class QuakeShaderFactory
 {
 public:
 	// where shader files are stored 
@@ -137,13 +417,12 @@ public:
   QuakeShaderFactory(void);
   ~QuakeShaderFactory(void);
 
+  // a shader is parsed the first time it is asked for.
   QuakeShader * Locate(const String &str);
   QuakeShader * Locate(const StringRef &str);
 
-  bool ShaderFileLoaded(const StringRef &str);
-
-
-  // add a q3 shader file to add all shaders in file to shader list 
+  // add the shaders of a q3 shader file in scripts/ to the index.  A
+  // shader already in the index keeps its first definition.
   bool AddShader(const StringRef &sname);
 
 
@@ -162,26 +441,54 @@ public:
     gSingleton = 0;
   }
 
-  void Process(const StringVector &args);
+  // threads the scripts are indexed on, 0 means one per hardware thread.
+  // Call before the factory is first used.
+  static void SetJobs(int jobs) { gJobs = jobs; };
+
+  // the shader scripts present in scripts/ as text.  The scripts read are
+  // recorded as dependencies, but a script added or removed changes which
+  // ones are read, so --incremental keys the mesh on this as well.
+  static String GetScriptSignature(void);
+
+  // keep the parsed shaders in this file and read them from there as
+  // long as their scripts do not change.  Call before the factory is
+  // first used.
+  static void SetCache(const char *fname) { gCacheName = fname; };
 
   /// get stripped down version of the name
   bool GetName(const String& str,char *stripped);
 
 private:
+  // the shader names of a script, safe to run for several scripts at once.
+  static void ScanScript(const Fmap &script,ShaderNameVector &names);
 
-  int          mBraceCount;
-
-  QuakeShader *mCurrent;
-  ShaderStage *mCurrentStage;
+  // add the names a script was scanned for to the index, in file order.
+  // Takes over the script, NULL if it could not be read.
+  bool AddScript(const char *sname,Fmap *script,const ShaderNameVector &names);
+  bool AddCachedScript(const char *sname,const ShaderCacheScript &script);
+  void AddLocation(const StringRef &ref,int script,size_t offset);
 
-  void ShaderString(const char *str);
+  // write a new cache if any script is not in the current one, the
+  // entries of 'cached' then point into the new cache.
+  void UpdateCache(const StringVector &order,
+                   const std::vector< Fmap * > &maps,
+                   const std::vector< ShaderNameVector > &names,
+                   std::vector< const ShaderCacheScript * > &cached,
+                   const std::vector< ShaderFileStamp > &stamps);
 
+  // the shader 'name' from the text at offset, NULL if it does not parse.
+  static QuakeShader * ParseText(const Fmap &script,size_t offset,const StringRef &name);
 
-  QuakeShaderMap mShaders; // all shaders available.
+  QuakeShaderMap mShaders; // all shaders parsed so far.
 
-  QuakeShaderFileMap mShaderFiles; // all shader files loades 
+  ShaderLocationMap   mLocations; // every shader indexed, parsed or not
+  StringVector        mScriptNames; // indexed scripts, their data in mScripts
+  std::vector< Fmap * > mScripts;
+  ShaderCache        *mCache; // NULL without a cache file
 
   static QuakeShaderFactory *gSingleton; // global instance of data
+  static int gJobs;
+  static String gCacheName;
 };
 
 #endif
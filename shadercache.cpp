@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+//############################################################################
+//##                                                                        ##
+//##  SHADERCACHE.CPP                                                       ##
+//##                                                                        ##
+//##  Keeps the parsed shaders of every script in a binary file, so later   ##
+//##  runs read them from there instead of parsing the script text again.   ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include "shadercache.h"
+#include "q3shader.h"
+#include "fload.h"
+#include "manifest.h"
+
+#define SHADER_CACHE_BOM 0x01020304u
+
+// appends the numbers and strings of the cache format
+class CacheOut
+{
+public:
+  CacheOut(UCharVector &buf) : mBuf(buf) { };
+
+  void Bytes(const void *data,size_t len)
+  {
+    const unsigned char *b = (const unsigned char *)data;
+    mBuf.insert(mBuf.end(),b,b+len);
+  };
+
+  void U8(unsigned char v)       { mBuf.push_back(v); };
+  void U32(unsigned int v)       { Bytes(&v,sizeof(v)); };
+  void U64(unsigned long long v) { Bytes(&v,sizeof(v)); };
+  void F32(float v)              { Bytes(&v,sizeof(v)); };
+
+  void Str(const std::string_view &s)
+  {
+    U32((unsigned int)s.size());
+    Bytes(s.data(),s.size());
+  };
+
+  void Str(const String &s)    { Str(std::string_view(s)); };
+  void Str(const StringRef &s) { Str(std::string_view(s.Get())); };
+
+private:
+  UCharVector &mBuf;
+};
+
+// reads them back, every read checked against the end.  Once a read
+// fails all later ones do and Ok says false.
+class CacheIn
+{
+public:
+  CacheIn(const unsigned char *data,size_t len)
+  {
+    mData = data;
+    mLen = len;
+    mPos = 0;
+    mOk = true;
+  };
+
+  bool Ok(void) const { return mOk; };
+  size_t GetPos(void) const { return mPos; };
+
+  bool Bytes(void *dest,size_t len)
+  {
+    if ( !mOk || len > mLen-mPos )
+    {
+      mOk = false;
+      memset(dest,0,len);
+      return false;
+    }
+    memcpy(dest,mData+mPos,len);
+    mPos += len;
+    return true;
+  };
+
+  unsigned char U8(void)       { unsigned char v; Bytes(&v,sizeof(v)); return v; };
+  unsigned int U32(void)       { unsigned int v; Bytes(&v,sizeof(v)); return v; };
+  unsigned long long U64(void) { unsigned long long v; Bytes(&v,sizeof(v)); return v; };
+  float F32(void)              { float v; Bytes(&v,sizeof(v)); return v; };
+
+  std::string_view Str(void)
+  {
+    unsigned int len = U32();
+    if ( !mOk || len > mLen-mPos )
+    {
+      mOk = false;
+      return std::string_view();
+    }
+    std::string_view s((const char *)mData+mPos,len);
+    mPos += len;
+    return s;
+  };
+
+  StringRef Ref(void)
+  {
+    std::string_view s = Str();
+    return StringDict::gStringDict().Get( String(s.data(),s.size()) );
+  };
+
+private:
+  const unsigned char *mData;
+  size_t               mLen;
+  size_t               mPos;
+  bool                 mOk;
+};
+
+static void WriteWave(CacheOut &out,const ShaderWave &wave)
+{
+  out.U8( (unsigned char)wave.mForm );
+  out.F32(wave.mBase);
+  out.F32(wave.mAmplitude);
+  out.F32(wave.mPhase);
+  out.F32(wave.mFrequency);
+}
+
+// false if the wave form is out of range.
+static bool ReadWave(CacheIn &in,ShaderWave &wave)
+{
+  wave.mForm      = (ShaderWaveForm)in.U8();
+  wave.mBase      = in.F32();
+  wave.mAmplitude = in.F32();
+  wave.mPhase     = in.F32();
+  wave.mFrequency = in.F32();
+  return wave.mForm <= SWF_NOISE;
+}
+
+static void WriteColorGen(CacheOut &out,const ShaderColorGen &gen)
+{
+  out.U8( (unsigned char)gen.mSource );
+  WriteWave(out,gen.mWave);
+  for (int i=0; i<3; i++) out.F32(gen.mValue[i]);
+}
+
+// false if the source or the wave form is out of range.
+static bool ReadColorGen(CacheIn &in,ShaderColorGen &gen)
+{
+  gen.mSource = (ShaderColorSource)in.U8();
+  bool ok = ReadWave(in,gen.mWave);
+  for (int i=0; i<3; i++) gen.mValue[i] = in.F32();
+  return ok && gen.mSource <= SCS_UNKNOWN;
+}
+
+static void WriteShader(CacheOut &out,const QuakeShader &shader)
+{
+  out.Str(shader.GetName());
+  out.Str(shader.mCull);
+  out.U8( (unsigned char)shader.mCullMode );
+  out.U8( (unsigned char)shader.mSort );
+  out.U8( (shader.mTrans ? 1 : 0) | (shader.mNoLightMap ? 2 : 0) | (shader.mSky ? 4 : 0) );
+  out.U32( (unsigned int)shader.mLightMapStage );
+  out.Str(shader.skyBox);
+
+  const StringRefVector &textures = shader.GetTextures();
+  out.U32( (unsigned int)textures.size() );
+  for (size_t i=0; i<textures.size(); i++) out.Str(textures[i]);
+
+  out.U32( (unsigned int)shader.GetNumStages() );
+  for (int i=0; i<shader.GetNumStages(); i++)
+  {
+    const ShaderStage &stage = shader.GetStage(i);
+    out.Str(stage.map);
+    out.U32( (unsigned int)stage.animMap.size() );
+    for (size_t j=0; j<stage.animMap.size(); j++) out.Str(stage.animMap[j]);
+    out.F32(stage.animMapFrequency);
+    out.Str(stage.blendFuncSrc);
+    out.Str(stage.blendFuncDst);
+    out.Str(stage.alphaFunc);
+    out.Str(stage.depthFunc);
+    out.U8( (unsigned char)stage.blendSrc );
+    out.U8( (unsigned char)stage.blendDst );
+    out.Str(stage.tcmodOk);
+    out.Str(stage.tcmod);
+    out.U32( (unsigned int)stage.tcMods.size() );
+    for (size_t j=0; j<stage.tcMods.size(); j++)
+    {
+      const ShaderTcMod &mod = stage.tcMods[j];
+      out.U8( (unsigned char)mod.mType );
+      for (int k=0; k<6; k++) out.F32(mod.mParams[k]);
+      WriteWave(out,mod.mWave);
+    }
+    out.U8( (unsigned char)stage.tcGen );
+    for (int k=0; k<6; k++) out.F32(stage.tcGenVector[k]);
+    out.Str(stage.rgbGen);
+    out.Str(stage.alphaGen);
+    WriteColorGen(out,stage.rgb);
+    WriteColorGen(out,stage.alpha);
+    out.U8( (stage.isLightMap ? 1 : 0) | (stage.isAnimMap ? 2 : 0) | (stage.clamp ? 4 : 0) );
+    out.Str(stage.textureBlendMode);
+    out.U8( (unsigned char)stage.blendMode );
+  }
+}
+
+static QuakeShader * ReadShader(CacheIn &in)
+{
+  QuakeShader *shader = new QuakeShader( in.Ref() );
+  shader->mCull = in.Ref();
+  shader->mCullMode = (ShaderCull)in.U8();
+  shader->mSort = (ShaderSort)in.U8();
+  // a record with an enum out of range is broken, like a short one.
+  bool ok = shader->mCullMode <= SC_NONE && shader->mSort <= SS_NEAREST;
+  unsigned char flags = in.U8();
+  shader->mTrans      = (flags & 1) != 0;
+  shader->mNoLightMap = (flags & 2) != 0;
+  shader->mSky        = (flags & 4) != 0;
+  shader->mLightMapStage = (int)in.U32();
+  std::string_view sky = in.Str();
+  shader->skyBox.assign(sky.data(),sky.size());
+
+  unsigned int textures = in.U32();
+  for (unsigned int i=0; i<textures && in.Ok(); i++) shader->AddTexture( in.Ref() );
+
+  unsigned int stages = in.U32();
+  for (unsigned int i=0; i<stages && in.Ok(); i++)
+  {
+    ShaderStage stage;
+    stage.map = in.Ref();
+    unsigned int frames = in.U32();
+    for (unsigned int j=0; j<frames && in.Ok(); j++) stage.animMap.push_back( in.Ref() );
+    stage.animMapFrequency = in.F32();
+    stage.blendFuncSrc = in.Ref();
+    stage.blendFuncDst = in.Ref();
+    stage.alphaFunc = in.Ref();
+    stage.depthFunc = in.Ref();
+    stage.blendSrc = (ShaderBlendFactor)in.U8();
+    stage.blendDst = (ShaderBlendFactor)in.U8();
+    if ( stage.blendSrc > SBF_UNKNOWN || stage.blendDst > SBF_UNKNOWN ) ok = false;
+    std::string_view s = in.Str();
+    stage.tcmodOk.assign(s.data(),s.size());
+    s = in.Str();
+    stage.tcmod.assign(s.data(),s.size());
+    unsigned int mods = in.U32();
+    for (unsigned int j=0; j<mods && in.Ok(); j++)
+    {
+      ShaderTcMod mod;
+      mod.mType = (ShaderTcModType)in.U8();
+      if ( mod.mType > STC_ENTITYTRANSLATE ) ok = false;
+      for (int k=0; k<6; k++) mod.mParams[k] = in.F32();
+      if ( !ReadWave(in,mod.mWave) ) ok = false;
+      stage.tcMods.push_back(mod);
+    }
+    stage.tcGen = (ShaderTcGen)in.U8();
+    if ( stage.tcGen > STG_VECTOR ) ok = false;
+    for (int k=0; k<6; k++) stage.tcGenVector[k] = in.F32();
+    s = in.Str();
+    stage.rgbGen.assign(s.data(),s.size());
+    s = in.Str();
+    stage.alphaGen.assign(s.data(),s.size());
+    if ( !ReadColorGen(in,stage.rgb) ) ok = false;
+    if ( !ReadColorGen(in,stage.alpha) ) ok = false;
+    flags = in.U8();
+    stage.isLightMap = (flags & 1) != 0;
+    stage.isAnimMap  = (flags & 2) != 0;
+    stage.clamp      = (flags & 4) != 0;
+    stage.textureBlendMode = in.Ref();
+    stage.blendMode = (ShaderTextureMode)in.U8();
+    if ( stage.blendMode > STM_BLENDTEXTUREALPHA ) ok = false;
+    shader->AddStage(&stage);
+  }
+
+  if ( !in.Ok() || !ok )
+  {
+    delete shader;
+    return 0;
+  }
+  return shader;
+}
+
+bool ShaderFileStamp::Stat(const char *fname)
+{
+  struct stat st;
+  if ( stat(fname,&st) != 0 ) return false;
+  mSize = (unsigned long long)st.st_size;
+  mTime = (unsigned long long)st.st_mtime;
+#ifdef __linux__
+  mTime = mTime*1000000000ull + (unsigned long long)st.st_mtim.tv_nsec;
+#endif
+  mHash = 0;
+  return true;
+}
+
+ShaderCache::ShaderCache(void)
+{
+  mFile = 0;
+  Clear();
+}
+
+ShaderCache::~ShaderCache(void)
+{
+  delete mFile;
+}
+
+void ShaderCache::Clear(void)
+{
+  delete mFile;
+  mFile = 0;
+  mBuffer.clear();
+  mData = 0;
+  mLen = 0;
+  mRecords = 0;
+  mScripts.clear();
+}
+
+bool ShaderCache::Load(const char *fname)
+{
+  Clear();
+  mFile = new Fmap(fname);
+  mData = (const unsigned char *)mFile->GetData();
+  mLen = mFile->GetLen();
+  if ( !mData ) // no cache yet
+  {
+    Clear();
+    return false;
+  }
+  if ( !Parse() )
+  {
+    printf("Ignoring %s, damaged or not a shader cache of this version.\n",fname);
+    Clear();
+    return false;
+  }
+  return true;
+}
+
+bool ShaderCache::Load(UCharVector &data)
+{
+  Clear();
+  mBuffer.swap(data);
+  mData = mBuffer.empty() ? 0 : &mBuffer[0];
+  mLen = mBuffer.size();
+  if ( !Parse() )
+  {
+    Clear();
+    return false;
+  }
+  return true;
+}
+
+bool ShaderCache::Parse(void)
+{
+  CacheIn in(mData,mLen);
+  char magic[8];
+  in.Bytes(magic,sizeof(magic));
+  if ( memcmp(magic,"Q3SHCACH",8) != 0 ) return false;
+  if ( in.U32() != SHADER_CACHE_VERSION ) return false;
+  if ( in.U32() != SHADER_CACHE_BOM ) return false;
+
+  unsigned int count = in.U32();
+  for (unsigned int i=0; i<count && in.Ok(); i++)
+  {
+    std::string_view path = in.Str();
+    ShaderCacheScript &script = mScripts[ String(path.data(),path.size()) ];
+    script.mStamp.mSize = in.U64();
+    script.mStamp.mTime = in.U64();
+    script.mStamp.mHash = in.U64();
+    unsigned int names = in.U32();
+    for (unsigned int j=0; j<names && in.Ok(); j++)
+    {
+      ShaderCacheName name;
+      name.mName = in.Str();
+      name.mRecord = in.U32();
+      script.mNames.push_back(name);
+    }
+  }
+
+  unsigned int bytes = in.U32();
+  unsigned long long hash = in.U64();
+  if ( !in.Ok() || bytes != mLen-in.GetPos() ) return false;
+  mRecords = in.GetPos();
+  return hash == HashBytes(mData+mRecords,bytes);
+}
+
+const ShaderCacheScript * ShaderCache::Find(const String &path,ShaderFileStamp &stamp,Fmap *&text) const
+{
+  text = 0;
+  if ( !stamp.Stat(path.c_str()) ) return 0;
+  const ShaderCacheScript *script = Get(path);
+  if ( !script || script->mStamp.mSize != stamp.mSize ) return 0;
+
+  if ( script->mStamp.mTime == stamp.mTime )
+  {
+    stamp.mHash = script->mStamp.mHash;
+    return script;
+  }
+
+  // touched, but maybe not changed
+  text = new Fmap(path);
+  if ( text->GetData() )
+    stamp.mHash = HashBytes((const unsigned char *)text->GetData(),text->GetLen());
+  else
+    stamp.mHash = HashBytes(0,0);
+  return stamp.mHash == script->mStamp.mHash ? script : 0;
+}
+
+const ShaderCacheScript * ShaderCache::Get(const String &path) const
+{
+  std::map< String, ShaderCacheScript >::const_iterator found = mScripts.find(path);
+  return found == mScripts.end() ? 0 : &(*found).second;
+}
+
+bool ShaderCache::GetRecord(unsigned int record,const unsigned char *&data,size_t &len) const
+{
+  if ( record == SHADER_CACHE_NONE || mRecords+record > mLen ) return false;
+  CacheIn in(mData+mRecords+record,mLen-mRecords-record);
+  len = in.U32();
+  if ( !in.Ok() || len > mLen-mRecords-record-in.GetPos() ) return false;
+  data = mData+mRecords+record+in.GetPos();
+  return true;
+}
+
+QuakeShader * ShaderCache::ReadShader(unsigned int record) const
+{
+  const unsigned char *data;
+  size_t len;
+  if ( !GetRecord(record,data,len) ) return 0;
+  CacheIn in(data,len);
+  return ::ReadShader(in);
+}
+
+void ShaderCacheWriter::AddScript(const String &path,const ShaderFileStamp &stamp)
+{
+  Script script;
+  script.mPath = path;
+  script.mStamp = stamp;
+  mScripts.push_back(script);
+}
+
+void ShaderCacheWriter::AddShader(const std::string_view &name,const QuakeShader *shader)
+{
+  if ( !shader )
+  {
+    AddRecord(name,0,0);
+    return;
+  }
+  UCharVector record;
+  CacheOut out(record);
+  WriteShader(out,*shader);
+  AddRecord(name,record.empty() ? 0 : &record[0],record.size());
+}
+
+void ShaderCacheWriter::AddRecord(const std::string_view &name,const unsigned char *record,size_t len)
+{
+  assert( !mScripts.empty() );
+  Script &script = mScripts.back();
+  script.mNames.push_back( String(name.data(),name.size()) );
+  if ( !record )
+  {
+    script.mRecords.push_back(SHADER_CACHE_NONE);
+    return;
+  }
+  script.mRecords.push_back( (unsigned int)mRecords.size() );
+  CacheOut out(mRecords);
+  out.U32( (unsigned int)len );
+  out.Bytes(record,len);
+}
+
+void ShaderCacheWriter::Get(UCharVector &data) const
+{
+  data.clear();
+  CacheOut out(data);
+  out.Bytes("Q3SHCACH",8);
+  out.U32(SHADER_CACHE_VERSION);
+  out.U32(SHADER_CACHE_BOM);
+  out.U32( (unsigned int)mScripts.size() );
+  for (size_t i=0; i<mScripts.size(); i++)
+  {
+    const Script &script = mScripts[i];
+    out.Str(script.mPath);
+    out.U64(script.mStamp.mSize);
+    out.U64(script.mStamp.mTime);
+    out.U64(script.mStamp.mHash);
+    out.U32( (unsigned int)script.mNames.size() );
+    for (size_t j=0; j<script.mNames.size(); j++)
+    {
+      out.Str(script.mNames[j]);
+      out.U32(script.mRecords[j]);
+    }
+  }
+  out.U32( (unsigned int)mRecords.size() );
+  out.U64( HashBytes(mRecords.empty() ? 0 : &mRecords[0],mRecords.size()) );
+  out.Bytes(mRecords.empty() ? 0 : &mRecords[0],mRecords.size());
+}
+
+bool ShaderCache::Save(const char *fname) const
+{
+  if ( !mData ) return false;
+
+  // a new file renamed over the old one, so a run reading the old cache
+  // at the same time never sees half of the new one.  Each process writes
+  // a temp file of its own, so runs saving at the same time stay apart.
+  char pid[32];
+  sprintf(pid,".%d.tmp",(int)getpid());
+  String temp = String(fname) + pid;
+  FILE *fph = fopen(temp.c_str(),"wb");
+  if ( !fph )
+  {
+    printf("Can't write shader cache %s\n",fname);
+    return false;
+  }
+  bool ok = fwrite(mData,mLen,1,fph) == 1;
+  ok = fclose(fph) == 0 && ok;
+#ifdef _WIN32
+  remove(fname); // rename does not replace files there
+#endif
+  if ( !ok || rename(temp.c_str(),fname) != 0 )
+  {
+    printf("Can't write shader cache %s\n",fname);
+    remove(temp.c_str());
+    return false;
+  }
+  return true;
+}
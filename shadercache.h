@@ -0,0 +1,146 @@
+#ifndef SHADERCACHE_H
+
+#define SHADERCACHE_H
+
+//############################################################################
+//##                                                                        ##
+//##  SHADERCACHE.H                                                         ##
+//##                                                                        ##
+//##  Keeps the parsed shaders of every script in a binary file, so later   ##
+//##  runs read them from there instead of parsing the script text again.   ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include <string_view>
+#include "stl.h"
+
+class Fmap;
+class QuakeShader;
+
+// cache file, numbers in the byte order of the machine that wrote it:
+//   "Q3SHCACH" <u32 version> <u32 byte order mark> <u32 script count>
+//   per script: <str path> <u64 size> <u64 time> <u64 hash> <u32 names>
+//               per name: <str name> <u32 record>
+//   <u32 record bytes> <u64 record hash> records, each <u32 length> and
+//   a shader
+// where <str> is <u32 length> and the text and the hash is HashBytes of
+// the records.  A record of SHADER_CACHE_NONE is a shader whose text did
+// not parse.
+#define SHADER_CACHE_VERSION 3
+#define SHADER_CACHE_NONE    0xFFFFFFFFu
+
+// what a script was when it was cached.
+class ShaderFileStamp
+{
+public:
+  ShaderFileStamp(void)
+  {
+    mSize = 0;
+    mTime = 0;
+    mHash = 0;
+  };
+
+  // size and modification time of fname, false if it is not there.
+  bool Stat(const char *fname);
+
+  unsigned long long mSize;
+  unsigned long long mTime;
+  unsigned long long mHash; // of the content, 0 while not known
+};
+
+class ShaderCacheName
+{
+public:
+  std::string_view mName;   // points into the cache
+  unsigned int     mRecord;
+};
+
+class ShaderCacheScript
+{
+public:
+  ShaderFileStamp                mStamp;
+  std::vector< ShaderCacheName > mNames; // in script order, repeats too
+};
+
+class ShaderCache
+{
+public:
+  ShaderCache(void);
+  ~ShaderCache(void);
+
+  // map a cache file.  False, leaving the cache empty, if there is none or
+  // it is broken or of another version.
+  bool Load(const char *fname);
+
+  // take over a cache built in memory by ShaderCacheWriter::Get.
+  bool Load(UCharVector &data);
+
+  // write the cache to fname.
+  bool Save(const char *fname) const;
+
+  // the cached entry of a script if the file did not change: the same
+  // size and time, else the same content.  'stamp' gets what the file is
+  // now.  If the content had to be read it is left mapped in 'text' for
+  // the caller, who deletes it.
+  const ShaderCacheScript * Find(const String &path,ShaderFileStamp &stamp,Fmap *&text) const;
+
+  // the entry of a script without looking at the file, NULL if none.
+  const ShaderCacheScript * Get(const String &path) const;
+
+  int GetScriptCount(void) const { return (int)mScripts.size(); };
+
+  // a new shader from a record, NULL if the record is broken.
+  QuakeShader * ReadShader(unsigned int record) const;
+
+  // the bytes of a record, to copy into a new cache.
+  bool GetRecord(unsigned int record,const unsigned char *&data,size_t &len) const;
+
+private:
+  ShaderCache(const ShaderCache &copy);            // not copyable
+  ShaderCache& operator=(const ShaderCache &copy);
+
+  void Clear(void);
+  bool Parse(void);
+
+  Fmap                *mFile;
+  UCharVector          mBuffer;
+  const unsigned char *mData;
+  size_t               mLen;
+  size_t               mRecords; // where the records start
+  std::map< String, ShaderCacheScript > mScripts;
+};
+
+// builds a new cache, script by script in index order.
+class ShaderCacheWriter
+{
+public:
+  void AddScript(const String &path,const ShaderFileStamp &stamp);
+
+  // a shader of the script added last, NULL if its text did not parse.
+  void AddShader(const std::string_view &name,const QuakeShader *shader);
+
+  // a shader of the script added last, as a record of an older cache.
+  void AddRecord(const std::string_view &name,const unsigned char *record,size_t len);
+
+  // the whole cache
+  void Get(UCharVector &data) const;
+
+private:
+  class Script
+  {
+  public:
+    String                      mPath;
+    ShaderFileStamp             mStamp;
+    StringVector                mNames;
+    std::vector< unsigned int > mRecords;
+  };
+
+  std::vector< Script > mScripts;
+  UCharVector           mRecords;
+};
+
+#endif
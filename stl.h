@@ -41,6 +41,9 @@ typedef std::vector< int > IntVector;
 typedef std::vector< char > CharVector;
 typedef std::vector< short > ShortVector;
 typedef std::vector< unsigned short > UShortVector;
+typedef std::vector< unsigned int > UIntVector;
+typedef std::vector< unsigned char > UCharVector;
+typedef std::vector< float > FloatVector;
 typedef std::queue< int > IntQueue;
 
 
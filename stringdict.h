@@ -129,6 +129,18 @@ private:
 
 };
 
+// Orders StringRefs by their text rather than by where the string table
+// happened to allocate them, for containers whose iteration order ends up
+// in an output file.
+class StringRefLess
+{
+public:
+  bool operator()(const StringRef &a,const StringRef &b) const
+  {
+    return strcmp(a.Get(),b.Get()) < 0;
+  };
+};
+
 typedef std::vector< StringRef > StringRefVector;
 typedef std::vector< StringRefVector > StringRefVectorVector;
 typedef std::set< StringRef > StringRefSet;
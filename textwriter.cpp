@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <charconv>
+
+//############################################################################
+//##                                                                        ##
+//##  TEXTWRITER.CPP                                                        ##
+//##                                                                        ##
+//##  Buffered text output for the VRML writers, with fast integer and     ##
+//##  float formatting.                                                     ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include "textwriter.h"
+
+void TextWriter::Print(const char *fmt,...)
+{
+  va_list ap;
+  va_start(ap,fmt);
+  int len = vsnprintf(mBuf.data()+mLen,mBuf.size()-mLen,fmt,ap);
+  va_end(ap);
+  if ( len < 0 ) return;
+
+  if ( mLen+len >= mBuf.size() ) // did not fit, make room and print again
+  {
+    Reserve(len+1);
+    va_start(ap,fmt);
+    vsnprintf(mBuf.data()+mLen,mBuf.size()-mLen,fmt,ap);
+    va_end(ap);
+  }
+  mLen += len;
+}
+
+void TextWriter::Flush(void)
+{
+  if ( mFph && mLen )
+  {
+    fwrite(&mBuf[0],mLen,1,mFph);
+    mLen = 0;
+  }
+}
+
+void TextWriter::Grow(size_t len)
+{
+  Flush();
+  if ( mLen+len > mBuf.size() )
+  {
+    size_t size = mBuf.size()*2;
+    while ( size < mLen+len ) size *= 2;
+    mBuf.resize(size);
+  }
+}
+
+const TextWriter::FloatFormat & TextWriter::GetFormat(const char *fmt)
+{
+  for (unsigned int i=0; i<mFormats.size(); i++)
+  {
+    if ( mFormats[i].mFmt == fmt ) return mFormats[i];
+  }
+
+  FloatFormat f;
+  f.mFmt = fmt;
+  String literal;
+  const char *scan = fmt;
+  while ( *scan )
+  {
+    if ( *scan != '%' )
+    {
+      literal += *scan++;
+      continue;
+    }
+    if ( scan[1] == '%' )
+    {
+      literal += '%';
+      scan+=2;
+      continue;
+    }
+
+    // %[flags][width][.precision]conversion
+    const char *start = scan++;
+    bool simple = true;
+    while ( *scan && strchr("-+ #0",*scan) ) { scan++; simple = false; }
+    while ( *scan >= '0' && *scan <= '9' ) { scan++; simple = false; }
+    int precision = 6;
+    if ( *scan == '.' )
+    {
+      precision = atoi(++scan);
+      while ( *scan >= '0' && *scan <= '9' ) scan++;
+    }
+    char conversion = *scan;
+    if ( conversion ) scan++;
+    if ( !strchr("gfe",conversion) ) simple = false;
+
+    f.mLiterals.push_back(literal);
+    f.mSpecs.push_back(String(start,scan-start));
+    f.mConversion += simple ? conversion : ' ';
+    f.mPrecision.push_back(precision);
+    literal.clear();
+  }
+  f.mTail = literal;
+
+  mFormats.push_back(f);
+  return mFormats.back();
+}
+
+void TextWriter::PutFloats(const char *fmt,const float *v)
+{
+  const FloatFormat &f = GetFormat(fmt);
+
+  for (unsigned int i=0; i<f.mSpecs.size(); i++)
+  {
+    Put(f.mLiterals[i].c_str(),f.mLiterals[i].size());
+
+    // room for the 39 digits of FLT_MAX and the decimals
+    int decimals = mFloatMode >= 0 ? mFloatMode : f.mPrecision[i];
+    size_t room = 64 + (decimals > 0 ? decimals : 0);
+    Reserve(room);
+
+    // std::to_chars with a precision gives the same text as printf.
+    char *dest = &mBuf[mLen];
+    char *end = dest+room;
+    std::to_chars_result r;
+    if ( mFloatMode == FLOAT_SHORTEST )
+      r = std::to_chars(dest,end,v[i]);
+    else if ( mFloatMode >= 0 )
+      r = std::to_chars(dest,end,(double)v[i],std::chars_format::fixed,mFloatMode);
+    else if ( f.mConversion[i] == 'g' )
+      r = std::to_chars(dest,end,(double)v[i],std::chars_format::general,f.mPrecision[i]);
+    else if ( f.mConversion[i] == 'f' )
+      r = std::to_chars(dest,end,(double)v[i],std::chars_format::fixed,f.mPrecision[i]);
+    else if ( f.mConversion[i] == 'e' )
+      r = std::to_chars(dest,end,(double)v[i],std::chars_format::scientific,f.mPrecision[i]);
+    else
+    {
+      int len = snprintf(dest,room,f.mSpecs[i].c_str(),(double)v[i]);
+      if ( len >= (int)room ) len = room-1;
+      mLen += len > 0 ? len : 0;
+      continue;
+    }
+    if ( r.ec == std::errc() ) mLen = r.ptr-&mBuf[0];
+  }
+
+  Put(f.mTail.c_str(),f.mTail.size());
+}
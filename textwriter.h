@@ -0,0 +1,145 @@
+#ifndef TEXTWRITER_H
+
+#define TEXTWRITER_H
+
+//############################################################################
+//##                                                                        ##
+//##  TEXTWRITER.H                                                          ##
+//##                                                                        ##
+//##  Buffered text output for the VRML writers, with fast integer and     ##
+//##  float formatting.                                                     ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include <stdio.h>
+#include <string.h>
+#include "stl.h"
+
+// how PutFloats prints the floats of its format, 0 or more means a fixed
+// number of decimals.
+#define FLOAT_FORMAT   -1 // as the printf format says
+#define FLOAT_SHORTEST -2 // shortest text that reads back as the same float
+
+#define TEXTWRITER_BUFFER (256*1024)
+
+class TextWriter
+{
+public:
+  // fph NULL keeps all text in memory until it is taken with GetText,
+  // the buffer then starts at 'size' and grows as needed.
+  TextWriter(FILE *fph,int floatMode=FLOAT_FORMAT,size_t size=TEXTWRITER_BUFFER)
+  {
+    mFph = fph;
+    mFloatMode = floatMode;
+    mLen = 0;
+    mBuf.resize(size);
+  };
+
+  ~TextWriter(void) { Flush(); };
+
+  // printf into the buffer
+  void Print(const char *fmt,...)
+#ifdef __GNUC__
+    __attribute__((format(printf,2,3)))
+#endif
+    ;
+
+  void Put(const char *str) { Put(str,strlen(str)); };
+
+  void Put(const char *str,size_t len)
+  {
+    Reserve(len);
+    memcpy(&mBuf[mLen],str,len);
+    mLen += len;
+  };
+
+  void Put(char c)
+  {
+    Reserve(1);
+    mBuf[mLen++] = c;
+  };
+
+  // same text as %d
+  void PutInt(int v)
+  {
+    Reserve(12);
+    char tmp[12];
+    unsigned int u = v < 0 ? 0u-(unsigned int)v : (unsigned int)v;
+    int n = 0;
+    do { tmp[n++] = (char)('0' + u%10); u /= 10; } while ( u );
+    if ( v < 0 ) mBuf[mLen++] = '-';
+    while ( n ) mBuf[mLen++] = tmp[--n];
+  };
+
+  // "a<sep>b<sep>c", the same text as printing them with %d
+  void PutInts(int a,int b,int c,const char *sep)
+  {
+    PutInt(a);
+    Put(sep);
+    PutInt(b);
+    Put(sep);
+    PutInt(c);
+  };
+
+  // print v[0], v[1] .. with a printf format that takes one float per
+  // conversion, like VFormatOptions::VFORMAT.  The float mode can replace
+  // how the conversions are done, the text around them stays.
+  void PutFloats(const char *fmt,const float *v);
+
+  void PutFloats(const char *fmt,float a,float b)
+  {
+    float v[2] = { a, b };
+    PutFloats(fmt,v);
+  };
+
+  void PutFloats(const char *fmt,float a,float b,float c)
+  {
+    float v[3] = { a, b, c };
+    PutFloats(fmt,v);
+  };
+
+  // drop the text of a memory writer
+  void Clear(void) { mLen = 0; };
+
+  // write out the buffered text, a no-op for memory writers.
+  void Flush(void);
+
+  // the text of a memory writer
+  const char * GetText(void) const { return mLen ? &mBuf[0] : ""; };
+  size_t GetLength(void) const { return mLen; };
+
+private:
+  void Reserve(size_t len)
+  {
+    if ( mLen+len > mBuf.size() ) Grow(len);
+  };
+
+  void Grow(size_t len);
+
+  // a printf format split at its conversions.
+  class FloatFormat
+  {
+  public:
+    const char  *mFmt;        // the format this was parsed from
+    StringVector mLiterals;   // text in front of each conversion
+    StringVector mSpecs;      // each conversion as written, for snprintf
+    String       mConversion; // 'g', 'f' or 'e' per conversion, ' ' if it
+                              // has flags or a width
+    IntVector    mPrecision;
+    String       mTail;       // text after the last conversion
+  };
+
+  const FloatFormat & GetFormat(const char *fmt);
+
+  FILE   *mFph;
+  int     mFloatMode;
+  CharVector mBuf;
+  size_t  mLen;
+  std::vector< FloatFormat > mFormats; // the few formats in use
+};
+
+#endif
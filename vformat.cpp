@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <assert.h>
 
 
@@ -27,20 +28,79 @@
 
 
 #include "vformat.h"
+#include "parallel.h"
+#include "manifest.h"
+#include "pngwrite.h"
+#include "fileindex.h"
 #include "stb_image.h"
 #include "stb_image_write.h"
 
-// does the file exists ?
+// does the file exists ? answered from the directory listing
 bool ExistsFile(const char *path) 
 {
-	FILE *f = fopen(path,"rb");
-	if (!f) 
-		return false;
-	fclose(f);
-	return true;
+	return FileIndex::gFileIndex().Exists(path);
 
 }
 
+String VFormatOptions::GetSignature(void) const
+{
+	char scratch[1024];
+	snprintf(scratch,sizeof(scratch),
+		"vrml2=%d glb=%d verbose=%d multi=%d bsp=%d png=%d lighting=%d mat=%d "
+		"effects=%d yzflip=%d notex=%d stages=%d split=%d vcache=%d simplify=%g,%g float=%d lod=%g "
+		"v=%s t=%s c=%s blend=%s stage0=%s lightmap=%s",
+		vrml2,glb,verbose,useMultiTexturing,useBsp,usePng,useLighting,useMat,
+		useEffects,yzFlip,noTextureCoordinates,maxStage,maxSectionVertices,vertexCacheSize,simplifyRatio,simplifyError,floatMode,
+		lodScreenError,VFORMAT,TFORMAT,CFORMAT,blendMode,stage0Mode,lightMapMode);
+
+	String signature = scratch;
+	for (unsigned int i=0; i<patchLods.size(); i++)
+	{
+		snprintf(scratch,sizeof(scratch)," patchlod=%g",patchLods[i]);
+		signature += scratch;
+	}
+	return signature;
+}
+
+// TGA to PNG conversions started by CheckTexture
+static JobQueue *gTextureQueue = 0;
+static int gTextureJobs = 0;
+static std::set< String > gTexturesQueued; // png files
+
+static void ConvertTexture(const String &tgaFileName,const String &pngFileName)
+{
+	int width, height, comp;
+	unsigned char *data = stbi_load(tgaFileName.c_str(), &width, &height, &comp	, 0);
+	if (!data) {
+		printf("Failed to read texture '%s'\n",tgaFileName.c_str());
+		return;
+	}
+	WritePng(pngFileName.c_str(), width, height, comp, data, width*comp, PNG_LEVEL_DEFAULT);
+	stbi_image_free(data);
+
+	Manifest *manifest = Manifest::GetActive();
+	if (manifest) manifest->Converted(tgaFileName.c_str(),pngFileName.c_str());
+}
+
+void SetTextureJobs(int jobs)
+{
+	gTextureJobs = jobs;
+}
+
+void WaitForTextures(void)
+{
+	delete gTextureQueue; // waits for the jobs
+	gTextureQueue = 0;
+}
+
+// ExistsFile for the texture lookups, the outputs depend on which of
+// the candidates are there.
+static bool ExistsTexture(const char *path)
+{
+	RecordDependency(path);
+	return ExistsFile(path);
+}
+
 // check basename for texture, and try to return jpg or png file 
 void CheckTexture(const char *baseName, String &textureFileName)
 {
@@ -52,7 +112,7 @@ void CheckTexture(const char *baseName, String &textureFileName)
 	if (!ext) {
 		textureFileName+=".jpg";
 
-		if (ExistsFile(textureFileName.c_str()))
+		if (ExistsTexture(textureFileName.c_str()))
 			return;
 	}
 
@@ -64,17 +124,26 @@ void CheckTexture(const char *baseName, String &textureFileName)
 
 	textureFileName+=".png";
 
-	if (ExistsFile(textureFileName.c_str()))
+	String tgaFileName=baseName;
+	if (ext)  // erase ext 
+		tgaFileName.erase(tgaFileName.size()-strlen(ext),strlen(ext));
+	tgaFileName+=".tga";
+
+	// already being converted
+	if (gTexturesQueued.count(textureFileName))
 		return;
 
-	// check if tga exists
-	textureFileName=baseName;
-	if (ext)  // erase ext 
-		textureFileName.erase(textureFileName.size()-strlen(ext),strlen(ext));
+	if (ExistsTexture(textureFileName.c_str())) {
+		// unless an earlier run converted it from a tga that changed since
+		Manifest *manifest = Manifest::GetActive();
+		if (!manifest || manifest->IsConversionCurrent(tgaFileName.c_str(),textureFileName.c_str()))
+			return;
+	}
 
-	textureFileName+=".tga";
+	// check if tga exists
+	textureFileName=tgaFileName;
 
-	if (ExistsFile(textureFileName.c_str())) {
+	if (ExistsTexture(textureFileName.c_str())) {
 		// convert tga to png
 		String outFileName=baseName;
 		if (ext)  // erase ext 
@@ -83,10 +152,12 @@ void CheckTexture(const char *baseName, String &textureFileName)
 		outFileName+=".png";
 
 		// bmp.TGAToPNG(textureFileName.c_str(),outFileName.c_str());
-		int width, height, comp;
-		unsigned char *data = stbi_load(textureFileName.c_str(), &width, &height, &comp	, 0);
-		stbi_write_png(outFileName.c_str(), width, height, comp, data, width*comp);
-		stbi_image_free(data);
+		// the png name is handed out right away, the file is written in
+		// the background.
+		if (!gTextureQueue) gTextureQueue = new JobQueue(gTextureJobs);
+		gTexturesQueued.insert(outFileName);
+		FileIndex::gFileIndex().Added(outFileName.c_str());
+		gTextureQueue->Add(std::bind(ConvertTexture,textureFileName,outFileName));
 
 		textureFileName = outFileName;
 		return;
@@ -100,7 +171,7 @@ void CheckTexture(const char *baseName, String &textureFileName)
 
 	textureFileName+=".jpg";
 
-	if (ExistsFile(textureFileName.c_str()))
+	if (ExistsTexture(textureFileName.c_str()))
 		return;
 
 	printf("Texture file not found:'%s'\n",baseName);
@@ -110,41 +181,6 @@ void CheckTexture(const char *baseName, String &textureFileName)
 
 
 
-LightMapVertex VertexLess::mFind;
-VertexVector * VertexLess::mList=0;
-
-bool VertexLess::operator()(int v1,int v2) const
-{
-
-  const LightMapVertex& a = Get(v1);
-  const LightMapVertex& b = Get(v2);
-
-  if ( a.GetX() < b.GetX() ) return true;
-  if ( a.GetX() > b.GetX() ) return false;
-
-  if ( a.GetY() < b.GetY() ) return true;
-  if ( a.GetY() > b.GetY() ) return false;
-
-  if ( a.GetZ() < b.GetZ() ) return true;
-  if ( a.GetZ() > b.GetZ() ) return false;
-
-  if ( a.mTexel1.x < b.mTexel1.x ) return true;
-  if ( a.mTexel1.x > b.mTexel1.x ) return false;
-
-  if ( a.mTexel1.y < b.mTexel1.y ) return true;
-  if ( a.mTexel1.y > b.mTexel1.y ) return false;
-
-  if ( a.mTexel2.x < b.mTexel2.x ) return true;
-  if ( a.mTexel2.x > b.mTexel2.x ) return false;
-
-  if ( a.mTexel2.y < b.mTexel2.y ) return true;
-  if ( a.mTexel2.y > b.mTexel2.y ) return false;
-
-
-  return false;
-};
-
-
 VertexMesh::~VertexMesh(void)
 {
   VertexSectionMap::iterator i;
@@ -156,7 +192,7 @@ VertexMesh::~VertexMesh(void)
 }
 
 
-void VertexMesh::AddTri(const StringRef &name,const LightMapVertex &v1,const LightMapVertex &v2,const LightMapVertex &v3)
+void VertexMesh::AddTri(const StringRef &name,const LightMapVertex &v1,const LightMapVertex &v2,const LightMapVertex &v3,unsigned char lods)
 {
   VertexSection *section;
 
@@ -183,7 +219,7 @@ void VertexMesh::AddTri(const StringRef &name,const LightMapVertex &v1,const Lig
 
   assert( section );
 
-  section->AddTri( v1, v2, v3 );
+  section->AddTri( v1, v2, v3, lods );
 
   mBound.MinMax( v1.mPos );
   mBound.MinMax( v2.mPos );
@@ -192,9 +228,515 @@ void VertexMesh::AddTri(const StringRef &name,const LightMapVertex &v1,const Lig
 }
 
 
+void VertexMesh::Merge(const VertexMesh &part)
+{
+  VertexSectionMap::const_iterator i;
+  for (i=part.mSections.begin(); i!=part.mSections.end(); ++i)
+  {
+    const StringRef &name = (*i).first;
+    VertexSection *section = FindSection(name);
+    if ( !section )
+    {
+      section = new VertexSection( name );
+      mSections[name] = section;
+    }
+    section->Merge( *(*i).second );
+  }
+
+  if ( part.mSections.size() )
+  {
+    mBound.MinMax( part.mBound.r1 );
+    mBound.MinMax( part.mBound.r2 );
+  }
+}
+
+VertexSection * VertexMesh::FindSection(const StringRef &name) const
+{
+  VertexSectionMap::const_iterator found;
+  found = mSections.find( name );
+  if ( found != mSections.end() ) return (*found).second;
+  return 0;
+}
+
+void VertexSection::Merge(const VertexSection &other)
+{
+  if ( other.mIndices.empty() ) return;
+
+  mBound.MinMax(other.mBound.r1);
+  mBound.MinMax(other.mBound.r2);
+
+  // the pool of 'other' is welded already and in order of first use, so
+  // looking its vertices up once each, in pool order, numbers them just
+  // as a single pass would have.  The triangles then only need a remap.
+  int vcount = other.mPoints.GetVertexCount();
+  UIntVector remap(vcount);
+  if ( mPoints.GetVertexCount() == 0 )
+  {
+    mPoints = other.mPoints;
+    for (int v=0; v<vcount; v++) remap[v] = (unsigned int)v;
+  }
+  else
+  {
+    for (int v=0; v<vcount; v++) remap[v] = (unsigned int)mPoints.GetVertex( other.mPoints.Get(v) );
+  }
+
+  int tcount = other.mIndices.size()/3;
+  mIndices.reserve( mIndices.size()+other.mIndices.size() );
+  for (int i=0; i<tcount; i++)
+  {
+    mIndices.push_back( remap[ other.mIndices[i*3+0] ] );
+    mIndices.push_back( remap[ other.mIndices[i*3+1] ] );
+    mIndices.push_back( remap[ other.mIndices[i*3+2] ] );
+    AddLods( other.mTriLods.empty() ? LOD_ALL : other.mTriLods[i] );
+  }
+}
+
+void VertexSection::Split(int maxVertices,std::vector< VertexSection * > &parts) const
+{
+  assert( maxVertices >= 3 );
+
+  VertexSection *part = 0;
+  int tcount = mIndices.size()/3;
+  for (int i=0; i<tcount; i++)
+  {
+    // a triangle adds at most 3 new vertices.
+    if ( !part || part->mPoints.GetVertexCount()+3 > maxVertices )
+    {
+      part = new VertexSection(mName);
+      part->mShader = mShader;
+      parts.push_back(part);
+    }
+    part->AddTri( mPoints.Get(mIndices[i*3+0]),
+                  mPoints.Get(mIndices[i*3+1]),
+                  mPoints.Get(mIndices[i*3+2]),
+                  mTriLods.empty() ? LOD_ALL : mTriLods[i] );
+  }
+}
+
+int VertexSection::CountCacheMisses(const UIntVector &indices,int cacheSize)
+{
+  // FIFO cache, a vertex is in it while it was loaded less than cacheSize
+  // misses ago.
+  unsigned int count = 0;
+  for (size_t i=0; i<indices.size(); i++)
+  {
+    if ( indices[i] >= count ) count = indices[i]+1;
+  }
+  IntVector loaded(count,-cacheSize-1);
+  int misses = 0;
+  for (size_t i=0; i<indices.size(); i++)
+  {
+    if ( misses-loaded[ indices[i] ] <= cacheSize ) continue;
+    loaded[ indices[i] ] = misses++;
+  }
+  return misses;
+}
+
+void VertexSection::OptimizeVertexCache(int cacheSize,int &missesBefore,int &missesAfter)
+{
+  int tcount = mIndices.size()/3;
+  int vcount = mPoints.GetVertexCount();
+  missesBefore = missesAfter = CountCacheMisses(mIndices,cacheSize);
+  if ( tcount < 2 ) return;
+
+  // Tipsify (Sander, Nehab, Barczak 2007): fan around a vertex, emitting
+  // all its triangles, then move on to the neighbour that is still in the
+  // cache and has the fewest triangles left, else back up a dead end stack.
+  IntVector offset(vcount+1,0);
+  for (int i=0; i<tcount*3; i++) offset[ mIndices[i]+1 ]++;
+  for (int v=0; v<vcount; v++) offset[v+1] += offset[v];
+  IntVector adjacency(tcount*3);
+  IntVector fill(offset.begin(),offset.end()-1);
+  for (int i=0; i<tcount*3; i++) adjacency[ fill[ mIndices[i] ]++ ] = i/3;
+
+  IntVector live(vcount);
+  for (int v=0; v<vcount; v++) live[v] = offset[v+1]-offset[v];
+
+  IntVector stamp(vcount,0);
+  IntVector deadEnd;
+  IntVector candidates;
+  std::vector< char > emitted(tcount,0);
+  IntVector order;
+  order.reserve(tcount);
+
+  int time = cacheSize+1;
+  int cursor = 0;
+  int fan = mIndices[0];
+  while ( fan >= 0 )
+  {
+    candidates.clear();
+    for (int a=offset[fan]; a<offset[fan+1]; a++)
+    {
+      int t = adjacency[a];
+      if ( emitted[t] ) continue;
+      emitted[t] = 1;
+      order.push_back(t);
+      for (int k=0; k<3; k++)
+      {
+        int v = mIndices[t*3+k];
+        deadEnd.push_back(v);
+        candidates.push_back(v);
+        live[v]--;
+        if ( time-stamp[v] > cacheSize ) stamp[v] = time++;
+      }
+    }
+
+    // the next fanning vertex
+    fan = -1;
+    int best = -1;
+    for (size_t c=0; c<candidates.size(); c++)
+    {
+      int v = candidates[c];
+      if ( live[v] <= 0 ) continue;
+      int priority = 0;
+      if ( time-stamp[v]+2*live[v] <= cacheSize ) priority = time-stamp[v];
+      if ( priority > best )
+      {
+        best = priority;
+        fan = v;
+      }
+    }
+    if ( fan < 0 )
+    {
+      while ( !deadEnd.empty() && fan < 0 )
+      {
+        int v = deadEnd.back();
+        deadEnd.pop_back();
+        if ( live[v] > 0 ) fan = v;
+      }
+      while ( fan < 0 && cursor < vcount )
+      {
+        if ( live[cursor] > 0 ) fan = cursor;
+        cursor++;
+      }
+    }
+  }
+
+  UIntVector indices(tcount*3);
+  UCharVector lods(mTriLods.size());
+  for (int i=0; i<tcount; i++)
+  {
+    int t = order[i];
+    indices[i*3+0] = mIndices[t*3+0];
+    indices[i*3+1] = mIndices[t*3+1];
+    indices[i*3+2] = mIndices[t*3+2];
+    if ( !lods.empty() ) lods[i] = mTriLods[t];
+  }
+
+  SetTriangles(indices,lods);
+  missesAfter = CountCacheMisses(mIndices,cacheSize);
+}
+
+void VertexSection::SetTriangles(UIntVector &indices,UCharVector &lods)
+{
+  // vertices in the order the triangles first use them.
+  IntVector remap(mPoints.GetVertexCount(),-1);
+  VertexPool points;
+  points.Clear(mPoints.GetVertexCount());
+  mBound.InitMinMax();
+  for (size_t i=0; i<indices.size(); i++)
+  {
+    int &v = remap[ indices[i] ];
+    if ( v < 0 )
+    {
+      v = points.GetVertex( mPoints.Get(indices[i]) );
+      mBound.MinMax( mPoints.Get(indices[i]).mPos );
+    }
+    indices[i] = v;
+  }
+
+  mIndices.swap(indices);
+  mTriLods.swap(lods);
+  mPoints = points;
+}
+
+// sum of the squared distances of a point to a set of planes, as the
+// symmetric 4x4 matrix of Garland and Heckbert.
+class ErrorQuadric
+{
+public:
+  ErrorQuadric(void)
+  {
+    for (int i=0; i<10; i++) m[i] = 0;
+  };
+
+  void AddPlane(double a,double b,double c,double d)
+  {
+    m[0] += a*a; m[1] += a*b; m[2] += a*c; m[3] += a*d;
+    m[4] += b*b; m[5] += b*c; m[6] += b*d;
+    m[7] += c*c; m[8] += c*d;
+    m[9] += d*d;
+  };
+
+  void Add(const ErrorQuadric &q)
+  {
+    for (int i=0; i<10; i++) m[i] += q.m[i];
+  };
+
+  double Error(const Vector3d<float> &p) const
+  {
+    double x = p.x, y = p.y, z = p.z;
+    return m[0]*x*x + 2*m[1]*x*y + 2*m[2]*x*z + 2*m[3]*x
+         + m[4]*y*y + 2*m[5]*y*z + 2*m[6]*y
+         + m[7]*z*z + 2*m[8]*z
+         + m[9];
+  };
+
+  double m[10];
+};
+
+// a candidate collapse of vertex mFrom onto vertex mTo, stale once the
+// stamp of either vertex moved on.
+class EdgeCollapse
+{
+public:
+  bool operator<(const EdgeCollapse &c) const // lowest cost on top
+  {
+    if ( mCost != c.mCost ) return mCost > c.mCost;
+    if ( mFrom != c.mFrom ) return mFrom > c.mFrom;
+    return mTo > c.mTo;
+  };
+
+  double mCost;
+  int    mFrom;
+  int    mTo;
+  int    mFromStamp;
+  int    mToStamp;
+};
+
+static void TriangleNormal(const Vector3d<float> &p1,
+                           const Vector3d<float> &p2,
+                           const Vector3d<float> &p3,
+                           double n[3])
+{
+  double ax = p2.x-p1.x, ay = p2.y-p1.y, az = p2.z-p1.z;
+  double bx = p3.x-p1.x, by = p3.y-p1.y, bz = p3.z-p1.z;
+  n[0] = ay*bz - az*by;
+  n[1] = az*bx - ax*bz;
+  n[2] = ax*by - ay*bx;
+}
+
+int VertexSection::Simplify(float ratio,float maxError)
+{
+  int tcount = mIndices.size()/3;
+  int vcount = mPoints.GetVertexCount();
+
+  int target = (int)(tcount*ratio);
+  if ( ratio >= 1 && maxError > 0 ) target = 0;
+  if ( target < 1 ) target = 1;
+  if ( target >= tcount ) return tcount;
+  double limit = maxError > 0 ? (double)maxError*maxError : -1;
+
+  std::vector< Vector3d<float> > pos(vcount);
+  for (int v=0; v<vcount; v++) pos[v] = mPoints.Get(v).mPos;
+
+  UIntVector tris(mIndices);
+  std::vector< char > dead(tcount,0);
+  std::vector< IntVector > vtris(vcount); // triangles per vertex, dead ones included
+  std::vector< ErrorQuadric > quadrics(vcount);
+  int live = tcount;
+
+  // a border edge has one triangle, a non manifold edge more than two.
+  std::map< std::pair< int, int >, int > edges;
+
+  for (int t=0; t<tcount; t++)
+  {
+    unsigned int *c = &tris[t*3];
+    if ( c[0] == c[1] || c[1] == c[2] || c[2] == c[0] )
+    {
+      dead[t] = 1;
+      live--;
+      continue;
+    }
+    for (int k=0; k<3; k++)
+    {
+      vtris[ c[k] ].push_back(t);
+      int a = c[k], b = c[(k+1)%3];
+      edges[ std::make_pair( a < b ? a : b, a < b ? b : a ) ]++;
+    }
+
+    double n[3];
+    TriangleNormal(pos[c[0]],pos[c[1]],pos[c[2]],n);
+    double len = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+    if ( len <= 0 ) continue;
+    n[0] /= len; n[1] /= len; n[2] /= len;
+    double d = -(n[0]*pos[c[0]].x + n[1]*pos[c[0]].y + n[2]*pos[c[0]].z);
+    for (int k=0; k<3; k++) quadrics[ c[k] ].AddPlane(n[0],n[1],n[2],d);
+  }
+
+  // vertices that have to stay where they are: on the border of the
+  // section, which is also where a U/V seam in either channel splits the
+  // vertices, or sharing their position with another vertex.
+  std::vector< char > locked(vcount,0);
+  for (std::map< std::pair< int, int >, int >::iterator i=edges.begin(); i!=edges.end(); ++i)
+  {
+    if ( (*i).second != 2 )
+    {
+      locked[ (*i).first.first ] = 1;
+      locked[ (*i).first.second ] = 1;
+    }
+  }
+
+  IntVector byPos(vcount);
+  for (int v=0; v<vcount; v++) byPos[v] = v;
+  std::sort(byPos.begin(),byPos.end(),[&](int a,int b)
+  {
+    if ( pos[a].x != pos[b].x ) return pos[a].x < pos[b].x;
+    if ( pos[a].y != pos[b].y ) return pos[a].y < pos[b].y;
+    return pos[a].z < pos[b].z;
+  });
+  for (int i=1; i<vcount; i++)
+  {
+    const Vector3d<float> &a = pos[ byPos[i-1] ];
+    const Vector3d<float> &b = pos[ byPos[i] ];
+    if ( a.x == b.x && a.y == b.y && a.z == b.z )
+    {
+      locked[ byPos[i-1] ] = 1;
+      locked[ byPos[i] ] = 1;
+    }
+  }
+
+  IntVector stamp(vcount,0);
+  std::vector< char > removed(vcount,0);
+  std::priority_queue< EdgeCollapse > heap;
+
+  auto consider = [&](int from,int to)
+  {
+    if ( locked[from] ) return;
+    ErrorQuadric q = quadrics[from];
+    q.Add(quadrics[to]);
+    EdgeCollapse c;
+    c.mCost = q.Error(pos[to]);
+    c.mFrom = from;
+    c.mTo = to;
+    c.mFromStamp = stamp[from];
+    c.mToStamp = stamp[to];
+    heap.push(c);
+  };
+
+  // the live vertices sharing a triangle with v
+  auto neighbours = [&](int v,IntVector &out)
+  {
+    out.clear();
+    for (size_t i=0; i<vtris[v].size(); i++)
+    {
+      int t = vtris[v][i];
+      if ( dead[t] ) continue;
+      for (int k=0; k<3; k++)
+      {
+        if ( (int)tris[t*3+k] != v ) out.push_back(tris[t*3+k]);
+      }
+    }
+    std::sort(out.begin(),out.end());
+    out.erase(std::unique(out.begin(),out.end()),out.end());
+  };
+
+  for (int t=0; t<tcount; t++)
+  {
+    if ( dead[t] ) continue;
+    for (int k=0; k<3; k++)
+    {
+      consider(tris[t*3+k],tris[t*3+(k+1)%3]);
+      consider(tris[t*3+(k+1)%3],tris[t*3+k]);
+    }
+  }
+
+  IntVector fromNear, toNear, common;
+  while ( live > target && !heap.empty() )
+  {
+    EdgeCollapse c = heap.top();
+    heap.pop();
+    int from = c.mFrom;
+    int to = c.mTo;
+    if ( removed[from] || removed[to] ) continue;
+    if ( stamp[from] != c.mFromStamp || stamp[to] != c.mToStamp ) continue;
+    if ( limit >= 0 && c.mCost > limit ) break; // every other one costs more
+
+    // the two must share exactly the vertices opposite their common
+    // triangles, anything else pinches the surface.
+    int shared = 0;
+    for (size_t i=0; i<vtris[from].size(); i++)
+    {
+      int t = vtris[from][i];
+      if ( !dead[t] && ( tris[t*3] == (unsigned int)to || tris[t*3+1] == (unsigned int)to || tris[t*3+2] == (unsigned int)to ) ) shared++;
+    }
+    if ( shared == 0 ) continue;
+    neighbours(from,fromNear);
+    neighbours(to,toNear);
+    common.clear();
+    std::set_intersection(fromNear.begin(),fromNear.end(),toNear.begin(),toNear.end(),std::back_inserter(common));
+    if ( (int)common.size() != shared ) continue;
+
+    // no remaining triangle may flip or fold over.
+    bool ok = true;
+    for (size_t i=0; i<vtris[from].size() && ok; i++)
+    {
+      int t = vtris[from][i];
+      unsigned int *tc = &tris[t*3];
+      if ( dead[t] || tc[0] == (unsigned int)to || tc[1] == (unsigned int)to || tc[2] == (unsigned int)to ) continue;
+      double before[3], after[3];
+      TriangleNormal(pos[tc[0]],pos[tc[1]],pos[tc[2]],before);
+      TriangleNormal(tc[0] == (unsigned int)from ? pos[to] : pos[tc[0]],
+                     tc[1] == (unsigned int)from ? pos[to] : pos[tc[1]],
+                     tc[2] == (unsigned int)from ? pos[to] : pos[tc[2]],after);
+      double dot = before[0]*after[0] + before[1]*after[1] + before[2]*after[2];
+      double lb = sqrt(before[0]*before[0] + before[1]*before[1] + before[2]*before[2]);
+      double la = sqrt(after[0]*after[0] + after[1]*after[1] + after[2]*after[2]);
+      if ( lb > 0 && dot <= 0.5*lb*la ) ok = false; // more than 60 degrees
+    }
+    if ( !ok ) continue;
+
+    for (size_t i=0; i<vtris[from].size(); i++)
+    {
+      int t = vtris[from][i];
+      if ( dead[t] ) continue;
+      unsigned int *tc = &tris[t*3];
+      if ( tc[0] == (unsigned int)to || tc[1] == (unsigned int)to || tc[2] == (unsigned int)to )
+      {
+        dead[t] = 1;
+        live--;
+        continue;
+      }
+      for (int k=0; k<3; k++)
+      {
+        if ( tc[k] == (unsigned int)from ) tc[k] = to;
+      }
+      vtris[to].push_back(t);
+    }
+    vtris[from].clear();
+    removed[from] = 1;
+    quadrics[to].Add(quadrics[from]);
+    stamp[to]++;
+
+    neighbours(to,toNear);
+    for (size_t i=0; i<toNear.size(); i++)
+    {
+      consider(toNear[i],to);
+      consider(to,toNear[i]);
+    }
+  }
+
+  // the surviving triangles in their old order, each vertex keeps its own
+  // texture and lightmap coordinates.
+  UIntVector indices;
+  UCharVector lods;
+  indices.reserve(live*3);
+  for (int t=0; t<tcount; t++)
+  {
+    if ( dead[t] ) continue;
+    indices.push_back(tris[t*3+0]);
+    indices.push_back(tris[t*3+1]);
+    indices.push_back(tris[t*3+2]);
+    if ( !mTriLods.empty() ) lods.push_back(mTriLods[t]);
+  }
+  SetTriangles(indices,lods);
+  return live;
+}
+
 void VertexSection::AddTri(const LightMapVertex &v1,
             const LightMapVertex &v2,
-            const LightMapVertex &v3)
+            const LightMapVertex &v3,
+            unsigned char lods)
 {
   mBound.MinMax(v1.mPos);
   mBound.MinMax(v2.mPos);
@@ -203,131 +745,350 @@ void VertexSection::AddTri(const LightMapVertex &v1,
   AddPoint(v1);
   AddPoint(v2);
   AddPoint(v3);
+  AddLods(lods);
+
+}
+
+void VertexSection::AddLods(unsigned char lods)
+{
+  // the masks are only stored once some triangle is not in every level.
+  if ( lods != LOD_ALL && mTriLods.empty() )
+  {
+    mTriLods.assign(mIndices.size()/3-1,LOD_ALL);
+  }
+  if ( !mTriLods.empty() ) mTriLods.push_back(lods);
+}
+
+void VertexSection::GetLodLevels(IntVector &levels) const
+{
+  levels.clear();
+  levels.push_back(0);
+
+  // levels in use are the ones up to the highest bit of a partial mask.
+  int count = 1;
+  for (size_t i=0; i<mTriLods.size(); i++)
+  {
+    if ( mTriLods[i] == LOD_ALL ) continue;
+    for (int lod=count; lod<MAX_LOD_LEVELS; lod++)
+    {
+      if ( mTriLods[i] & (1<<lod) ) count = lod+1;
+    }
+  }
 
+  for (int lod=1; lod<count; lod++)
+  {
+    int prev = levels.back();
+    for (size_t i=0; i<mTriLods.size(); i++)
+    {
+      if ( ((mTriLods[i]>>lod) ^ (mTriLods[i]>>prev)) & 1 )
+      {
+        levels.push_back(lod);
+        break;
+      }
+    }
+  }
+}
+
+const UIntVector& VertexSection::GetLodIndices(int lod,UIntVector &scratch) const
+{
+  if ( mTriLods.empty() ) return mIndices;
+
+  scratch.clear();
+  for (size_t i=0; i<mTriLods.size(); i++)
+  {
+    if ( mTriLods[i] & (1<<lod) )
+    {
+      scratch.push_back(mIndices[i*3+0]);
+      scratch.push_back(mIndices[i*3+1]);
+      scratch.push_back(mIndices[i*3+2]);
+    }
+  }
+  return scratch;
 }
 
 
 void VertexSection::AddPoint(const LightMapVertex &p)
 {
-  unsigned short idx = (unsigned short)mPoints.GetVertex(p);
+  unsigned int idx = (unsigned int)mPoints.GetVertex(p);
   mIndices.push_back(idx);
 };
 
 
+void VertexMesh::OptimizeVertexCache(int cacheSize,int jobs,int &triangles,
+                                     int &missesBefore,int &missesAfter)
+{
+  std::vector< VertexSection * > sections;
+  for (VertexSectionMap::iterator i=mSections.begin(); i!=mSections.end(); ++i)
+  {
+    sections.push_back( (*i).second );
+  }
+
+  IntVector before(sections.size()), after(sections.size());
+  ParallelFor((int)sections.size(),jobs,[&](int s)
+  {
+    sections[s]->OptimizeVertexCache(cacheSize,before[s],after[s]);
+  });
+
+  for (size_t s=0; s<sections.size(); s++)
+  {
+    triangles    += sections[s]->GetTriangleCount();
+    missesBefore += before[s];
+    missesAfter  += after[s];
+  }
+}
+
+void VertexMesh::Simplify(float ratio,float maxError,int jobs,int &before,int &after)
+{
+  std::vector< VertexSection * > sections;
+  for (VertexSectionMap::iterator i=mSections.begin(); i!=mSections.end(); ++i)
+  {
+    sections.push_back( (*i).second );
+    before += (*i).second->GetTriangleCount();
+  }
+
+  IntVector kept(sections.size());
+  ParallelFor((int)sections.size(),jobs,[&](int s)
+  {
+    kept[s] = sections[s]->Simplify(ratio,maxError);
+  });
+
+  for (size_t s=0; s<sections.size(); s++) after += kept[s];
+}
+
+void VertexMesh::GetSections(int maxVertices,
+                             std::vector< VertexSection * > &sections,
+                             std::vector< VertexSection * > &parts) const
+{
+  VertexSectionMap::const_iterator i;
+  for (i=mSections.begin(); i!=mSections.end(); ++i)
+  {
+    VertexSection *section = (*i).second;
+    if ( maxVertices > 0 && section->GetVertexCount() > maxVertices )
+    {
+      size_t first = parts.size();
+      section->Split(maxVertices,parts);
+      sections.insert(sections.end(),parts.begin()+first,parts.end());
+    }
+    else
+      sections.push_back(section);
+  }
+}
+
 void VertexMesh::SaveVRML2(
 			FILE *fph,
             VFormatOptions &options) const 
+{
+	SaveVRML2(fph,NULL,options);
+}
+
+void VertexMesh::SaveVRML2(
+			FILE *fph1,
+			FILE *fph2,
+            VFormatOptions &options) const 
 {
 	if ( mSections.size() )
 	{
 		
-		if ( fph )
+		if ( fph1 )
 		{
+			int files = fph2 ? 2 : 1;
+			TextWriter *out[2];
+			out[0] = new TextWriter(fph1,options.floatMode);
+			out[1] = fph2 ? new TextWriter(fph2,options.floatMode) : NULL;
+
 			//fprintf(fph,"#VRML V2.0 utf8 generated by QBSP \n");
-			if (mSections.size() >0) {
-				fprintf(fph,"Group {\n");
-				fprintf(fph,"children [\n");
+			for (int f=0; f<files; f++) {
+				out[f]->Put("Group {\n");
+				out[f]->Put("children [\n");
 			}	
-			VertexSectionMap::const_iterator i;
-			
-			for (i=mSections.begin(); i!=mSections.end(); ++i)
-			{
-				(*i).second->SaveVRML2(fph,options);
+
+			std::vector< VertexSection * > sections;
+			std::vector< VertexSection * > parts;
+			GetSections(options.maxSectionVertices,sections,parts);
+			int count = (int)sections.size();
+
+			// the appearances of one file after the other and in file order,
+			// they hand out the DEF names.  Channel #2 has no material.
+			std::vector< SectionDefs > defs(count*files);
+			std::vector< TextWriter * > appearance(count*files);
+			for (int f=0; f<files; f++) {
+				if (f == 1) {
+					options.tex1 = false;
+					options.matDefined = false;
+					options.useMat = false;
+				}
+				for (int k=0; k<count; k++) {
+					appearance[f*count+k] = new TextWriter(NULL,options.floatMode,1024);
+					sections[k]->SaveAppearanceVRML2(*appearance[f*count+k],options,defs[f*count+k]);
+				}
 			}
-			if (mSections.size() >0) {
-				
-				fprintf(fph,"\n]\n}\n");
+
+			// then the geometry, a window of sections at a time on all threads
+			// into a buffer per section and file.  Channel #2 shares the text
+			// of channel #1 unless it differs.
+			int jobs = GetJobCount(options.jobs);
+			int window = jobs*4;
+			for (int first=0; first<count; first+=window) {
+				int n = std::min(window,count-first);
+				std::vector< TextWriter * > geometry(n*files,(TextWriter *)NULL);
+				ParallelFor(n,jobs,[&](int k) {
+					VertexSection *section = sections[first+k];
+					for (int f=0; f<files; f++) {
+						const SectionDefs &d = defs[f*count+first+k];
+						if (f > 0 && d.SameGeometry(defs[first+k],options)) continue;
+						geometry[f*n+k] = new TextWriter(NULL,options.floatMode,65536);
+						section->SaveGeometryVRML2(*geometry[f*n+k],options,d);
+					}
+				});
+				for (int k=0; k<n; k++) {
+					for (int f=0; f<files; f++) {
+						TextWriter *a = appearance[f*count+first+k];
+						TextWriter *g = geometry[f*n+k] ? geometry[f*n+k] : geometry[k];
+						out[f]->Put(a->GetText(),a->GetLength());
+						out[f]->Put(g->GetText(),g->GetLength());
+						delete a;
+					}
+				}
+				for (int k=0; k<n*files; k++)
+					delete geometry[k];
 			}
-			
+
+			for (unsigned int p=0; p<parts.size(); p++)
+				delete parts[p];
+
+			for (int f=0; f<files; f++) {
+				out[f]->Put("\n]\n}\n");
+				delete out[f];
+			}	
 		}
 	}
 }
 
-void VertexMesh::SaveVRML(const String &name,  // base file name
-              bool tex1) const           // texture channel 1=(true)
+void VertexMesh::SaveVRML(const String &name1,
+              const String &name2,
+              int maxSectionVertices) const
 {
+  // the items of the second file are numbered after those of the first.
+  static int itemcount=1;
+
   if ( mSections.size() )
   {
-    String oname = name+".wrl";
-    FILE *fph = fopen(oname.c_str(),"wb");
-
-    if ( fph )
+    String oname1 = name1+".wrl";
+    String oname2 = name2+".wrl";
+    FILE *fph1 = fopen(oname1.c_str(),"wb");
+    FILE *fph2 = fopen(oname2.c_str(),"wb");
+    RecordOutput(oname1.c_str());
+    RecordOutput(oname2.c_str());
+
+    if ( fph1 && fph2 )
     {
-      fprintf(fph,"#VRML V1.0 ascii\n");
-      fprintf(fph,"Separator {\n");
-      fprintf(fph,"  ShapeHints {\n");
-      fprintf(fph,"    shapeType SOLID\n");
-      fprintf(fph,"    vertexOrdering COUNTERCLOCKWISE\n");
-      fprintf(fph,"    faceType CONVEX\n");
-      fprintf(fph,"  }\n");
-
-      VertexSectionMap::const_iterator i;
-
-      for (i=mSections.begin(); i!=mSections.end(); ++i)
+      TextWriter out1(fph1);
+      TextWriter out2(fph2);
+      TextWriter *out[2] = { &out1, &out2 };
+      for (int f=0; f<2; f++)
       {
-        (*i).second->SaveVRML(fph,tex1);
+        out[f]->Put("#VRML V1.0 ascii\n");
+        out[f]->Put("Separator {\n");
+        out[f]->Put("  ShapeHints {\n");
+        out[f]->Put("    shapeType SOLID\n");
+        out[f]->Put("    vertexOrdering COUNTERCLOCKWISE\n");
+        out[f]->Put("    faceType CONVEX\n");
+        out[f]->Put("  }\n");
       }
 
-      fprintf(fph,"}\n");
+      std::vector< VertexSection * > sections;
+      std::vector< VertexSection * > parts;
+      GetSections(maxSectionVertices,sections,parts);
+      int count = (int)sections.size();
+
+      for (int k=0; k<count; k++)
+        sections[k]->SaveVRML(out1,out2,itemcount+k,itemcount+count+k);
+      itemcount += count*2;
+
+      for (unsigned int p=0; p<parts.size(); p++)
+        delete parts[p];
 
-      fclose(fph);
+      out1.Put("}\n");
+      out2.Put("}\n");
+      out1.Flush();
+      out2.Flush();
     }
+
+    if ( fph1 ) fclose(fph1);
+    if ( fph2 ) fclose(fph2);
   }
 }
 
-void VertexSection::SaveVRML(FILE *fph,bool tex1)
+void VertexSection::SaveVRML(TextWriter &out1,TextWriter &out2,int item1,int item2) const
 {
   // save it into a VRML file!
-  static int itemcount=1;
+  TextWriter *out[2] = { &out1, &out2 };
+  int item[2] = { item1, item2 };
 
-  fprintf(fph,"DEF item%d Separator {\n",itemcount++);
-  fprintf(fph,"Translation { translation 0 0 0 }\n");
-  fprintf(fph,"Material {\n");
-  fprintf(fph,"  ambientColor 0.1791 0.06536 0.06536\n");
-  fprintf(fph,"  diffuseColor 0.5373 0.1961 0.1961\n");
-  fprintf(fph,"  specularColor 0.9 0.9 0.9\n");
-  fprintf(fph,"  shininess 0.25\n");
-  fprintf(fph,"  transparency 0\n");
-  fprintf(fph,"}\n");
-  fprintf(fph,"Texture2 {\n");
+  for (int f=0; f<2; f++)
+  {
+    bool tex1 = f == 0;
 
+    out[f]->Print("DEF item%d Separator {\n",item[f]);
+    out[f]->Put("Translation { translation 0 0 0 }\n");
+    out[f]->Put("Material {\n");
+    out[f]->Put("  ambientColor 0.1791 0.06536 0.06536\n");
+    out[f]->Put("  diffuseColor 0.5373 0.1961 0.1961\n");
+    out[f]->Put("  specularColor 0.9 0.9 0.9\n");
+    out[f]->Put("  shininess 0.25\n");
+    out[f]->Put("  transparency 0\n");
+    out[f]->Put("}\n");
+    out[f]->Put("Texture2 {\n");
 
-  const char *foo = mName;
-  char scratch[256];
 
-  if ( !tex1 )
-  {
-    while ( *foo && *foo != '+' ) foo++;
-    char *dest = scratch;
-    if ( *foo == '+' )
+    const char *foo = mName;
+    char scratch[256];
+
+    if ( !tex1 )
     {
-      foo++;
-      while ( *foo ) *dest++ = *foo++;
+      while ( *foo && *foo != '+' ) foo++;
+      char *dest = scratch;
+      if ( *foo == '+' )
+      {
+        foo++;
+        while ( *foo ) *dest++ = *foo++;
+      }
+      *dest = 0;
+    }
+    else
+    {
+      char *dest = scratch;
+      while ( *foo && *foo != '+' ) *dest++ = *foo++;
+      *dest = 0;
     }
-    *dest = 0;
-  }
-  else
-  {
-    char *dest = scratch;
-    while ( *foo && *foo != '+' ) *dest++ = *foo++;
-    *dest = 0;
-  }
 
-  if ( tex1 )
-    fprintf(fph,"  filename %c%s.tga%c\n",0x22,scratch,0x22);
-  else
-    fprintf(fph,"  filename %c%s.bmp%c\n",0x22,scratch,0x22);
+    if ( tex1 )
+      out[f]->Print("  filename %c%s.tga%c\n",0x22,scratch,0x22);
+    else
+      out[f]->Print("  filename %c%s.bmp%c\n",0x22,scratch,0x22);
 
-  fprintf(fph,"}\n");
+    out[f]->Put("}\n");
+  }
 
-  mPoints.SaveVRML(fph,tex1);
+  // coordinates and indices are the same in both files.
+  TextWriter shared(NULL,FLOAT_FORMAT,65536);
+  mPoints.SaveCoordinatesVRML(shared);
+  out1.Put(shared.GetText(),shared.GetLength());
+  out2.Put(shared.GetText(),shared.GetLength());
 
-  int tcount = mIndices.size()/3;
+  mPoints.SaveTextureCoordinatesVRML(out1,true);
+  mPoints.SaveTextureCoordinatesVRML(out2,false);
+
+  // VRML 1 gets the finest LOD level only.
+  UIntVector scratchIndices;
+  const UIntVector &indices = GetLodIndices(0,scratchIndices);
+  int tcount = indices.size()/3;
 
+  shared.Clear();
   if ( 1 )
   {
-    fprintf(fph,"  IndexedFaceSet {\ncoordIndex [\n");
-    UShortVector::iterator j= mIndices.begin();
+    shared.Put("  IndexedFaceSet {\ncoordIndex [\n");
+    UIntVector::const_iterator j= indices.begin();
     for (int i=0; i<tcount; i++)
     {
       int i1 = *j;
@@ -336,17 +1097,16 @@ void VertexSection::SaveVRML(FILE *fph,bool tex1)
       j++;
       int i3 = *j;
       j++;
-      if ( i == (tcount-1) )
-        fprintf(fph,"  %d, %d, %d, -1]\n",i1,i2,i3);
-      else
-        fprintf(fph,"  %d, %d, %d, -1,\n",i1,i2,i3);
+      shared.Put("  ");
+      shared.PutInts(i1,i2,i3,", ");
+      shared.Put( i == (tcount-1) ? ", -1]\n" : ", -1,\n" );
     }
   }
 
   if ( 1 )
   {
-    fprintf(fph,"  textureCoordIndex [\n");
-    UShortVector::iterator j= mIndices.begin();
+    shared.Put("  textureCoordIndex [\n");
+    UIntVector::const_iterator j= indices.begin();
     for (int i=0; i<tcount; i++)
     {
       int i1 = *j;
@@ -355,36 +1115,41 @@ void VertexSection::SaveVRML(FILE *fph,bool tex1)
       j++;
       int i3 = *j;
       j++;
-      if ( i == (tcount-1) )
-        fprintf(fph,"  %d, %d, %d, -1]\n",i1,i2,i3);
-      else
-        fprintf(fph,"  %d, %d, %d, -1,\n",i1,i2,i3);
+      shared.Put("  ");
+      shared.PutInts(i1,i2,i3,", ");
+      shared.Put( i == (tcount-1) ? ", -1]\n" : ", -1,\n" );
     }
   }
-  fprintf(fph,"  }\n");
-  fprintf(fph,"}\n");
+  shared.Put("  }\n");
+  shared.Put("}\n");
+  out1.Put(shared.GetText(),shared.GetLength());
+  out2.Put(shared.GetText(),shared.GetLength());
 };
 
 
-void VertexPool::SaveVRML(FILE *fph,bool tex1)
+void VertexPool::SaveCoordinatesVRML(TextWriter &out) const
 {
   if ( 1 )
   {
-    fprintf(fph,"  Coordinate3 {\npoint [\n");
+    out.Put("  Coordinate3 {\npoint [\n");
     int count = mVtxs.size();
     for (int i=0; i<count; i++)
     {
       const LightMapVertex &vtx = mVtxs[i];
       if ( i == (count-1) )
-        fprintf(fph,"  %f %f %f\n]\n",vtx.mPos.x,vtx.mPos.y,vtx.mPos.z);
+        out.PutFloats("  %f %f %f\n]\n",vtx.mPos.x,vtx.mPos.y,vtx.mPos.z);
       else
-        fprintf(fph,"  %f %f %f,\n",vtx.mPos.x,vtx.mPos.y,vtx.mPos.z);
+        out.PutFloats("  %f %f %f,\n",vtx.mPos.x,vtx.mPos.y,vtx.mPos.z);
     }
-    fprintf(fph,"   }\n");
+    out.Put("   }\n");
   }
+}
+
+void VertexPool::SaveTextureCoordinatesVRML(TextWriter &out,bool tex1) const
+{
   if ( 1 )
   {
-    fprintf(fph,"  TextureCoordinate2 {\npoint [\n");
+    out.Put("  TextureCoordinate2 {\npoint [\n");
     int count = mVtxs.size();
 
     for (int i=0; i<count; i++)
@@ -394,26 +1159,26 @@ void VertexPool::SaveVRML(FILE *fph,bool tex1)
       if ( !tex1 ) // if saving second U/V channel.
       {
         if ( i == (count-1) )
-          fprintf(fph,"  %f %f\n]\n",vtx.mTexel2.x,1.0f-vtx.mTexel2.y);
+          out.PutFloats("  %f %f\n]\n",vtx.mTexel2.x,1.0f-vtx.mTexel2.y);
         else
-          fprintf(fph,"  %f %f,\n",vtx.mTexel2.x,1.0f-vtx.mTexel2.y);
+          out.PutFloats("  %f %f,\n",vtx.mTexel2.x,1.0f-vtx.mTexel2.y);
       }
       else
       {
         if ( i == (count-1) )
-          fprintf(fph,"  %f %f\n]\n",vtx.mTexel1.x,1.0f-vtx.mTexel1.y);
+          out.PutFloats("  %f %f\n]\n",vtx.mTexel1.x,1.0f-vtx.mTexel1.y);
         else
-          fprintf(fph,"  %f %f,\n",vtx.mTexel1.x,1.0f-vtx.mTexel1.y);
+          out.PutFloats("  %f %f,\n",vtx.mTexel1.x,1.0f-vtx.mTexel1.y);
       }
     }
 
-    fprintf(fph,"   }\n");
+    out.Put("   }\n");
   }
 }
 
 // write a single VRML ImageTexture node
 
-void WriteImageTexture(FILE *fph,const StringRef &name,
+void WriteImageTexture(TextWriter &out,const StringRef &name,
 					   VFormatOptions &options,bool lightmap, bool clamp= false)
 {
 
@@ -421,7 +1186,7 @@ void WriteImageTexture(FILE *fph,const StringRef &name,
 	  TextureDefMap::iterator found;
 	  found = options.textureDefMap.find(name);
 	  if ( found != options.textureDefMap.end()) { // simply use it 
-		  fprintf(fph,"USE %s\n",(const char *)(*found).second );
+		  out.Print("USE %s\n",(const char *)(*found).second );
 	  } 
 	  else 
 	  { // need to define new imageTexture node 
@@ -430,9 +1195,9 @@ void WriteImageTexture(FILE *fph,const StringRef &name,
 		  sprintf(buf,"_T%d",options.textureCount);
 		  options.textureCount++;
 
-		  fprintf(fph,"DEF %s ImageTexture {\n",(const char *)buf);
+		  out.Print("DEF %s ImageTexture {\n",(const char *)buf);
 
-		  if (clamp) fprintf(fph,"\trepeatS FALSE repeatT FALSE\n");		  
+		  if (clamp) out.Put("\trepeatS FALSE repeatT FALSE\n");		  
 		  const char *ext="bmp";
 		  
 		  if (options.usePng) 
@@ -442,11 +1207,11 @@ void WriteImageTexture(FILE *fph,const StringRef &name,
 				String textureFileName;
 				// check and return jpg, png ..
 				CheckTexture(name, textureFileName);
-				fprintf(fph,"  url %c%s%c\n",0x22,textureFileName.c_str(),0x22);
+				out.Print("  url %c%s%c\n",0x22,textureFileName.c_str(),0x22);
 		  } else
-			  fprintf(fph,"  url %c%s.%s%c\n",0x22,name.Get(),ext,0x22);
+			  out.Print("  url %c%s.%s%c\n",0x22,name.Get(),ext,0x22);
 		  
-		  fprintf(fph,"}\n");
+		  out.Put("}\n");
 		  
 		  // insert new node into map 
 		  options.textureDefMap.insert(TextureDefMap::value_type(name,buf));
@@ -456,7 +1221,16 @@ void WriteImageTexture(FILE *fph,const StringRef &name,
 
 // save it into a VRML 2 file
 
-void VertexSection::SaveVRML2(FILE *fph,VFormatOptions &options)
+void VertexSection::SaveVRML2(TextWriter &out,VFormatOptions &options)
+{
+  SectionDefs defs;
+  SaveAppearanceVRML2(out,options,defs);
+  SaveGeometryVRML2(out,options,defs);
+}
+
+// everything up to the geometry of the first Shape.  This part hands out
+// the DEF names, so sections have to go through it in file order.
+void VertexSection::SaveAppearanceVRML2(TextWriter &out,VFormatOptions &options,SectionDefs &defs)
 {
 
   static int itemcount=1;
@@ -506,9 +1280,32 @@ void VertexSection::SaveVRML2(FILE *fph,VFormatOptions &options)
 
   }	
 
-  //fprintf(fph,"DEF item%d Shape {\n",itemcount++);
-  fprintf(fph,"Shape {\n");
-  fprintf(fph,"appearance ");
+  // patches tessellated at several levels of detail go into an LOD node,
+  // one Shape per level.
+  IntVector &lodLevels = defs.lodLevels;
+  GetLodLevels(lodLevels);
+  int levels = (int)lodLevels.size();
+  int lodDef = -1;
+  if ( levels > 1 )
+  {
+    lodDef = options.lodCount++;
+    Vector3d<float> center;
+    center.Lerp(mBound.r1,mBound.r2,0.5f);
+    out.Put("LOD {\ncenter ");
+    if (options.yzFlip)
+      out.PutFloats(options.VFORMAT,center.x,center.z,center.y);
+    else out.PutFloats(options.VFORMAT,center.x,center.y,center.z);
+    out.Put("\nrange [");
+    for (int lod=1; lod<levels; lod++)
+      out.Print(" %g",options.GetLodRange(lodLevels[lod]));
+    out.Put(" ]\nlevel [\n");
+  }
+
+  char *appearance = defs.appearance;
+
+  //out.Print("DEF item%d Shape {\n",itemcount++);
+  out.Put("Shape {\n");
+  out.Put("appearance ");
 
 
   // appearance node already defined ?
@@ -516,18 +1313,20 @@ void VertexSection::SaveVRML2(FILE *fph,VFormatOptions &options)
   found = options.appearanceDefMap.find(mName);
   if ( found != options.appearanceDefMap.end()) { // simply use it 
 	  //found.r
-	  fprintf(fph,"USE %s\n",(const char *)(*found).second);
+	  out.Print("USE %s\n",(const char *)(*found).second);
+	  strcpy(appearance,(const char *)(*found).second);
   } 
   else 
   {  // need to define new Appearance node 
 	  if (options.verbose) {
-		fprintf(fph," #%s\n",(const char *) mName);
+		out.Print(" #%s\n",(const char *) mName);
 		if (mShader) {
-			  fprintf(fph," #shader %s\n",(const char *) mShader->GetName());
+			  out.Print(" #shader %s\n",(const char *) mShader->GetName());
 		}		
 	  }	
 	  
-	  fprintf(fph,"DEF A%d Appearance {\n",options.appearanceCount);
+	  out.Print("DEF A%d Appearance {\n",options.appearanceCount);
+	  sprintf(appearance,"A%d",options.appearanceCount);
 	  char buf[60];
 	  sprintf(buf,"_A%d",options.appearanceCount);
 
@@ -537,38 +1336,38 @@ void VertexSection::SaveVRML2(FILE *fph,VFormatOptions &options)
 	  options.appearanceCount++;
 		  
 		  if (options.useLighting) {
-			  fprintf(fph,"material Material {\n");
-			  fprintf(fph,"  ambientIntensity 0.06536 \n");
-			  fprintf(fph,"  diffuseColor 0.5373 0.1961 0.1961\n");
-			  fprintf(fph,"  specularColor 0.9 0.9 0.9\n");
-			  fprintf(fph,"  shininess 0.25\n");
-			  //fprintf(fph,"  transparency 0\n");
-			  fprintf(fph,"}\n");
+			  out.Put("material Material {\n");
+			  out.Put("  ambientIntensity 0.06536 \n");
+			  out.Put("  diffuseColor 0.5373 0.1961 0.1961\n");
+			  out.Put("  specularColor 0.9 0.9 0.9\n");
+			  out.Put("  shininess 0.25\n");
+			  //out.Put("  transparency 0\n");
+			  out.Put("}\n");
 		  }
 		  else {  
 		  if (options.useMat) {
 			  if (!options.matDefined) {
-				fprintf(fph,"material DEF MAT Material {\n");
-				//fprintf(fph,"  diffuseColor 0 0 0\n");
-				fprintf(fph,"  diffuseColor 1 1 1\n");
-				//fprintf(fph,"  emissiveColor 0.5 0.5 0.5\n"); // overall brightness 
-				fprintf(fph,"  emissiveColor 0.2 0.2 0.2\n"); // overall brightness 
-				fprintf(fph,"}\n");
+				out.Put("material DEF MAT Material {\n");
+				//out.Put("  diffuseColor 0 0 0\n");
+				out.Put("  diffuseColor 1 1 1\n");
+				//out.Put("  emissiveColor 0.5 0.5 0.5\n"); // overall brightness 
+				out.Put("  emissiveColor 0.2 0.2 0.2\n"); // overall brightness 
+				out.Put("}\n");
 				options.matDefined = true;
 			  } else 	
-				fprintf(fph,"material USE MAT \n");
+				out.Put("material USE MAT \n");
 
 		  }
 		  }
 		  
 		  
-		  fprintf(fph,"texture ");
+		  out.Put("texture ");
 		  
 		  bool tex1 = options.tex1;
 		
 		  
 		  if (options.useMultiTexturing) {
-			  fprintf(fph,"MultiTexture {\nmaterialColor TRUE texture [\n");
+			  out.Put("MultiTexture {\nmaterialColor TRUE texture [\n");
 			  tex1 = true;
 		
 		  if (mShader) {
@@ -583,36 +1382,36 @@ void VertexSection::SaveVRML2(FILE *fph,VFormatOptions &options)
 
 				if (stage.isAnimMap) {
 					if (options.useEffects) {
-						fprintf(fph,"DEF MAP AnimMap {\nfrequency %f textures [\n",stage.animMapFrequency);
+						out.Print("DEF MAP AnimMap {\nfrequency %f textures [\n",stage.animMapFrequency);
 						for (unsigned int i=0; i<stage.animMap.size(); i++)
-							WriteImageTexture(fph,stage.animMap[i],options,false,stage.clamp);
+							WriteImageTexture(out,stage.animMap[i],options,false,stage.clamp);
 
-						//fprintf(fph,"] ROUTE TIMER.fraction_changed TO MAP.set_fraction \n");
-					    fprintf(fph,"]ROUTE TIMER.time_changed TO MAP.set_time\n");
+						//out.Put("] ROUTE TIMER.fraction_changed TO MAP.set_fraction \n");
+					    out.Put("]ROUTE TIMER.time_changed TO MAP.set_time\n");
 
-						fprintf(fph,"}");
+						out.Put("}");
 					}else
-						WriteImageTexture(fph,stage.animMap[0],options,false,stage.clamp);
+						WriteImageTexture(out,stage.animMap[0],options,false,stage.clamp);
 
 
 				} else 
 				if (stage.isLightMap) {
-					WriteImageTexture(fph,lightMap,options,true,stage.clamp);
+					WriteImageTexture(out,lightMap,options,true,stage.clamp);
 					hasLightMap = true;
 					mShader->mLightMapStage=lightMapStage=i;
 				} else 
-					WriteImageTexture(fph,stage.map,options,false,stage.clamp);
+					WriteImageTexture(out,stage.map,options,false,stage.clamp);
 			}
 		  }	
 		  else 
 		  { // no shader
-			//WriteImageTexture(fph,name,options,false);
+			//WriteImageTexture(out,name,options,false);
 			if (options.useMultiTexturing) {
 				if (hasLightMap) {
-					WriteImageTexture(fph,lightMap,options,true,false);
+					WriteImageTexture(out,lightMap,options,true,false);
 				}
 			}
-			WriteImageTexture(fph,name,options,false);
+			WriteImageTexture(out,name,options,false);
 
 		  }	
 		  } 
@@ -622,23 +1421,23 @@ void VertexSection::SaveVRML2(FILE *fph,VFormatOptions &options)
 					if (mShader) 
 					    mShader ->GetBaseTexture(name);
 
-					WriteImageTexture(fph,name,options,false);
+					WriteImageTexture(out,name,options,false);
 
 			  } else {	
 				if (hasLightMap) {
-					WriteImageTexture(fph,lightMap,options,true,false);
+					WriteImageTexture(out,lightMap,options,true,false);
 				}
-				else WriteImageTexture(fph,"nomap",options,true,false);
+				else WriteImageTexture(out,"nomap",options,true,false);
 			  }	
 
 		  }	
 		  if (options.useMultiTexturing) {
-			  fprintf(fph,"]");
+			  out.Put("]");
 			  // add makes it to bright
 			  // with modulate currently to dark
 			  //if (numStages>1) 
 			  if (mShader) {
-				fprintf(fph,"mode [ ");
+				out.Put("mode [ ");
 				bool hasTcMod = false;
 
 				for (int i=0; i<numStages; i++) {
@@ -646,28 +1445,23 @@ void VertexSection::SaveVRML2(FILE *fph,VFormatOptions &options)
 					//if (i>0 && numStages >2) // we can do only 2 stages 
 					//	i=numStages-1;
 					const ShaderStage& stage = mShader->GetStage(i);
-					const char *mode = stage.textureBlendMode;
+					ShaderTextureMode mode = stage.blendMode;
 					
 					if (stage.tcmod.length()>0) hasTcMod = true;
 					if (stage.tcmodOk.length()>0) hasTcMod = true;
 
-					if (i==0 && stage.textureBlendMode == String("ADD") && !stage.isLightMap)
-						mode = "MODULATE";
-
-					if (!mode) {
-						if (i==0 && !options.useMat) 
-							mode = "REPLACE";
-					}	
+					if (i==0 && mode == STM_ADD && !stage.isLightMap)
+						mode = STM_MODULATE;
 
-					fprintf(fph,"\"%s\" ", mode ? mode : "ADD");
-					fprintf(fph,"# blend %s %s \n",(const char *) stage.blendFuncSrc,(const char *) stage.blendFuncDst);
+					out.Print("\"%s\" ", GetTextureModeName(mode));
+					out.Print("# blend %s %s \n",(const char *) stage.blendFuncSrc,(const char *) stage.blendFuncDst);
 
 				}
-				fprintf(fph,"]\n");
+				out.Put("]\n");
 
 				// tcmod 
 				if (hasTcMod) {
-				fprintf(fph,"textureTransform [ ");
+				out.Put("textureTransform [ ");
 
 				for (int i=0; i<numStages; i++) {
 				
@@ -678,54 +1472,100 @@ void VertexSection::SaveVRML2(FILE *fph,VFormatOptions &options)
 					const char *modeOk = stage.tcmodOk.c_str();
 
 					if (stage.tcmod.length()>0 || stage.tcmodOk.length()>0 ) {
-					   fprintf(fph,"DEF TC%d TcMod {\n",i);
+					   out.Print("DEF TC%d TcMod {\n",i);
 
 					   if (stage.tcmodOk.length()>0)
-						   fprintf(fph,"\t%s\n", modeOk);
+						   out.Print("\t%s\n", modeOk);
 
 					   if (stage.tcmod.length()>0) 
-						   fprintf(fph,"\tmode \"%s\" \n",mode ? mode : "" );
+						   out.Print("\tmode \"%s\" \n",mode ? mode : "" );
 
-					   //fprintf(fph,"ROUTE TIMER.fraction_changed TO TC%d.set_fraction \n",i);
-					   fprintf(fph,"ROUTE TIMER.time_changed TO TC%d.set_time\n",i);
-					   fprintf(fph,"}\n");
+					   //out.Print("ROUTE TIMER.fraction_changed TO TC%d.set_fraction \n",i);
+					   out.Print("ROUTE TIMER.time_changed TO TC%d.set_time\n",i);
+					   out.Put("}\n");
 					}
-					else  fprintf(fph,"NULL\n");
+					else  out.Put("NULL\n");
 
 				}
-				fprintf(fph,"]\n");
+				out.Put("]\n");
 				}
 
 			  } 
 			  else {
 				  if (hasLightMap)
-					  fprintf(fph, "%s", options.blendMode);
+					  out.Print( "%s", options.blendMode);
 				  else ; // MODULATE 
 			  }					
-			  fprintf(fph,"}");
+			  out.Put("}");
 		  }	// multi texture 
 		  
-		  fprintf(fph,"}\n");
+		  out.Put("}\n");
   }	
 
-  int tcount = mIndices.size()/3;
+  defs.lightMapStage = lightMapStage;
+  defs.lodDef = lodDef;
+  defs.tex1 = options.tex1;
+}
+
+// the geometry of the section, with the coarser LOD levels.  Only reads
+// shared state, so sections can be written concurrently.
+void VertexSection::SaveGeometryVRML2(TextWriter &out,const VFormatOptions &options,const SectionDefs &defs) const
+{
+  const IntVector &lodLevels = defs.lodLevels;
+  int levels = (int)lodLevels.size();
+  int lodDef = defs.lodDef;
+
+  UIntVector scratchIndices;
+  SaveFaceSetVRML2(out,GetLodIndices(0,scratchIndices));
+
+  mPoints.SaveVRML2(out,options,defs);
+
+  out.Put("  }\n");
+  out.Put("}\n");
+
+  // the coarser levels share appearance, coordinates, texture coordinates
+  // and colors with the finest one.
+  for (int lod=1; lod<levels; lod++)
+  {
+    out.Put("Shape {\n");
+    out.Print("appearance USE %s\n",defs.appearance);
+    SaveFaceSetVRML2(out,GetLodIndices(lodLevels[lod],scratchIndices));
+    out.Print("coord USE _LC%d\n",lodDef);
+    if (options.useMultiTexturing || options.noTextureCoordinates)
+      out.Print("texCoord USE _LT%d\n",lodDef);
+    out.Print("\tcolor USE _LK%d\n",lodDef);
+    out.Put("  }\n");
+    out.Put("}\n");
+  }
+
+  if ( levels > 1 )
+  {
+    out.Put("]\n}\n");
+  }
+};
+
+// write the IndexedFaceSet header and its coordIndex
+void VertexSection::SaveFaceSetVRML2(TextWriter &out,const UIntVector &indices) const
+{
+  int tcount = indices.size()/3;
 
   // write the indexed face set 
   if ( 1 )
   {
-    fprintf(fph,"geometry  IndexedFaceSet {\n");
+    out.Put("geometry  IndexedFaceSet {\n");
 
-    fprintf(fph,"\tccw FALSE creaseAngle 3.14\n");
+    out.Put("\tccw FALSE creaseAngle 3.14\n");
 
-	if (mShader && (mShader->mCull == StringRef("none") ||  mShader->mCull == StringRef("disable")))  {
-	    fprintf(fph,"\tsolid FALSE\n");
+	ShaderCull cull = mShader ? mShader->mCullMode : SC_FRONT;
+	if (cull == SC_NONE)  {
+	    out.Put("\tsolid FALSE\n");
 	}
-	if (mShader && (mShader->mCull == StringRef("back")))  {
-	    fprintf(fph,"\tccw TRUE\n");
+	if (cull == SC_BACK)  {
+	    out.Put("\tccw TRUE\n");
 	}
-    fprintf(fph,"\tcoordIndex [\n");
+    out.Put("\tcoordIndex [\n");
 
-    UShortVector::iterator j= mIndices.begin();
+    UIntVector::const_iterator j= indices.begin();
     for (int i=0; i<tcount; i++)
     {
       int i1 = *j;
@@ -734,18 +1574,17 @@ void VertexSection::SaveVRML2(FILE *fph,VFormatOptions &options)
       j++;
       int i3 = *j;
       j++;
-      if ( i == (tcount-1) )
-        fprintf(fph,"\t%d,%d,%d,-1]\n",i1,i2,i3);
-      else
-        fprintf(fph,"\t%d,%d,%d,-1,\n",i1,i2,i3);
+      out.Put("\t");
+      out.PutInts(i1,i2,i3,",");
+      out.Put( i == (tcount-1) ? ",-1]\n" : ",-1,\n" );
 
     }
   }
 
   if ( 0 ) // if texCoord index == ccordIndex no need to export
   {
-    fprintf(fph,"  textureCoordIndex [\n");
-    UShortVector::iterator j= mIndices.begin();
+    out.Put("  textureCoordIndex [\n");
+    UIntVector::const_iterator j= indices.begin();
     for (int i=0; i<tcount; i++)
     {
       int i1 = *j;
@@ -754,49 +1593,47 @@ void VertexSection::SaveVRML2(FILE *fph,VFormatOptions &options)
       j++;
       int i3 = *j;
       j++;
-      if ( i == (tcount-1) )
-        fprintf(fph,"\t%d,%d,%d,-1]\n",i1,i2,i3);
-      else
-        fprintf(fph,"\t%d,%d,%d,-1,\n",i1,i2,i3);
+      out.Put("\t");
+      out.PutInts(i1,i2,i3,",");
+      out.Put( i == (tcount-1) ? ",-1]\n" : ",-1,\n" );
     }
   }
-
-  mPoints.SaveVRML2(fph,lightMapStage,options);
-
-  fprintf(fph,"  }\n");
-  fprintf(fph,"}\n");
-};
+}
 
 
-void VertexPool::SaveVRML2(FILE *fph, int lightMapStage, VFormatOptions &options)
+void VertexPool::SaveVRML2(TextWriter &out, const VFormatOptions &options,const SectionDefs &defs) const
 {
+  int lightMapStage = defs.lightMapStage;
+  int lodDef = defs.lodDef;
   
   if ( 1 )
   {
-    fprintf(fph,"coord Coordinate {\npoint [\n\t");
+    if (lodDef >= 0) out.Print("coord DEF _LC%d Coordinate {\npoint [\n\t",lodDef);
+    else out.Put("coord Coordinate {\npoint [\n\t");
     int count = mVtxs.size();
     for (int i=0; i<count; i++)
     {
       const LightMapVertex &vtx = mVtxs[i];
 	  
 	  if (i>0) { 
-			fprintf(fph,",\n\t");
+			out.Put(",\n\t");
 	  }		
 	   
       if (options.yzFlip)
-		  fprintf(fph,options.VFORMAT,vtx.mPos.x,vtx.mPos.z,vtx.mPos.y);
-      else fprintf(fph,options.VFORMAT,vtx.mPos.x,vtx.mPos.y,vtx.mPos.z);
+		  out.PutFloats(options.VFORMAT,vtx.mPos.x,vtx.mPos.z,vtx.mPos.y);
+      else out.PutFloats(options.VFORMAT,vtx.mPos.x,vtx.mPos.y,vtx.mPos.z);
 
     }
-    fprintf(fph,"\n]\n}\n");
+    out.Put("\n]\n}\n");
   }
 
   if (options.useMultiTexturing) { // PROPOSAL MultiTextureCoodinate 
-    fprintf(fph,"texCoord  MultiTextureCoordinate {\ncoord [\n\t");
+    if (lodDef >= 0) out.Print("texCoord DEF _LT%d MultiTextureCoordinate {\ncoord [\n\t",lodDef);
+    else out.Put("texCoord  MultiTextureCoordinate {\ncoord [\n\t");
     int count = mVtxs.size();
 
 	// channel 0
-    fprintf(fph,"\tTextureCoordinate {\npoint [\n\t");
+    out.Put("\tTextureCoordinate {\npoint [\n\t");
 
 
     for (int i=0; i<count; i++)
@@ -804,44 +1641,45 @@ void VertexPool::SaveVRML2(FILE *fph, int lightMapStage, VFormatOptions &options
       const LightMapVertex &vtx = mVtxs[i];
 
 	  if (i>0) { 
-			if ( (i%4) == 0) fprintf(fph,",\n\t");
-			else fprintf(fph,",");
+			if ( (i%4) == 0) out.Put(",\n\t");
+			else out.Put(",");
 	  }		
       if (lightMapStage == 0)
-		  fprintf(fph,options.TFORMAT,vtx.mTexel2.x,1.0f-vtx.mTexel2.y);
-      else fprintf(fph,options.TFORMAT,vtx.mTexel1.x,1.0f-vtx.mTexel1.y);
+		  out.PutFloats(options.TFORMAT,vtx.mTexel2.x,1.0f-vtx.mTexel2.y);
+      else out.PutFloats(options.TFORMAT,vtx.mTexel1.x,1.0f-vtx.mTexel1.y);
 
     }
-    fprintf(fph,"\n]\n}\n");
+    out.Put("\n]\n}\n");
 	
 	//if (lightMapStage == 1) 
 	{
 
 	// channel 1
-	fprintf(fph,"\tTextureCoordinate {\npoint [\n\t");
+	out.Put("\tTextureCoordinate {\npoint [\n\t");
 
     for (int i=0; i<count; i++)
     {
       const LightMapVertex &vtx = mVtxs[i];
 
 	  if (i>0) { 
-			if ( (i%4) == 0) fprintf(fph,",\n\t");
-			else fprintf(fph,",");
+			if ( (i%4) == 0) out.Put(",\n\t");
+			else out.Put(",");
 	  }		
       if (lightMapStage == 1)
-		  fprintf(fph,options.TFORMAT,vtx.mTexel2.x,1.0f-vtx.mTexel2.y);
-      else fprintf(fph,options.TFORMAT,vtx.mTexel1.x,1.0f-vtx.mTexel1.y);
+		  out.PutFloats(options.TFORMAT,vtx.mTexel2.x,1.0f-vtx.mTexel2.y);
+      else out.PutFloats(options.TFORMAT,vtx.mTexel1.x,1.0f-vtx.mTexel1.y);
 	}
-    fprintf(fph,"\n\t]\n}\n");
+    out.Put("\n\t]\n}\n");
 	
 	}
-    fprintf(fph,"\n]\n}\n");
+    out.Put("\n]\n}\n");
 
 
   } else	
   if ( options.noTextureCoordinates )
   {
-    fprintf(fph,"texCoord  TextureCoordinate {\npoint [\n\t");
+    if (lodDef >= 0) out.Print("texCoord DEF _LT%d TextureCoordinate {\npoint [\n\t",lodDef);
+    else out.Put("texCoord  TextureCoordinate {\npoint [\n\t");
     int count = mVtxs.size();
 
     for (int i=0; i<count; i++)
@@ -849,21 +1687,21 @@ void VertexPool::SaveVRML2(FILE *fph, int lightMapStage, VFormatOptions &options
       const LightMapVertex &vtx = mVtxs[i];
 
 	  if (i>0) {
-			if ( (i%4) == 0) fprintf(fph,",\n\t");
-			else fprintf(fph,",");
+			if ( (i%4) == 0) out.Put(",\n\t");
+			else out.Put(",");
 	  }		
 
 
-      if ( !options.tex1 ) // if saving second U/V channel.
+      if ( !defs.tex1 ) // if saving second U/V channel.
       {
-         fprintf(fph,options.TFORMAT,vtx.mTexel2.x,1.0f-vtx.mTexel2.y);
+         out.PutFloats(options.TFORMAT,vtx.mTexel2.x,1.0f-vtx.mTexel2.y);
       }
       else
       {
-          fprintf(fph,options.TFORMAT,vtx.mTexel1.x,1.0f-vtx.mTexel1.y);
+          out.PutFloats(options.TFORMAT,vtx.mTexel1.x,1.0f-vtx.mTexel1.y);
       }
     }
-    fprintf(fph,"\n]\n}\n");
+    out.Put("\n]\n}\n");
 
   }
 
@@ -871,7 +1709,8 @@ void VertexPool::SaveVRML2(FILE *fph, int lightMapStage, VFormatOptions &options
    {
     int count = mVtxs.size();
 	// channel 0
-    fprintf(fph,"\tcolor Color {\ncolor [\n\t");
+    if (lodDef >= 0) out.Print("\tcolor DEF _LK%d Color {\ncolor [\n\t",lodDef);
+    else out.Put("\tcolor Color {\ncolor [\n\t");
 
 
     for (int i=0; i<count; i++)
@@ -879,12 +1718,12 @@ void VertexPool::SaveVRML2(FILE *fph, int lightMapStage, VFormatOptions &options
       const LightMapVertex &vtx = mVtxs[i];
 
 	  if (i>0) { 
-			if ( (i%4) == 0) fprintf(fph,",\n\t");
-			else fprintf(fph,",");
+			if ( (i%4) == 0) out.Put(",\n\t");
+			else out.Put(",");
 	  }		
-      fprintf(fph,options.CFORMAT,vtx.mColor.x,vtx.mColor.y,vtx.mColor.z);
+      out.PutFloats(options.CFORMAT,vtx.mColor.x,vtx.mColor.y,vtx.mColor.z);
 
     }
-    fprintf(fph,"\n]\n}\n");
+    out.Put("\n]\n}\n");
    }
 }
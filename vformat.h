@@ -24,9 +24,20 @@
 #include "vector.h"
 #include "stringdict.h"
 #include "rect.h"
+#include "textwriter.h"
 
 
 class QuakeShader;
+class GltfWriter;
+
+// check basename for texture, and return the jpg, png .. file to use.
+// A tga is converted to png on a background thread, the png name is
+// returned right away; call WaitForTextures before the files are used.
+void CheckTexture(const char *baseName, String &textureFileName);
+
+// threads for the conversions, 0 means one per core
+void SetTextureJobs(int jobs);
+void WaitForTextures(void);
 
 // mapping a shader texture to VRML ImageTexture DEF Name 
 typedef std::map< StringRef, StringRef > TextureDefMap;
@@ -48,9 +59,11 @@ public :
 	// for creting DEF names 
 	int appearanceCount;
 	int textureCount;
+	int lodCount;
 
 
 	bool vrml2;			// want VRML 2 output 
+	bool glb;			// want binary glTF 2.0 output 
 	bool verbose;		// want verbose output
 
 	bool useMultiTexturing; // emit VRML Contact 3D MultiTexture proposed nodes
@@ -73,6 +86,10 @@ public :
 	// printf format for vertex colors
 	const char * CFORMAT;
 
+	// FLOAT_FORMAT to print floats as the formats above say,
+	// FLOAT_SHORTEST or a fixed number of decimals (see textwriter.h)
+	int floatMode;
+
 	// the default light map blending mode 
 	const char *blendMode;
 	const char *stage0Mode;
@@ -80,14 +97,47 @@ public :
 
 	bool matDefined;
 
+	// threads used to write the sections, 0 means one per core
+	int jobs;
+
+	// sections with more vertices than this are written as several shapes,
+	// 0 means never split.  65536 keeps every index within 16 bits.
+	int maxSectionVertices;
+
+	// geometric error tolerance of each patch LOD level, finest first.
+	// Empty means a single level at the default tolerance.
+	FloatVector patchLods;
+
+	// reorder the triangles of every section for a vertex cache of this
+	// many entries, 0 keeps the BSP order.
+	int vertexCacheSize;
+
+	// VertexSection::Simplify with these, a ratio of 1 and no error bound
+	// keeps every triangle.
+	float simplifyRatio;
+	float simplifyError;
+
+	// a coarser LOD level is shown from the distance at which the error
+	// tolerance of that level spans this angle (radians).
+	float lodScreenError;
+
 	VFormatOptions() {
 		appearanceCount=0;
+		maxSectionVertices=0;
+		vertexCacheSize=0;
+		simplifyRatio=1;
+		simplifyError=0;
 		textureCount=0;
+		lodCount=0;
+		lodScreenError=0.01f;
 		matDefined = false;
+		jobs=0;
 
 		vrml2=true;
+		glb=false;
 		verbose=false;
 		useBsp=false;
+		noTextureCoordinates=false;
 
 		useEffects=true;
 
@@ -104,6 +154,7 @@ public :
 		VFORMAT = "%g %g %g";
 		TFORMAT  = "%g %g";
 		CFORMAT = "%.3f %.3f %.3f";
+		floatMode = FLOAT_FORMAT;
 
 		useMat = true;
 
@@ -119,6 +170,17 @@ public :
 
 	};
 
+	// every setting that changes what is written, as text, so that a run
+	// can tell whether an earlier run wrote the same.
+	String GetSignature(void) const;
+
+	// distance from which LOD level 'lod' (1 or more) replaces the finer one
+	float GetLodRange(int lod) const
+	{
+		float error = lod < (int)patchLods.size() ? patchLods[lod] : 0.0f;
+		return error / lodScreenError;
+	}
+
 	// map from quake to float coordinates 
 	void MapVertex (float v[3]) 
 	{
@@ -205,48 +267,56 @@ public:
 
 typedef std::vector< LightMapVertex > VertexVector;
 
-class VertexLess
+// Triangles carry a mask of the LOD levels they belong to, bit k for level
+// k.  Only tessellated patches differ between levels, everything else is
+// in all of them.
+#define LOD_ALL 0xFF
+#define MAX_LOD_LEVELS 8
+
+// what the appearance part of a VRML 2 section decided for its geometry
+class SectionDefs
 {
 public:
-
-	bool operator()(int v1,int v2) const;
-
-  static void SetSearch(const LightMapVertex& match,VertexVector *list)
+  int       lightMapStage;  // texture stage of the lightmap coordinates
+  int       lodDef;         // number of the DEF'd LOD nodes, -1 if none
+  bool      tex1;           // U/V channel #1 when there is just one
+  char      appearance[60]; // DEF name of the appearance
+  IntVector lodLevels;      // the LOD levels written
+
+  // the geometry written with these and with 'other' is the same text
+  bool SameGeometry(const SectionDefs &other,const VFormatOptions &options) const
   {
-    mFind = match;
-    mList = list;
+    return lodDef == other.lodDef && lightMapStage == other.lightMapStage &&
+           (tex1 == other.tex1 || !options.noTextureCoordinates);
   };
-
-private:
-  const LightMapVertex& Get(int index) const
-  {
-    if ( index == -1 ) return mFind;
-	  VertexVector &vlist = *mList;
-    return vlist[index];
-  }
-  static LightMapVertex mFind; // vertice to locate.
-  static VertexVector  *mList;
 };
 
-typedef std::set<int, VertexLess > VertexSet;
-
 class VertexPool
 {
 public:
+  VertexPool(void)
+  {
+    mMask = 0;
+  };
 
+  // index of a vertex equal to vtx, adding it if there is none yet.
+  // Vertices are welded when all 7 position and texel floats compare equal.
   int GetVertex(const LightMapVertex& vtx)
   {
-    VertexLess::SetSearch(vtx,&mVtxs);
-    VertexSet::iterator found;
-    found = mVertSet.find( -1 );
-    if ( found != mVertSet.end() )
+    if ( (mVtxs.size()+1)*2 > mTable.size() ) Grow();
+
+    unsigned int slot = Hash(vtx) & mMask;
+    while ( 1 )
     {
-      return *found;
+      int found = mTable[slot];
+      if ( found < 0 ) break;
+      if ( Same(mVtxs[found],vtx) ) return found;
+      slot = (slot+1) & mMask; // linear probing
     }
+
     int idx = mVtxs.size();
-    assert( idx >= 0 && idx < 65536 );
     mVtxs.push_back( vtx );
-    mVertSet.insert( idx );
+    mTable[slot] = idx;
     return idx;
   };
 
@@ -267,7 +337,8 @@ public:
 
   void Clear(int reservesize)  // clear the vertice pool.
   {
-    mVertSet.clear();
+    mTable.clear();
+    mMask = 0;
     mVtxs.clear();
     mVtxs.reserve(reservesize);
   };
@@ -291,11 +362,66 @@ public:
   };
 
 
-  void SaveVRML(FILE *fph,bool tex1);
-  void SaveVRML2(FILE *fph,int lightMapStage, VFormatOptions &options);
+  // the Coordinate3 and the TextureCoordinate2 of a U/V channel
+  void SaveCoordinatesVRML(TextWriter &out) const;
+  void SaveTextureCoordinatesVRML(TextWriter &out,bool tex1) const;
+
+  // defs.lodDef >= 0 DEFs the nodes so that coarser LOD levels can USE them.
+  void SaveVRML2(TextWriter &out,const VFormatOptions &options,const SectionDefs &defs) const;
 
 private:
-  VertexSet      mVertSet; // ordered list.
+  // float bits of the welded components, with -0 folded onto +0 so that
+  // values which compare equal also hash equal.
+  static unsigned int Bits(float f)
+  {
+    f += 0.0f;
+    unsigned int u;
+    memcpy(&u,&f,sizeof(u));
+    return u;
+  };
+
+  static unsigned int Hash(const LightMapVertex &v)
+  {
+    unsigned int h = 2166136261u;
+    const float comp[7] = { v.mPos.x, v.mPos.y, v.mPos.z,
+                            v.mTexel1.x, v.mTexel1.y,
+                            v.mTexel2.x, v.mTexel2.y };
+    for (int i=0; i<7; i++)
+    {
+      h ^= Bits(comp[i]);
+      h *= 0x9E3779B1u;
+      h ^= h >> 15;
+    }
+    return h;
+  };
+
+  static bool Same(const LightMapVertex &a,const LightMapVertex &b)
+  {
+    return a.mPos.x == b.mPos.x &&
+           a.mPos.y == b.mPos.y &&
+           a.mPos.z == b.mPos.z &&
+           a.mTexel1.x == b.mTexel1.x &&
+           a.mTexel1.y == b.mTexel1.y &&
+           a.mTexel2.x == b.mTexel2.x &&
+           a.mTexel2.y == b.mTexel2.y;
+  };
+
+  // double the table and re-insert, keeps the load factor at or below 1/2.
+  void Grow(void)
+  {
+    size_t size = mTable.size() ? mTable.size()*2 : 64;
+    mTable.assign(size,-1);
+    mMask = (unsigned int)(size-1);
+    for (size_t i=0; i<mVtxs.size(); i++)
+    {
+      unsigned int slot = Hash(mVtxs[i]) & mMask;
+      while ( mTable[slot] >= 0 ) slot = (slot+1) & mMask;
+      mTable[slot] = (int)i;
+    }
+  };
+
+  IntVector      mTable; // open addressing hash of indices into mVtxs, -1 = empty.
+  unsigned int   mMask;  // mTable.size()-1, the size is a power of two.
   VertexVector   mVtxs;  // set of vertices.
 };
 
@@ -312,11 +438,53 @@ public:
 
   void AddTri(const LightMapVertex &v1,
               const LightMapVertex &v2,
-              const LightMapVertex &v3);
+              const LightMapVertex &v3,
+              unsigned char lods=LOD_ALL);
+
+
+  // VRML 1 of U/V channel #1 to out1 and of channel #2 to out2, the
+  // parts both have in common formatted once.
+  void SaveVRML(TextWriter &out1,TextWriter &out2,int item1,int item2) const;
+  void SaveVRML2(TextWriter &out,VFormatOptions &options);
+
+  // the two halves of SaveVRML2.  The appearance part must be done in file
+  // order, the geometry part can be done by several threads at once.
+  void SaveAppearanceVRML2(TextWriter &out,VFormatOptions &options,SectionDefs &defs);
+  void SaveGeometryVRML2(TextWriter &out,const VFormatOptions &options,const SectionDefs &defs) const;
+  void SaveGLB(GltfWriter &glb,VFormatOptions &options) const;
+
+  // the LOD levels that differ from the next finer one, level 0 first.
+  // Just level 0 if no triangle is limited to some levels.
+  void GetLodLevels(IntVector &levels) const;
+
+  // indices of the triangles in LOD level 'lod'.  Returns mIndices itself
+  // when every triangle is in every level, else fills and returns scratch.
+  const UIntVector& GetLodIndices(int lod,UIntVector &scratch) const;
+
+  // append all triangles of 'other', in order.
+  void Merge(const VertexSection &other);
 
+  // cut the section into new sections of at most maxVertices vertices each,
+  // keeping the triangle order.  The caller owns the parts.
+  void Split(int maxVertices,std::vector< VertexSection * > &parts) const;
 
-  void SaveVRML(FILE *fph,bool tex1);
-  void SaveVRML2(FILE *fph,VFormatOptions &options);
+  int GetVertexCount(void) const { return mPoints.GetVertexCount(); };
+  int GetTriangleCount(void) const { return mIndices.size()/3; };
+
+  // reorder the triangles for a post-transform vertex cache of cacheSize
+  // entries, then the vertices to the order the triangles first use them.
+  // The misses of a FIFO cache of that size before and after.
+  void OptimizeVertexCache(int cacheSize,int &missesBefore,int &missesAfter);
+
+  static int CountCacheMisses(const UIntVector &indices,int cacheSize);
+
+  // collapse edges by quadric error until ratio of the triangles is left
+  // or the next collapse would cost more than maxError (a distance, 0 for
+  // no bound).  Ratio 1 with a bound collapses as far as the bound allows.
+  // Vertices on the section border, on U/V seams of either channel and
+  // at shared positions stay put, and every vertex that is left keeps its
+  // own U/Vs.  Returns the triangles left.
+  int Simplify(float ratio,float maxError);
 
   void SetShader(QuakeShader	*shader) { mShader = shader; }
   QuakeShader* GetShader(QuakeShader	*shader) { return mShader; }
@@ -324,15 +492,25 @@ public:
 private:
 
   void AddPoint(const LightMapVertex &p);
+  void AddLods(unsigned char lods); // after the points of a triangle
+
+  void SaveFaceSetVRML2(TextWriter &out,const UIntVector &indices) const;
+
+  // replace the triangles, indices into mPoints.  The vertices are
+  // renumbered in the order of first use, unused ones are dropped.
+  void SetTriangles(UIntVector &indices,UCharVector &lods);
 
   StringRef     mName;
   Rect3d<float> mBound;
-  UShortVector  mIndices;
+  UIntVector    mIndices;
+  UCharVector   mTriLods; // LOD mask per triangle, empty while all are LOD_ALL
   VertexPool    mPoints;
   QuakeShader	*mShader; // tmp pointer to shader 
 };
 
-typedef std::map< StringRef, VertexSection * > VertexSectionMap;
+// by name text: string table addresses depend on the heap layout, which
+// differs with the number of threads building the mesh.
+typedef std::map< StringRef, VertexSection *, StringRefLess > VertexSectionMap;
 
 
 
@@ -350,14 +528,50 @@ public:
   void AddTri(const StringRef &name,
               const LightMapVertex &v1,
               const LightMapVertex &v2,
-              const LightMapVertex &v3);
+              const LightMapVertex &v3,
+              unsigned char lods=LOD_ALL);
 
-  void SaveVRML(const String &name,  // base file name
-                bool tex1) const;          // texture channel 1=(true)
+  // VRML 1 of U/V channel #1 into name1.wrl and of channel #2 into
+  // name2.wrl, in one pass.
+  void SaveVRML(const String &name1,
+                const String &name2,
+                int maxSectionVertices=0) const; // split larger sections, 0=never
 
    void SaveVRML2(FILE *fph,
                  VFormatOptions &options) const;   
 
+  // VRML 2 into two files at once, U/V channel #1 into fph1 and channel #2
+  // without material into fph2.  The second file continues the DEF names
+  // of the first, and leaves options as if it had been written after it.
+  void SaveVRML2(FILE *fph1,
+                 FILE *fph2,
+                 VFormatOptions &options) const;
+
+  // binary glTF 2.0 into name.glb, one mesh per section.
+  bool SaveGLB(const String &name,VFormatOptions &options) const;
+
+  // VertexSection::OptimizeVertexCache on every section, on up to 'jobs'
+  // threads.  Adds the triangles and the cache misses to the counts.
+  void OptimizeVertexCache(int cacheSize,int jobs,int &triangles,
+                           int &missesBefore,int &missesAfter);
+
+  // VertexSection::Simplify on every section, on up to 'jobs' threads.
+  // Adds the triangles before and after to the counts.
+  void Simplify(float ratio,float maxError,int jobs,int &before,int &after);
+
+  // append all sections of a partial mesh.  Merging the parts of a mesh in
+  // the order they were split gives the same result as building it whole.
+  void Merge(const VertexMesh &part);
+
+  VertexSection * FindSection(const StringRef &name) const;
+
+  // the sections in output order, the ones with more than maxVertices
+  // vertices replaced by their parts, which are also added to 'parts' for
+  // the caller to delete.
+  void GetSections(int maxVertices,
+                   std::vector< VertexSection * > &sections,
+                   std::vector< VertexSection * > &parts) const;
+
 
    // current section in progress 
    VertexSection   *mLastSection;
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <chrono>
+
+//############################################################################
+//##                                                                        ##
+//##  VPBENCH.CPP                                                           ##
+//##                                                                        ##
+//##  Microbenchmark of the hashed VertexPool against the ordered set based ##
+//##  pool it replaced.  Welds the corners of a large grid of quads, so     ##
+//##  most lookups hit a vertex that already exists.                        ##
+//##                                                                        ##
+//##  No warranty expressed or implied.                                     ##
+//##                                                                        ##
+//##  Part of the Q3BSP project, which converts a Quake 3 BSP file into a   ##
+//##  polygon mesh.                                                         ##
+//############################################################################
+
+#include "vformat.h"
+
+// the previous pool : a std::set of indices ordered by the vertex they
+// refer to.  Only kept here as the reference for the benchmark.
+class SetVertexPool
+{
+public:
+  class Less
+  {
+  public:
+    Less(const SetVertexPool *pool) { mPool = pool; };
+
+    bool operator()(int a,int b) const
+    {
+      const LightMapVertex &v1 = Get(a);
+      const LightMapVertex &v2 = Get(b);
+
+      const float comp1[7] = { v1.mPos.x, v1.mPos.y, v1.mPos.z, v1.mTexel1.x, v1.mTexel1.y, v1.mTexel2.x, v1.mTexel2.y };
+      const float comp2[7] = { v2.mPos.x, v2.mPos.y, v2.mPos.z, v2.mTexel1.x, v2.mTexel1.y, v2.mTexel2.x, v2.mTexel2.y };
+      for (int i=0; i<7; i++)
+      {
+        if ( comp1[i] < comp2[i] ) return true;
+        if ( comp1[i] > comp2[i] ) return false;
+      }
+      return false;
+    };
+
+  private:
+    const LightMapVertex& Get(int idx) const
+    {
+      return idx < 0 ? mPool->mFind : mPool->mVtxs[idx];
+    };
+
+    const SetVertexPool *mPool;
+  };
+
+  SetVertexPool(void) : mVertSet(Less(this))
+  {
+  };
+
+  int GetVertex(const LightMapVertex& vtx)
+  {
+    mFind = vtx;
+    std::set<int,Less>::iterator found = mVertSet.find(-1);
+    if ( found != mVertSet.end() ) return *found;
+    int idx = mVtxs.size();
+    mVtxs.push_back( vtx );
+    mVertSet.insert( idx );
+    return idx;
+  };
+
+  LightMapVertex       mFind;
+  VertexVector         mVtxs;
+  std::set<int,Less>   mVertSet;
+};
+
+// corners of a grid of quads, two triangles each, like a patch or brush
+// face would feed them to a VertexSection.
+static void MakeGrid(int size,VertexVector &verts)
+{
+  static const int corner[6][2] = { {0,0}, {1,0}, {1,1}, {0,0}, {1,1}, {0,1} };
+  verts.clear();
+  verts.reserve(size*size*6);
+  for (int y=0; y<size; y++)
+  {
+    for (int x=0; x<size; x++)
+    {
+      for (int c=0; c<6; c++)
+      {
+        float u = (float)(x+corner[c][0]);
+        float v = (float)(y+corner[c][1]);
+        verts.push_back( LightMapVertex(u*16.0f,v*16.0f,(float)((x^y)&7),
+                                        u*0.125f,v*0.125f,u/size,v/size) );
+      }
+    }
+  }
+}
+
+template <class Pool> static double Weld(const VertexVector &verts,IntVector &indices,int &unique)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  Pool pool;
+  indices.resize(verts.size());
+  for (size_t i=0; i<verts.size(); i++)
+  {
+    indices[i] = pool.GetVertex(verts[i]);
+  }
+  unique = 0;
+  for (size_t i=0; i<indices.size(); i++)
+  {
+    if ( indices[i] >= unique ) unique = indices[i]+1;
+  }
+  std::chrono::duration<double> seconds = std::chrono::steady_clock::now()-start;
+  return seconds.count();
+}
+
+int main(int argc,char **argv)
+{
+  int size = 1000;
+  if ( argc > 1 ) size = atoi(argv[1]);
+  if ( size <= 0 )
+  {
+    printf("Usage: vpbench [gridsize]\n");
+    return 1;
+  }
+
+  VertexVector verts;
+  MakeGrid(size,verts);
+  printf("Welding %d vertices of a %dx%d quad grid.\n",(int)verts.size(),size,size);
+
+  IntVector setIndices,hashIndices;
+  int setUnique,hashUnique;
+  double setTime  = Weld<SetVertexPool>(verts,setIndices,setUnique);
+  double hashTime = Weld<VertexPool>(verts,hashIndices,hashUnique);
+
+  printf("std::set pool : %8.3f s  %d unique\n",setTime,setUnique);
+  printf("hashed pool   : %8.3f s  %d unique\n",hashTime,hashUnique);
+  if ( hashTime > 0 ) printf("speedup       : %8.2fx\n",setTime/hashTime);
+
+  if ( setIndices != hashIndices )
+  {
+    printf("ERROR: the pools produced different indices.\n");
+    return 1;
+  }
+  return 0;
+}